@@ -3,4 +3,20 @@ OP (roll)
 OP (pick)
 OP (drop)
 OP (quote)
+/* Arithmetic on the top stack elements, see op_arith.  */
+OP (add)
+OP (sub)
+OP (mul)
+OP (addmul)
+OP (cmp)
+OP (sgn)
+OP (divexact)
+OP (mul_2exp)
+/* Branches and loops, see op_control.  */
+OP (if)
+OP (ifelse)
+OP (loop)
+OP (while)
+/* End the time slice, see thread_run.  */
+OP (yield)
 #undef OP
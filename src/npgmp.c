@@ -12,6 +12,10 @@
    Copyright(C) 2012 John Tobey, see ../LICENCE
 */
 
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200112L  /* for clock_gettime */
+#endif
+
 #include <gmp.h>
 
 /* Break the GMP abstraction just this once. */
@@ -27,6 +31,8 @@ typedef __gmp_randstate_struct* x_gmp_randstate_ptr;
 #include <math.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <stdint.h>
 
 #if __GNUC__
 #define UNUSED __attribute__ ((unused))
@@ -34,12 +40,20 @@ typedef __gmp_randstate_struct* x_gmp_randstate_ptr;
 #define UNLIKELY(x) __builtin_expect ((x) != 0, 0)
 #define LIKELY(x)   __builtin_expect ((x) != 0, 1)
 #define ALWAYS_INLINE __attribute__ ((__always_inline__))
+#define NO_SANITIZE_ADDRESS __attribute__ ((no_sanitize_address))
+#define ATOMIC_ADD(p, n) __sync_add_and_fetch (p, n)
+#define ATOMIC_SUB(p, n) __sync_sub_and_fetch (p, n)
+#define ATOMIC_CAS(p, old, new) __sync_bool_compare_and_swap (p, old, new)
 #else
 #define UNUSED
 #define THREAD_LOCAL1
 #define UNLIKELY(x) (x)
 #define LIKELY(x)   (x)
 #define ALWAYS_INLINE
+#define NO_SANITIZE_ADDRESS
+#define ATOMIC_ADD(p, n) (*(p) += (n))
+#define ATOMIC_SUB(p, n) (*(p) -= (n))
+#define ATOMIC_CAS(p, old, new) (*(p) == (old) ? (*(p) = (new), 1) : 0)
 #endif
 
 #ifndef THREAD_LOCAL
@@ -72,6 +86,21 @@ typedef __gmp_randstate_struct* x_gmp_randstate_ptr;
 #ifndef NPGMP_SCRIPT
 # define NPGMP_SCRIPT 1  /* Provide script interpreter.  */
 #endif
+#ifndef NPGMP_COMPACT
+# define NPGMP_COMPACT NPGMP_SCRIPT  /* Compact the script heap.  */
+#endif
+#ifndef NPGMP_NURSERY
+# define NPGMP_NURSERY NPGMP_COMPACT  /* Allocate young vectors apart.  */
+#endif
+#if NPGMP_NURSERY && !NPGMP_COMPACT
+# error "NPGMP_NURSERY requires NPGMP_COMPACT"
+#endif
+#ifndef NPGMP_MEMORY
+# define NPGMP_MEMORY 1  /* Install our own GMP memory functions.  */
+#endif
+#ifndef NPGMP_SELFTEST
+# define NPGMP_SELFTEST 0  /* Check internals in each new instance.  */
+#endif
 
 #define PLUGIN_NAME        "GMP Arithmetic Library"
 #define PLUGIN_DESCRIPTION PLUGIN_NAME " (EXPERIMENTAL)"
@@ -113,6 +142,8 @@ static NPNetscapeFuncs* sBrowserFuncs;
     sBrowserFuncs->construct (npp, obj, args, argCount, result)
 
 static NPIdentifier ID_toString, ID_length;
+static NPIdentifier ID_next, ID_exponent;
+static NPIdentifier ID_feed, ID_finish;
 /* XXX Let's do valueOf, too. */
 
 
@@ -135,12 +166,57 @@ typedef struct _Class {
     struct _TopObject* top;
 } Class;
 
+/* Per-instance object pools, see below.  */
+#define POOL_GRAIN 16
+#define POOL_CLASSES 8  /* objects of up to POOL_GRAIN * POOL_CLASSES bytes */
+
+typedef struct _Pool {
+    void* free;                /* free list, linked through the objects */
+    union _PoolSlab* slabs;    /* all slabs of this size */
+    size_t in_use;             /* objects allocated and not freed */
+    size_t capacity;           /* objects in all slabs */
+} Pool;
+
+/* Constants from mpz.const and mpz.pow2, see below.  */
+#define MPZ_CONST_MIN (-16)
+#define MPZ_CONST_MAX 256
+#define MPZ_POW2_COUNT 256
+
+/* Recycled numbers, see below.  */
+#define RECYCLE_MAX 16
+
+typedef struct _Recycle {
+    size_t count;
+    size_t bytes;                 /* limb bytes of all bodies */
+    NPObject* body[RECYCLE_MAX];  /* most recently recycled last */
+    size_t body_bytes[RECYCLE_MAX];
+} Recycle;
+
+/* Live objects by type, for gmp.memory().  */
+enum {
+    CENSUS_Integer, CENSUS_Rational, CENSUS_Float, CENSUS_Rand,
+    CENSUS_Tuple, CENSUS_Stack, CENSUS_Root, CENSUS_TYPES
+};
+
+typedef struct _Census {
+    size_t live;
+    size_t peak;  /* maximum of live */
+} Census;
+
 typedef struct _TopObject {
     NPObject    npobj;
     NPP         instance;
     bool        destroying;
     const char* errmsg;
     NPObject*   npobjGmp;
+    Pool        pools[POOL_CLASSES];
+#if NPGMP_MEMORY
+    size_t      gmp_bytes;  /* GMP memory charged to this instance */
+    size_t      gmp_peak;   /* maximum of gmp_bytes */
+    bool        over_quota; /* gmp_bytes exceeded quota in this entry */
+#endif
+    size_t      quota;      /* gmp.set_memory_quota, or 0 */
+    Census      census[CENSUS_TYPES];
 
     Class       Entry;
 #define Entry_getTop(object) GET_TOP (Entry, object)
@@ -154,6 +230,17 @@ typedef struct _TopObject {
     Class       Integer;
 #define Integer_getTop(object) GET_TOP (Integer, object)
 #define TYPE_Integer (offsetof (TopObject, Integer))
+    Recycle     recycled_mpz;
+    size_t      mpz_hint;  /* limbs wanted by the next Integer_allocate */
+    struct _RadixPowers* radix_powers[61];  /* indexed by base - 2 */
+    NPObject*   mpz_const[MPZ_CONST_MAX - MPZ_CONST_MIN + 1];
+    NPObject*   mpz_pow2[MPZ_POW2_COUNT];
+    Class       Digits;
+#define Digits_getTop(object) GET_TOP (Digits, object)
+#define TYPE_Digits (offsetof (TopObject, Digits))
+    Class       Parser;
+#define Parser_getTop(object) GET_TOP (Parser, object)
+#define TYPE_Parser (offsetof (TopObject, Parser))
 #endif
 
 #if NPGMP_MPQ
@@ -163,6 +250,7 @@ typedef struct _TopObject {
     Class       Rational;
 #define Rational_getTop(object) GET_TOP (Rational, object)
 #define TYPE_Rational (offsetof (TopObject, Rational))
+    Recycle     recycled_mpq;
 #endif
 
 #if NPGMP_RAND
@@ -176,6 +264,7 @@ typedef struct _TopObject {
 #define Float_getTop(object) GET_TOP (Float, object)
 #define TYPE_Float (offsetof (TopObject, Float))
     mp_bitcnt_t default_mpf_prec;  /* Emulate mpf_set_default_prec. */
+    Recycle     recycled_mpf;
 #endif
 
 #if NPGMP_SCRIPT
@@ -188,11 +277,482 @@ typedef struct _TopObject {
     Class       Root;
 #define Root_getTop(object) GET_TOP (Root, object)
 #define TYPE_Root (offsetof (TopObject, Root))
+    Class       Op;
+#define Op_getTop(object) GET_TOP (Op, object)
+    NPObject*   npobjOp;  /* the "op" object, if JavaScript holds it */
+    struct _Thread* thread;  /* runs the instance's scripts */
+    Class       SharedString;
+#define SharedString_getTop(object) GET_TOP (SharedString, object)
+#define TYPE_SharedString (offsetof (TopObject, SharedString))
+    void*       strings;  /* live SharedStrings, for tsearch() */
 #endif
 
 } TopObject;
 
 static TopObject* get_top (NPObject* npobj);
+static bool free_recycled (TopObject* top);
+
+#if NPGMP_SCRIPT
+/* Script objects returned to JavaScript are wrapped in Roots, see
+   below.  */
+typedef struct _Root {
+    NPObject npobj;
+    NPObject* payload;
+    struct _Root** prev;
+    struct _Root* next;
+} Root;
+#endif
+
+/* Return the object in *VAR, looking through any Root.  Only tuples
+   and stacks go out in Roots, so the number converters do not need
+   this.  */
+static inline NPObject*
+var_object (TopObject* top, const NPVariant* var)
+{
+    NPObject* npobj = NPVARIANT_TO_OBJECT (*var);
+#if NPGMP_SCRIPT
+    if (npobj->_class == &top->Root.npclass)
+        return ((Root*) npobj)->payload;
+#endif
+    return npobj;
+}
+
+
+/*
+ * Object pools.
+ *
+ * Wrapper objects are small, fixed-size, and often short-lived.  Each
+ * instance carves them from slabs of POOL_SLAB_SIZE bytes, with one
+ * free list per multiple of POOL_GRAIN.  Freed objects return to
+ * their list, and slabs return to the browser only when the TopObject
+ * dies.  Every object retains the TopObject, so by then none remain.
+ */
+
+#ifndef POOL_SLAB_SIZE
+# define POOL_SLAB_SIZE 4096
+#endif
+
+typedef union _PoolSlab {
+    union _PoolSlab* next;
+    char align[POOL_GRAIN];
+} PoolSlab;
+
+static inline size_t
+pool_class (size_t size)
+{
+    return (size - 1) / POOL_GRAIN;
+}
+
+/* Add a slab of objects of SIZE bytes to POOL.  */
+static bool
+pool_grow (Pool* pool, size_t size)
+{
+    size_t osize = (pool_class (size) + 1) * POOL_GRAIN;
+    size_t count = (POOL_SLAB_SIZE - sizeof (PoolSlab)) / osize;
+    PoolSlab* slab = (PoolSlab*) NPN_MemAlloc (POOL_SLAB_SIZE);
+    char* obj;
+
+    if (!slab)
+        return false;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->capacity += count;
+
+    /* Thread the new objects onto the free list, lowest first.  */
+    obj = (char*) (slab + 1) + count * osize;
+    while (count--) {
+        obj -= osize;
+        *(void**) obj = pool->free;
+        pool->free = obj;
+    }
+    return true;
+}
+
+/* Allocate SIZE bytes as NPN_MemAlloc would, from TOP's pools if
+   SIZE is small.  */
+static void*
+pool_alloc (TopObject* top, size_t size)
+{
+    Pool* pool;
+    void* ret;
+
+    if (pool_class (size) >= POOL_CLASSES) {
+        ret = NPN_MemAlloc (size);
+        if (!ret && free_recycled (top))
+            ret = NPN_MemAlloc (size);
+        return ret;
+    }
+
+    pool = &top->pools[pool_class (size)];
+    if (!pool->free && !pool_grow (pool, size)) {
+        /* Recycled numbers may hold the memory we need.  */
+        free_recycled (top);
+        if (!pool->free && !pool_grow (pool, size))
+            return 0;
+    }
+    ret = pool->free;
+    pool->free = *(void**) ret;
+    pool->in_use++;
+    return ret;
+}
+
+/* Free PTR of SIZE bytes from pool_alloc.  */
+static void
+pool_free (TopObject* top, void* ptr, size_t size)
+{
+    Pool* pool;
+
+    if (pool_class (size) >= POOL_CLASSES) {
+        NPN_MemFree (ptr);
+        return;
+    }
+    pool = &top->pools[pool_class (size)];
+    *(void**) ptr = pool->free;
+    pool->free = ptr;
+    pool->in_use--;
+}
+
+/* Count an object of type T, a CENSUS_ constant, as born or died.  */
+static inline void
+census_born (TopObject* top, int t)
+{
+    if (++top->census[t].live > top->census[t].peak)
+        top->census[t].peak = top->census[t].live;
+}
+
+static inline void
+census_died (TopObject* top, int t)
+{
+    top->census[t].live--;
+}
+
+static void
+free_pools (TopObject* top)
+{
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        Pool* pool = &top->pools[i];
+#if DEBUG_ALLOC
+        if (pool->in_use)
+            fprintf (stderr, "pool %d: %lu objects leaked\n", i,
+                     (unsigned long) pool->in_use);
+#endif  /* DEBUG_ALLOC */
+        while (pool->slabs) {
+            PoolSlab* next = pool->slabs->next;
+            NPN_MemFree (pool->slabs);
+            pool->slabs = next;
+        }
+        pool->free = 0;
+        pool->capacity = 0;
+    }
+}
+
+
+/*
+ * GMP memory functions.
+ *
+ * NP_Initialize installs these with mp_set_memory_functions.  Each
+ * block starts with a header naming the instance charged for it (the
+ * one whose code was running when it was allocated) and its usable
+ * capacity.  Blocks of up to LIMB_GRAIN * LIMB_CLASSES bytes come
+ * from free lists by size class.  Larger ones use realloc, and when
+ * they grow they get extra room, so the chains of small increases
+ * that mpz_mul and mpz_realloc2 produce mostly stay in place.
+ *
+ * Integer objects also carry MPZ_INLINE_LIMBS limbs of their own,
+ * behind a header of zero capacity.  GMP uses them until the number
+ * outgrows them, whereupon gmp_realloc moves it to the heap.  Freeing
+ * inline limbs does nothing.
+ *
+ * GMP may hand these functions blocks from the functions they
+ * replaced, allocated before NP_Initialize, and passes them on when the
+ * header lacks LIMB_MAGIC.  The magic number ends the header, so
+ * checking a foreign block reads only the word before it, which
+ * malloc keeps for its own use.  Any thread may free a block, onto its own
+ * free lists, so the slabs are global.  NP_Shutdown puts the old
+ * functions back and frees the slabs only when no block is live, and
+ * otherwise leaves that to the last gmp_free.
+ */
+
+#if NPGMP_MEMORY
+
+#define LIMB_GRAIN 16
+#define LIMB_CLASSES 16
+#ifndef LIMB_SLAB_SIZE
+# define LIMB_SLAB_SIZE 16384
+#endif
+#ifndef MPZ_INLINE_LIMBS
+# define MPZ_INLINE_LIMBS 4
+#endif
+
+#define LIMB_MAGIC 0x4c696d62  /* "Limb" */
+
+typedef struct _LimbFields {
+    TopObject* owner;  /* instance charged, or null */
+    size_t capacity;   /* usable bytes after the header, or 0 */
+} LimbFields;
+
+/* The last four bytes hold LIMB_MAGIC; see limb_magic_p.  */
+typedef union _LimbHeader {
+    LimbFields h;
+    char align[(sizeof (LimbFields) + sizeof (uint32_t) + LIMB_GRAIN - 1)
+               / LIMB_GRAIN * LIMB_GRAIN];
+} LimbHeader;
+
+static THREAD_LOCAL TopObject* GmpOwner;  /* instance to charge */
+static THREAD_LOCAL void* LimbFree[LIMB_CLASSES];
+static THREAD_LOCAL unsigned LimbFreeEpoch;  /* LimbEpoch of LimbFree */
+static void* LimbSlabs;     /* linked through the first word */
+static unsigned LimbEpoch;  /* counts limb_release calls */
+static size_t LimbLive;     /* blocks allocated and not freed */
+static bool LimbShutdown;   /* NP_Shutdown left limb_release to gmp_free */
+
+/* GMP's memory functions before NP_Initialize, for NP_Shutdown.  */
+static void* (*SavedAlloc) (size_t);
+static void* (*SavedRealloc) (void*, size_t, size_t);
+static void (*SavedFree) (void*, size_t);
+
+static inline void
+limb_set_magic (void* ptr)
+{
+    ((uint32_t*) ptr)[-1] = LIMB_MAGIC;
+}
+
+/* Whether PTR came from gmp_alloc.  A block from malloc may have no
+   header of ours, so do not let AddressSanitizer object to the read.  */
+static NO_SANITIZE_ADDRESS bool
+limb_magic_p (void* ptr)
+{
+    return ((uint32_t*) ptr)[-1] == LIMB_MAGIC;
+}
+
+static inline size_t
+limb_class (size_t size)
+{
+    return (size - 1) / LIMB_GRAIN;
+}
+
+/* Return the calling thread's free list for class C, emptying the
+   lists first if limb_release has freed the slabs under them.  */
+static inline void**
+limb_free_list (size_t c)
+{
+    if (UNLIKELY (LimbFreeEpoch != LimbEpoch)) {
+        memset (LimbFree, '\0', sizeof LimbFree);
+        LimbFreeEpoch = LimbEpoch;
+    }
+    return &LimbFree[c];
+}
+
+static void
+gmp_oom (void)
+{
+    /* GMP can not handle failure, and its own allocator aborts.  */
+    fputs ("npgmp: Cannot allocate memory\n", stderr);
+    abort ();
+}
+
+/* Call malloc or realloc for GMP.  Under memory pressure, first
+   drop the charged instance's recycled numbers and retry.  */
+static void*
+gmp_malloc (void* ptr, size_t size)
+{
+    void* ret = (ptr ? realloc (ptr, size) : malloc (size));
+
+    if (!ret && GmpOwner && free_recycled (GmpOwner))
+        ret = (ptr ? realloc (ptr, size) : malloc (size));
+    return ret;
+}
+
+/* Charge BLOCK's capacity to its owner, or if SIGN is negative,
+   refund it.  */
+static inline void
+limb_charge (LimbHeader* block, int sign)
+{
+    TopObject* owner = block->h.owner;
+
+    if (!owner)
+        return;
+    if (sign < 0) {
+        owner->gmp_bytes -= block->h.capacity;
+        return;
+    }
+    owner->gmp_bytes += block->h.capacity;
+    if (owner->gmp_bytes > owner->gmp_peak)
+        owner->gmp_peak = owner->gmp_bytes;
+    if (owner->quota && owner->gmp_bytes > owner->quota) {
+        /* Recycled numbers count against the quota, so drop them
+           first.  */
+        free_recycled (owner);
+        if (owner->gmp_bytes > owner->quota)
+            owner->over_quota = true;
+    }
+}
+
+static void*
+gmp_alloc (size_t size)
+{
+    LimbHeader* block;
+    size_t c = limb_class (size ?: 1);
+
+    if (c < LIMB_CLASSES) {
+        void** list = limb_free_list (c);
+
+        if (!*list) {
+            size_t bsize = sizeof (LimbHeader) + (c + 1) * LIMB_GRAIN;
+            size_t count = (LIMB_SLAB_SIZE - LIMB_GRAIN) / bsize;
+            char* slab = (char*) gmp_malloc (0, LIMB_SLAB_SIZE);
+
+            /* Slabs stay on the free lists until limb_release.  The
+               first grain links them for it.  */
+            if (!slab)
+                gmp_oom ();
+            do
+                *(void**) slab = LimbSlabs;
+            while (!ATOMIC_CAS (&LimbSlabs, *(void**) slab, slab));
+            slab += LIMB_GRAIN;
+            while (count--) {
+                *(void**) slab = *list;
+                *list = slab;
+                slab += bsize;
+            }
+        }
+        block = (LimbHeader*) *list;
+        *list = *(void**) block;
+        block->h.capacity = (c + 1) * LIMB_GRAIN;
+    }
+    else {
+        block = (LimbHeader*) gmp_malloc (0, sizeof (LimbHeader) + size);
+        if (!block)
+            gmp_oom ();
+        block->h.capacity = size;
+    }
+    block->h.owner = GmpOwner;
+    limb_set_magic (block + 1);
+    limb_charge (block, 1);
+    ATOMIC_ADD (&LimbLive, 1);
+    return block + 1;
+}
+
+/* Put back the functions that NP_Initialize replaced, and free the
+   slabs.  No block may be live.  The caller claims the call by
+   clearing LimbShutdown.  */
+static void
+limb_release (void)
+{
+    void* slab = LimbSlabs;
+
+    mp_set_memory_functions (SavedAlloc, SavedRealloc, SavedFree);
+    LimbSlabs = 0;
+    ATOMIC_ADD (&LimbEpoch, 1);
+    while (slab) {
+        void* next = *(void**) slab;
+
+        free (slab);
+        slab = next;
+    }
+}
+
+static void
+gmp_free (void* ptr, size_t size)
+{
+    LimbHeader* block = (LimbHeader*) ptr - 1;
+    size_t c;
+
+    if (UNLIKELY (!limb_magic_p (ptr))) {
+        SavedFree (ptr, size);  /* from before NP_Initialize */
+        return;
+    }
+    if (block->h.capacity == 0)
+        return;  /* inline */
+    c = limb_class (block->h.capacity);
+    limb_charge (block, -1);
+    if (c < LIMB_CLASSES) {
+        void** list = limb_free_list (c);
+
+        *(void**) block = *list;
+        *list = block;
+    }
+    else
+        free (block);
+    if (ATOMIC_SUB (&LimbLive, 1) == 0 && UNLIKELY (LimbShutdown)
+        && ATOMIC_CAS (&LimbShutdown, true, false))
+        limb_release ();
+}
+
+static void*
+gmp_realloc (void* ptr, size_t old_size, size_t new_size)
+{
+    LimbHeader* block = (LimbHeader*) ptr - 1;
+    size_t capacity;
+    TopObject* owner;
+    void* ret;
+
+    if (UNLIKELY (!limb_magic_p (ptr)))
+        return SavedRealloc (ptr, old_size, new_size);
+    capacity = block->h.capacity;
+
+    /* Stay in place unless that would waste over half the block.
+       Inline limbs stay put until they overflow.  */
+    if (capacity == 0 ? new_size <= old_size
+        : new_size <= capacity && new_size >= capacity / 2)
+        return ptr;
+
+    if (capacity != 0 && limb_class (capacity) >= LIMB_CLASSES &&
+        limb_class (new_size) >= LIMB_CLASSES) {
+        /* Grow by an extra quarter.  */
+        size_t want = new_size + (new_size > capacity ? new_size / 4 : 0);
+        LimbHeader* grown;
+
+        limb_charge (block, -1);
+        grown = (LimbHeader*) realloc (block, sizeof (LimbHeader) + want);
+        if (!grown && want > new_size) {
+            want = new_size;
+            grown = (LimbHeader*) gmp_malloc (block,
+                                              sizeof (LimbHeader) + want);
+        }
+        if (!grown)
+            gmp_oom ();
+        grown->h.capacity = want;
+        limb_charge (grown, 1);
+        return grown + 1;
+    }
+
+    /* Move between size classes, keeping the owner.  */
+    owner = GmpOwner;
+    GmpOwner = block->h.owner;
+    ret = gmp_alloc (new_size);
+    GmpOwner = owner;
+    memcpy (ret, ptr, old_size < new_size ? old_size : new_size);
+    gmp_free (ptr, old_size);
+    return ret;
+}
+
+/* Charge GMP allocations to TOP until gmp_owner_leave.  Return the
+   previous owner, to pass to gmp_owner_leave.  */
+static inline TopObject*
+gmp_owner_enter (TopObject* top)
+{
+    TopObject* ret = GmpOwner;
+    GmpOwner = top;
+    return ret;
+}
+
+static inline void
+gmp_owner_leave (TopObject* previous)
+{
+    GmpOwner = previous;
+}
+
+#else  /* !NPGMP_MEMORY */
+
+/* GMP's own allocator would try to free inline limbs.  */
+#undef MPZ_INLINE_LIMBS
+#define MPZ_INLINE_LIMBS 0
+
+static inline TopObject* gmp_owner_enter (TopObject* top) { return 0; }
+static inline void gmp_owner_leave (TopObject* previous) {}
+
+#endif  /* !NPGMP_MEMORY */
 
 
 /*
@@ -225,15 +785,17 @@ vraisef (NPObject* npobj, const char* format, va_list ap)
 {
     TopObject* top = get_top (npobj);
     if (top) {
-        free_errmsg (top->errmsg);
-        int needed = vsnprintf (0, 0, format, ap) + 1;
+        /* The arguments may include the old top->errmsg, so format
+           before freeing it.  */
+        va_list ap2;
+        va_copy (ap2, ap);
+        int needed = vsnprintf (0, 0, format, ap2) + 1;
+        va_end (ap2);
         char* buffer = (char*) NPN_MemAlloc (needed);
-        if (buffer) {
+        if (buffer)
             vsnprintf (buffer, needed, format, ap);
-            top->errmsg = buffer;
-        }
-        else
-            top->errmsg = OOM;
+        free_errmsg (top->errmsg);
+        top->errmsg = (buffer ? buffer : OOM);
     }
     else {
         fprintf (stderr, "Uncaught: ");
@@ -313,6 +875,137 @@ oom (NPObject* npobj, NPVariant* result, bool ret)
 }
 
 
+/*
+ * Shared strings.
+ *
+ * The browser frees string values with NPN_MemFree, so a string
+ * NPVariant can have only one owner, and copying it means copying
+ * its characters.  Strings that scripts keep, such as tuple elements
+ * and stack entries, are instead held as SharedString objects.
+ * NPN_RetainObject copies these, and NPN_ReleaseVariantValue frees
+ * them.  copy_npvariant turns them back into strings when it returns
+ * them to the browser.  An instance has at most one SharedString of
+ * a given value, so a script that pushes the same string repeatedly
+ * holds one copy.
+ */
+
+#if NPGMP_SCRIPT
+
+#include <search.h>
+
+typedef struct _SharedString {
+    NPObject npobj;
+    NPString string;  /* NUL-terminated, from NPN_MemAlloc */
+} SharedString;
+
+/* Order SharedStrings by value.  */
+static int
+compare_strings (const void* a1, const void* a2)
+{
+    const NPString* s1 = &((const SharedString*) a1)->string;
+    const NPString* s2 = &((const SharedString*) a2)->string;
+    uint32_t len = (s1->UTF8Length < s2->UTF8Length
+                    ? s1->UTF8Length : s2->UTF8Length);
+    int ret = memcmp (s1->UTF8Characters, s2->UTF8Characters, len);
+
+    if (ret)
+        return ret;
+    return (s1->UTF8Length > s2->UTF8Length) -
+        (s1->UTF8Length < s2->UTF8Length);
+}
+
+static NPObject*
+SharedString_allocate (NPP npp, NPClass *aClass)
+{
+    TopObject* top = CONTAINING (TopObject, SharedString, aClass);
+    SharedString* ret = (SharedString*) pool_alloc (top, sizeof (SharedString));
+#if DEBUG_ALLOC
+    fprintf (stderr, "SharedString allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        NPN_RetainObject ((NPObject*) top);
+        ret->string.UTF8Characters = 0;
+        ret->string.UTF8Length = 0;
+    }
+    return &ret->npobj;
+}
+
+static void
+SharedString_deallocate (NPObject *npobj)
+{
+    SharedString* ss = (SharedString*) npobj;
+#if DEBUG_ALLOC
+    fprintf (stderr, "SharedString deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    TopObject* top = SharedString_getTop (npobj);
+    if (ss->string.UTF8Characters) {
+        tdelete (ss, &top->strings, compare_strings);
+        NPN_MemFree ((NPUTF8*) ss->string.UTF8Characters);
+    }
+    pool_free (top, npobj, sizeof (SharedString));
+    NPN_ReleaseObject ((NPObject*) top);
+}
+
+/* Return the SharedString holding STRING, retained, making one with a
+   copy of STRING if none exists.  Return null if out of memory.  */
+static SharedString*
+make_shared_string (TopObject* top, const NPString* string)
+{
+    uint32_t len = string->UTF8Length;
+    SharedString key;
+    SharedString** found;
+    SharedString* ret = 0;
+    NPUTF8* s;
+
+    key.string = *string;
+    found = (SharedString**) tfind (&key, &top->strings, compare_strings);
+    if (found)
+        return (SharedString*) NPN_RetainObject (&(*found)->npobj);
+
+    s = (NPUTF8*) NPN_MemAlloc (len + 1);
+    if (s)
+        ret = (SharedString*) NPN_CreateObject (top->instance,
+                                                &top->SharedString.npclass);
+    if (!ret) {
+        if (s)
+            NPN_MemFree (s);
+        raise_oom ((NPObject*) top);
+        return 0;
+    }
+    memcpy (s, string->UTF8Characters, len);
+    s[len] = '\0';
+    ret->string.UTF8Characters = s;
+    ret->string.UTF8Length = len;
+    if (!tsearch (ret, &top->strings, compare_strings)) {
+        NPN_ReleaseObject (&ret->npobj);
+        raise_oom ((NPObject*) top);
+        return 0;
+    }
+    return ret;
+}
+
+#endif  /* NPGMP_SCRIPT */
+
+/* If *VAR is a string or SharedString, set *STRING to its value and
+   return true.  */
+static inline bool
+var_to_npstring (TopObject* top, const NPVariant* var, NPString* string)
+{
+    if (NPVARIANT_IS_STRING (*var)) {
+        *string = NPVARIANT_TO_STRING (*var);
+        return true;
+    }
+#if NPGMP_SCRIPT
+    if (NPVARIANT_IS_OBJECT (*var) && NPVARIANT_TO_OBJECT (*var)->_class ==
+        &top->SharedString.npclass) {
+        *string = ((SharedString*) NPVARIANT_TO_OBJECT (*var))->string;
+        return true;
+    }
+#endif
+    return false;
+}
+
+
 /*
  * Argument conversion.
  *
@@ -389,33 +1082,49 @@ outdel_double (TopObject* top, double value, NPVariant* result)
 
 /* C integer types <=> NPVariantType_{Double|Int32|String} */
 
-#define PARSE_UNSIGNED(top, type, arg, start, end)                      \
-    do {                                                                \
-        TopObject* t = (top);                                           \
-        type* a = (arg);                                                \
-        const NPUTF8* s = (start);                                      \
-        const NPUTF8* e = (end);                                        \
-                                                                        \
-        if (s == e) {                                                   \
-            raisef ((NPObject*) t, "invalid %s", #type);                \
-            return false;                                               \
-        }                                                               \
-        *a = 0;                                                         \
-        while (s < e) {                                                 \
-            if (*s < '0' || *s > '9' ||                                 \
-                *a * 2 < *a || *a * 4 < *a * 2 || *a * 8 < *a * 4 ||    \
-                *a * 10 + (*s - '0') < *a * 8) {                        \
-                raisef ((NPObject*) t, "invalid %s", #type);            \
-                return false;                                           \
-            }                                                           \
-            *a = *a * 10 + (*s - '0');                                  \
-        }                                                               \
-    } while (0)
+/* The largest value of integer TYPE, signed or unsigned.  */
+#define INT_TYPE_MAX(type)                                              \
+    ((type) -1 > 0 ? (uintmax_t) (type) -1 :                           \
+     ((uintmax_t) 1 << (8 * sizeof (type) - 1)) - 1)
+
+/* Set *VALUE from the decimal digits between S and E and return true,
+   or return false if there are no digits, a non-digit, or a value
+   above MAX.  Comparing with MAX / 10 and MAX % 10, as strtoul does,
+   checks overflow without extra multiplications.  */
+static inline bool
+parse_decimal (const NPUTF8* s, const NPUTF8* e, uintmax_t max,
+               uintmax_t* value)
+{
+    uintmax_t cutoff = max / 10;
+    unsigned int cutlim = max % 10;
+    uintmax_t v = 0;
+
+    if (s == e)
+        return false;
+    for (; s < e; s++) {
+        unsigned int d = (unsigned char) *s - '0';
+        if (d > 9 || v > cutoff || (v == cutoff && d > cutlim))
+            return false;
+        v = v * 10 + d;
+    }
+    *value = v;
+    return true;
+}
+
+/* Return 1 if STR starts with a minus sign, else 0.  */
+static inline int
+minus_p (NPString str)
+{
+    return str.UTF8Length > 0 && str.UTF8Characters[0] == '-';
+}
 
 #define DEFINE_IN_SIGNED(type)                                          \
     static bool UNUSED                                                  \
     in_ ## type (TopObject* top, const NPVariant* var, type* arg)       \
     {                                                                   \
+        NPString str;                                                   \
+        uintmax_t u;                                                    \
+                                                                        \
         if (NPVARIANT_IS_INT32 (*var) &&                                \
             NPVARIANT_TO_INT32 (*var) == (type) NPVARIANT_TO_INT32 (*var)) \
             *arg = (type) NPVARIANT_TO_INT32 (*var);                    \
@@ -424,18 +1133,15 @@ outdel_double (TopObject* top, double value, NPVariant* result)
             NPVARIANT_TO_DOUBLE (*var) == (type) NPVARIANT_TO_DOUBLE (*var)) \
             *arg = (type) NPVARIANT_TO_DOUBLE (*var);                   \
                                                                         \
-        else if (NPVARIANT_IS_STRING (*var)) {                          \
-            int sign = 1;                                               \
-            NPString str = NPVARIANT_TO_STRING (*var);                  \
-            const char* start = str.UTF8Characters;                     \
-            const char* end = start + str.UTF8Length;                   \
-            if (start < end && *start == '-') {                         \
-                sign = -1;                                              \
-                start++;                                                \
-            }                                                           \
-            PARSE_UNSIGNED (top, type, arg, start, end);                \
-            *arg *= sign;                                               \
-        }                                                               \
+        else if (var_to_npstring (top, var, &str) &&                    \
+                 parse_decimal (str.UTF8Characters + minus_p (str),     \
+                                str.UTF8Characters + str.UTF8Length,    \
+                                INT_TYPE_MAX (type) + minus_p (str),    \
+                                &u))                                    \
+            /* Avoid overflow on the most negative value.  */           \
+            *arg = (minus_p (str) && u                                  \
+                    ? -(type) (u - 1) - 1 : (type) u);                  \
+                                                                        \
         else {                                                          \
             raisef ((NPObject*) top, "invalid %s", #type);              \
             return false;                                               \
@@ -447,6 +1153,9 @@ outdel_double (TopObject* top, double value, NPVariant* result)
     static bool UNUSED                                                  \
     in_ ## type (TopObject* top, const NPVariant* var, type* arg)       \
     {                                                                   \
+        NPString str;                                                   \
+        uintmax_t u;                                                    \
+                                                                        \
         if (NPVARIANT_IS_INT32 (*var) && NPVARIANT_TO_INT32 (*var) >= 0 && \
             NPVARIANT_TO_INT32 (*var) == (type) NPVARIANT_TO_INT32 (*var)) \
             *arg = (type) NPVARIANT_TO_INT32 (*var);                    \
@@ -455,12 +1164,12 @@ outdel_double (TopObject* top, double value, NPVariant* result)
             NPVARIANT_TO_DOUBLE (*var) == (type) NPVARIANT_TO_DOUBLE (*var)) \
             *arg = (type) NPVARIANT_TO_DOUBLE (*var);                   \
                                                                         \
-        else if (NPVARIANT_IS_STRING (*var)) {                          \
-            NPString str = NPVARIANT_TO_STRING (*var);                  \
-            const char* start = str.UTF8Characters;                     \
-            const char* end = start + str.UTF8Length;                   \
-            PARSE_UNSIGNED (top, type, arg, start, end);                \
-        }                                                               \
+        else if (var_to_npstring (top, var, &str) &&                    \
+                 parse_decimal (str.UTF8Characters,                     \
+                                str.UTF8Characters + str.UTF8Length,    \
+                                INT_TYPE_MAX (type), &u))               \
+            *arg = (type) u;                                            \
+                                                                        \
         else {                                                          \
             raisef ((NPObject*) top, "invalid %s", #type);              \
             return false;                                               \
@@ -549,22 +1258,21 @@ outdel_Bool (TopObject* top, bool value, NPVariant* result)
 static bool UNUSED
 in_stringz (TopObject* top, const NPVariant* var, stringz* arg)
 {
-    const NPString* npstr;
+    NPString npstr;
     NPUTF8* str;
 
-    if (!NPVARIANT_IS_STRING (*var)) {
+    if (!var_to_npstring (top, var, &npstr)) {
         raisef ((NPObject*) top, "not a string");
         return false;
     }
-    npstr = &NPVARIANT_TO_STRING (*var);
-    str = (NPUTF8*) NPN_MemAlloc (npstr->UTF8Length + 1);
+    str = (NPUTF8*) NPN_MemAlloc (npstr.UTF8Length + 1);
     if (!str) {
         raise_oom ((NPObject*) top);
         return false;
     }
     *arg = str;
-    strncpy (str, npstr->UTF8Characters, npstr->UTF8Length);
-    str[npstr->UTF8Length] = '\0';
+    strncpy (str, npstr.UTF8Characters, npstr.UTF8Length);
+    str[npstr.UTF8Length] = '\0';
     return true;
 }
 
@@ -600,11 +1308,10 @@ outdel_stringz (TopObject* top, stringz value, NPVariant* result)
 static bool UNUSED
 in_npstring (TopObject* top, const NPVariant* var, NPString* arg)
 {
-    if (!NPVARIANT_IS_STRING (*var)) {
+    if (!var_to_npstring (top, var, arg)) {
         raisef ((NPObject*) top, "not a string");
         return false;
     }
-    *arg = NPVARIANT_TO_STRING (*var);
     return true;
 }
 
@@ -629,7 +1336,115 @@ outdel_npstring (TopObject* top, NPString value, NPVariant* result)
     return out_npstring (top, value, result);
 }
 
-/* NPObject* <=> NPVariantType_Object */
+/* Binary data <=> NPVariantType_String
+
+   JavaScript has no byte array type that NPAPI understands, so we use
+   the "binary string" convention of atob() and btoa(): one character
+   per byte, code points 0 through 255.  In UTF-8, bytes 0x80 and
+   above become two-byte sequences.  */
+
+typedef struct _Bytes {
+    size_t length;
+    unsigned char* data;  /* from NPN_MemAlloc */
+} Bytes;
+
+typedef Bytes bytes;
+
+static bool UNUSED
+in_bytes (TopObject* top, const NPVariant* var, bytes* arg)
+{
+    NPString str;
+    const unsigned char* s;
+    const unsigned char* e;
+    unsigned char* d;
+
+    if (!var_to_npstring (top, var, &str)) {
+        raisef ((NPObject*) top, "not a string");
+        return false;
+    }
+    s = (const unsigned char*) str.UTF8Characters;
+    e = s + str.UTF8Length;
+
+    /* The decoded length can not exceed the encoded length.  */
+    d = (unsigned char*) NPN_MemAlloc (e - s ?: 1);
+    if (!d) {
+        raise_oom ((NPObject*) top);
+        return false;
+    }
+    arg->data = d;
+
+    while (s < e) {
+        if (*s < 0x80)
+            *d++ = *s++;
+        else if ((*s & 0xfe) == 0xc2 && s + 1 < e && (s[1] & 0xc0) == 0x80) {
+            *d++ = (unsigned char) ((s[0] & 0x1f) << 6 | (s[1] & 0x3f));
+            s += 2;
+        }
+        else {
+            NPN_MemFree (arg->data);
+            raisef ((NPObject*) top, "not a binary string");
+            return false;
+        }
+    }
+    arg->length = d - arg->data;
+    return true;
+}
+
+static inline void UNUSED
+del_bytes (bytes arg)
+{
+    if (arg.data)
+        NPN_MemFree (arg.data);
+}
+
+static bool UNUSED
+out_bytes (TopObject* top, bytes value, NPVariant* result)
+{
+    size_t len = value.length;
+    NPUTF8* ret;
+    NPUTF8* p;
+
+    if (!value.data && value.length) {
+        /* Allocation failed in the function that produced VALUE.  */
+        VOID_TO_NPVARIANT (*result);
+        raise_oom ((NPObject*) top);
+        return false;
+    }
+
+    for (size_t i = 0; i < value.length; i++)
+        len += value.data[i] >> 7;
+
+    ret = (NPUTF8*) NPN_MemAlloc (len ?: 1);
+    if (!ret) {
+        VOID_TO_NPVARIANT (*result);
+        raise_oom ((NPObject*) top);
+        return false;
+    }
+
+    p = ret;
+    for (size_t i = 0; i < value.length; i++) {
+        unsigned char c = value.data[i];
+        if (c < 0x80)
+            *p++ = c;
+        else {
+            *p++ = 0xc0 | (c >> 6);
+            *p++ = 0x80 | (c & 0x3f);
+        }
+    }
+    STRINGN_TO_NPVARIANT (ret, len, *result);
+    return true;
+}
+
+static inline bool UNUSED
+outdel_bytes (TopObject* top, bytes value, NPVariant* result)
+{
+    if (!out_bytes (top, value, result))
+        return false;
+    del_bytes (value);
+    return true;
+}
+
+/* NPObject* <=> NPVariantType_Object */
 
 static bool UNUSED
 in_npobj (TopObject* top, const NPVariant* var, NPObject** arg)
@@ -638,7 +1453,7 @@ in_npobj (TopObject* top, const NPVariant* var, NPObject** arg)
         raisef ((NPObject*) top, "not an object");
         return false;
     }
-    *arg = NPVARIANT_TO_OBJECT (*var);
+    *arg = var_object (top, var);
     return true;
 }
 
@@ -727,31 +1542,41 @@ typedef struct _Tuple {
     NPObject npobj;
     NPVariant* start;
     NPVariant* end;
+#if NPGMP_SCRIPT
+    struct _Code* code;  /* compiled form, see tuple_code() */
+#endif
 } Tuple;
 
 static NPObject*
 Tuple_allocate (NPP npp, NPClass *aClass)
 {
-    Tuple* ret = (Tuple*) NPN_MemAlloc (sizeof (Tuple));
+    TopObject* top = CONTAINING (TopObject, Tuple, aClass);
+    Tuple* ret = (Tuple*) pool_alloc (top, sizeof (Tuple));
 #if DEBUG_ALLOC
     fprintf (stderr, "Tuple allocate %p\n", ret);
 #endif  /* DEBUG_ALLOC */
     if (ret) {
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Tuple, aClass));
+        NPN_RetainObject ((NPObject*) top);
+        census_born (top, CENSUS_Tuple);
         ret->start = 0;
         ret->end = 0;
+#if NPGMP_SCRIPT
+        ret->code = 0;
+#endif
     }
     return &ret->npobj;
 }
 
-static NPVariant* tuple_alloc (uint32_t size);
+static NPVariant* tuple_alloc (TopObject* top, uint32_t size);
 static void tuple_free (Tuple* tuple);
-static bool retain_for_js (TopObject* top, NPObject* npobj);
+static NPObject* retain_for_js (TopObject* top, NPObject* npobj);
+static void gc_safe_point (TopObject* top);
+static void remember (TopObject* top, NPVariant* dest);
 
 #if !NPGMP_SCRIPT  /* Script allocation is in a special heap.  */
 
 static NPVariant*
-tuple_alloc (uint32_t size)
+tuple_alloc (TopObject* top, uint32_t size)
 {
     NPVariant* ret;
     ret = (NPVariant*) NPN_MemAlloc (size * sizeof ret[0]);
@@ -767,10 +1592,20 @@ tuple_free (Tuple* tuple)
         NPN_MemFree (tuple->start);
 }
 
-static bool
+static NPObject*
 retain_for_js (TopObject* top, NPObject* npobj)
 {
-    return true;
+    return npobj;
+}
+
+static inline void
+gc_safe_point (TopObject* top)
+{
+}
+
+static inline void
+remember (TopObject* top, NPVariant* dest)
+{
 }
 
 #endif  /* !NPGMP_SCRIPT */
@@ -782,9 +1617,10 @@ Tuple_deallocate (NPObject *npobj)
     fprintf (stderr, "Tuple deallocate %p\n", npobj);
 #endif  /* DEBUG_ALLOC */
     TopObject* top = Tuple_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
     tuple_free ((Tuple*) npobj);
-    NPN_MemFree (npobj);
+    pool_free (top, npobj, sizeof (Tuple));
+    census_died (top, CENSUS_Tuple);
+    NPN_ReleaseObject ((NPObject*) top);
 }
 
 static size_t
@@ -812,28 +1648,64 @@ Tuple_hasProperty(NPObject *npobj, NPIdentifier key)
         id_to_index (key) < Tuple_length ((Tuple*) npobj);
 }
 
-/* Return true if copy SRC to DEST, else set errmsg.  */
+/* Return true if copy SRC to DEST, else set errmsg.  DEST is for the
+   browser, so SharedString values become strings.  */
 static bool
 copy_npvariant (NPObject* npobj, NPVariant* dest, const NPVariant* src)
 {
-    if (NPVARIANT_IS_STRING (*src)) {
-        uint32_t len = NPVARIANT_TO_STRING (*src).UTF8Length;
-        NPUTF8* s = (NPUTF8*) NPN_MemAlloc (len);
+    NPString value;
+
+    if (var_to_npstring (get_top (npobj), src, &value)) {
+        NPUTF8* s = (NPUTF8*) NPN_MemAlloc (value.UTF8Length);
         if (!s) {
             raise_oom (npobj);
             return false;
         }
-        memcpy (s, NPVARIANT_TO_STRING (*src).UTF8Characters, len);
-        STRINGN_TO_NPVARIANT (s, len, *dest);
+        memcpy (s, value.UTF8Characters, value.UTF8Length);
+        STRINGN_TO_NPVARIANT (s, value.UTF8Length, *dest);
     }
-    else {
-        if (NPVARIANT_IS_OBJECT (*src))
-            NPN_RetainObject (NPVARIANT_TO_OBJECT (*src));
+    else if (NPVARIANT_IS_OBJECT (*src)) {
+        TopObject* top = get_top (npobj);
+        NPObject* obj = NPN_RetainObject (var_object (top, src));
+
+        obj = retain_for_js (top, obj);
+        if (!obj) {
+            raise_oom (npobj);
+            return false;
+        }
+        OBJECT_TO_NPVARIANT (obj, *dest);
+    }
+    else
         *dest = *src;
+    return true;
+}
+
+#if NPGMP_SCRIPT
+
+/* Like copy_npvariant, but DEST stays in the plugin, so strings
+   become SharedString values and copies of those share storage.  */
+static bool
+share_npvariant (NPObject* npobj, NPVariant* dest, const NPVariant* src)
+{
+    if (NPVARIANT_IS_STRING (*src)) {
+        SharedString* ss = make_shared_string (get_top (npobj),
+                                               &NPVARIANT_TO_STRING (*src));
+        if (!ss)
+            return false;
+        OBJECT_TO_NPVARIANT (&ss->npobj, *dest);
+    }
+    else if (NPVARIANT_IS_OBJECT (*src)) {
+        NPObject* obj = var_object (get_top (npobj), src);
+        OBJECT_TO_NPVARIANT (NPN_RetainObject (obj), *dest);
+        remember (get_top (npobj), dest);
     }
+    else
+        *dest = *src;
     return true;
 }
 
+#endif  /* NPGMP_SCRIPT */
+
 static bool
 tuple_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
 {
@@ -867,19 +1739,60 @@ make_tuple (TopObject* top, uint32_t size)
 {
     Tuple* ret = (Tuple*) NPN_CreateObject (top->instance, &top->Tuple.npclass);
     if (ret) {
-        ret->start = tuple_alloc (size);
+        ret->start = tuple_alloc (top, size);
         if (ret->start) {
             memset (ret->start, '\0', size * sizeof ret->start[0]);
             ret->end = ret->start + size;
         }
         else {
-            NPN_MemFree (ret);
+            NPN_ReleaseObject (&ret->npobj);
             ret = 0;
         }
     }
     return ret;
 }
 
+/* gmp.pool_usage() returns [objects in use, free objects, slab bytes,
+   GMP bytes] for TOP's object pools and GMP memory.  */
+static NPObject*
+x_x_pool_usage (TopObject* top)
+{
+    Tuple* ret = make_tuple (top, 4);
+    size_t in_use = 0, capacity = 0, slabs = 0;
+
+    if (!ret) {
+        raise_oom ((NPObject*) top);
+        return 0;
+    }
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        in_use += top->pools[i].in_use;
+        capacity += top->pools[i].capacity;
+        for (PoolSlab* slab = top->pools[i].slabs; slab; slab = slab->next)
+            slabs++;
+    }
+    /* Count recycled numbers as free.  */
+#if NPGMP_MPZ
+    in_use -= top->recycled_mpz.count;
+#endif
+#if NPGMP_MPQ
+    in_use -= top->recycled_mpq.count;
+#endif
+#if NPGMP_MPF
+    in_use -= top->recycled_mpf.count;
+#endif
+    (void) out_size_t (top, in_use, &ret->start[0]);
+    (void) out_size_t (top, capacity - in_use, &ret->start[1]);
+    (void) out_size_t (top, slabs * POOL_SLAB_SIZE, &ret->start[2]);
+#if NPGMP_MEMORY
+    (void) out_size_t (top, top->gmp_bytes, &ret->start[3]);
+#else
+    INT32_TO_NPVARIANT (0, ret->start[3]);
+#endif
+    return &ret->npobj;
+}
+
+#define x_pool_usage() x_x_pool_usage (vTop)
+
 
 /*
  * GMP-specific types.
@@ -950,14 +1863,23 @@ DEFINE_UNSIGNED (mp_limb_t)
 
 typedef mpz_ptr uninit_mpz;
 typedef mpq_ptr uninit_mpq;
+typedef mpz_ptr dest_mpz;
+typedef mpq_ptr dest_mpq;
 typedef mpf_ptr uninit_mpf;
+typedef mpf_ptr dest_mpf;
 typedef mpf_ptr defprec_mpf;
 typedef x_gmp_randstate_ptr uninit_rand;
 
 #if NPGMP_MPZ
 typedef struct _Integer {
     NPObject npobj;
+    struct _Integer* twin;  /* next Integer sharing our limbs, or null */
+    struct _Integer* prev_twin;  /* previous one, or null */
     mpz_t mp;
+#if MPZ_INLINE_LIMBS
+    LimbHeader header;  /* must immediately precede limbs */
+    mp_limb_t limbs[MPZ_INLINE_LIMBS];
+#endif
 } Integer;
 #endif  /* NPGMP_MPZ */
 
@@ -970,6 +1892,9 @@ typedef struct _MpzRef {
 
 typedef struct _Rational {
     NPObject npobj;
+    struct _Rational* twin;  /* next Rational sharing our limbs, or null */
+    struct _Rational* prev_twin;  /* previous one, or null */
+    MpzRef* ref[2];  /* mpq.numref and mpq.denref views, or null */
     mpq_t mp;
 } Rational;
 #endif  /* NPGMP_MPQ */
@@ -982,6 +1907,42 @@ typedef struct _Float {
 } Float;
 #endif  /* NPGMP_MPF */
 
+#if NPGMP_MPQ || NPGMP_MPF
+/* Untouched Rationals and Floats point here, at a zero and a one,
+   instead of at limbs of their own; see rational_touch.  */
+static mp_limb_t ZeroLimbs[2] = { 0, 1 };
+#endif
+
+#if NPGMP_MPQ
+/* A new Rational holds no limbs until it first receives a value.
+   Until then, it is zero over one in ZeroLimbs, which GMP may read but
+   not write, so only the converters of destinations touch it.  */
+static inline bool
+rational_untouched_p (mpq_srcptr q)
+{
+    return mpq_numref (q)->_mp_d == &ZeroLimbs[0];
+}
+
+static inline void
+rational_untouch (mpq_ptr q)
+{
+    mpq_numref (q)->_mp_alloc = 0;
+    mpq_numref (q)->_mp_size = 0;
+    mpq_numref (q)->_mp_d = &ZeroLimbs[0];
+    mpq_denref (q)->_mp_alloc = 0;
+    mpq_denref (q)->_mp_size = 1;
+    mpq_denref (q)->_mp_d = &ZeroLimbs[1];
+}
+
+static inline mpq_ptr
+rational_touch (Rational* q)
+{
+    if (rational_untouched_p (q->mp))
+        mpq_init (q->mp);
+    return q->mp;
+}
+#endif  /* NPGMP_MPQ */
+
 #if NPGMP_RAND
 typedef struct _Rand {
     NPObject npobj;
@@ -991,2794 +1952,6668 @@ typedef struct _Rand {
 
 
 /*
- * Integer objects wrap mpz_t.
+ * Recycled numbers.
+ *
+ * Clearing a number when its wrapper dies means that a loop making
+ * and dropping temporaries grows fresh limbs on every iteration.  So
+ * the Integer, Rational and Float deallocators keep up to RECYCLE_MAX
+ * bodies of each type, still initialized, and the allocators reuse
+ * them, preferring one whose capacity suits the number to be made.
+ * The bins of an instance hold at most RECYCLE_BYTES limb bytes in
+ * all, or an eighth of its memory quota if that is less, and a body
+ * that does not fit, or would take over a quarter of that, is cleared
+ * as before.  free_recycled clears the
+ * rest when memory runs short, when the instance goes over its quota,
+ * or when it dies.  Recycled bodies do not retain the TopObject.
  */
 
-#if NPGMP_MPZ
+#ifndef RECYCLE_BYTES
+# define RECYCLE_BYTES 65536
+#endif
 
-static NPObject*
-Integer_allocate (NPP npp, NPClass *aClass)
+/* Return the limb bytes in TOP's bins.  */
+static size_t
+recycled_bytes (TopObject* top)
 {
-    Integer* ret = (Integer*) NPN_MemAlloc (sizeof (Integer));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Integer allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret) {
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Integer, aClass));
-        mpz_init (ret->mp);
-    }
-    return (NPObject*) ret;
-}
+    size_t ret = 0;
 
-static void
-Integer_deallocate (NPObject *npobj)
-{
-#if DEBUG_ALLOC
-    fprintf (stderr, "Integer deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
-    TopObject* top = Integer_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
-    mpz_clear (((Integer*) npobj)->mp);
-    NPN_MemFree (npobj);
+#if NPGMP_MPZ
+    ret += top->recycled_mpz.bytes;
+#endif
+#if NPGMP_MPQ
+    ret += top->recycled_mpq.bytes;
+#endif
+#if NPGMP_MPF
+    ret += top->recycled_mpf.bytes;
+#endif
+    return ret;
 }
 
+/* Keep BODY, which holds LIMBS limbs, in TOP's BIN if there is
+   room.  */
 static bool
-integer_toString (TopObject *top, mpz_ptr mpp, const NPVariant *args,
-                  uint32_t argCount, NPVariant *result)
+recycle_put (TopObject* top, Recycle* bin, NPObject* body, size_t limbs)
 {
-    int base = 0;
+    size_t bytes = limbs * sizeof (mp_limb_t);
+    size_t budget = RECYCLE_BYTES;
 
-    if (argCount < 1)
-        base = 10;
+    if (top->quota && top->quota / 8 < budget)
+        budget = top->quota / 8;
+    if (bin->count >= RECYCLE_MAX || bytes > budget / 4
+        || recycled_bytes (top) > budget - bytes)
+        return false;
+    body->_class = 0;  /* for census_limbs */
+    bin->body[bin->count] = body;
+    bin->body_bytes[bin->count++] = bytes;
+    bin->bytes += bytes;
+    return true;
+}
 
-    else if (!in_output_base (top, &args[0], &base)) {
-        return set_exception ((NPObject*) top, "invalid argument", result,
-                              true);
+/* Remove and return the most recent body in BIN whose capacity, as
+   measured by CAPACITY, is at least WANT.  Return null if there is
+   none.  */
+static NPObject*
+recycle_take (Recycle* bin, size_t want, size_t (*capacity) (NPObject*))
+{
+    for (size_t i = bin->count; i-- > 0; ) {
+        NPObject* ret = bin->body[i];
+        if (want == 0 || capacity (ret) >= want) {
+            bin->count--;
+            bin->bytes -= bin->body_bytes[i];
+            memmove (&bin->body[i], &bin->body[i + 1],
+                     (bin->count - i) * sizeof bin->body[0]);
+            memmove (&bin->body_bytes[i], &bin->body_bytes[i + 1],
+                     (bin->count - i) * sizeof bin->body_bytes[0]);
+            return ret;
+        }
     }
-
-    size_t len = mpz_sizeinbase (mpp, base) + 2;
-    NPUTF8* s = (NPUTF8*) NPN_MemAlloc (len);
-    if (!s)
-        return oom ((NPObject*) top, result, true);
-
-    mpz_get_str (s, base, mpp);
-    if (s[0] != '-')
-        len--;
-    STRINGN_TO_NPVARIANT (s, s[len-2] ? len-1 : len-2, *result);
-    return true;
+    return 0;
 }
 
-static bool
-Integer_invoke (NPObject *npobj, NPIdentifier name,
-                const NPVariant *args, uint32_t argCount, NPVariant *result)
+#if NPGMP_MPZ
+static size_t
+mpz_capacity (NPObject* body)
 {
-    Integer* z = (Integer*) npobj;
-    if (name == ID_toString)
-        return integer_toString (Integer_getTop (npobj),
-                                 z->mp, args, argCount, result);
-    return false;
+    return ((Integer*) body)->mp->_mp_alloc;
 }
+#endif  /* NPGMP_MPZ */
 
-static NPObject*
-x_x_mpz (TopObject* top)
+#if NPGMP_MPF
+static size_t
+mpf_capacity (NPObject* body)
 {
-    NPObject* ret = NPN_CreateObject (top->instance, &top->Integer.npclass);
-    if (!ret)
-        raise_oom ((NPObject*) top);
-    return ret;
+    return mpf_get_prec (((Float*) body)->mp);
 }
+#endif  /* NPGMP_MPF */
 
-/* XXX Could avoid macro use of vTop by making x_mpz a no-op and having the
-   entry return a new type that creates the object in its output method. */
-#define x_mpz() x_x_mpz (vTop)
-
-static Bool
-is_mpz (Variant var)
+/* Clear all of TOP's recycled bodies.  Return true if there were
+   any.  */
+static bool
+free_recycled (TopObject* top)
 {
-    if (!NPVARIANT_IS_OBJECT (*var.arg))
-        return false;
-    NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
-    if (npobj->_class == (NPClass*) &var.top->Integer)
-        return true;
+    bool ret = false;
+    NPObject* body;
+
+#if NPGMP_MPZ
+    while ((body = recycle_take (&top->recycled_mpz, 0, 0))) {
+        mpz_clear (((Integer*) body)->mp);
+        pool_free (top, body, sizeof (Integer));
+        ret = true;
+    }
+#endif
 #if NPGMP_MPQ
-    if (npobj->_class == (NPClass*) &var.top->MpzRef)
-        return true;
-#endif  /* NPGMP_MPQ */
-    return false;
+    while ((body = recycle_take (&top->recycled_mpq, 0, 0))) {
+        mpq_clear (((Rational*) body)->mp);
+        pool_free (top, body, sizeof (Rational));
+        ret = true;
+    }
+#endif
+#if NPGMP_MPF
+    while ((body = recycle_take (&top->recycled_mpf, 0, 0))) {
+        mpf_clear (((Float*) body)->mp);
+        pool_free (top, body, sizeof (Float));
+        ret = true;
+    }
+#endif
+    (void) body;
+    return ret;
 }
 
+
 /*
- * Class of objects "returned" by the mpq_numref and mpq_denref macros.
+ * Memory census and quota.
+ *
+ * Each instance counts its live objects by type.  gmp.memory() adds
+ * the limb bytes they hold, found by walking the object pools, and
+ * the GMP memory charged to the instance.  gmp.set_memory_quota
+ * limits the latter.  GMP can not survive a failed allocation, so
+ * functions that can make huge numbers from small arguments check
+ * their estimated size first, and anything else that goes over the
+ * quota raises an error after it returns.
  */
 
-#if NPGMP_MPQ
+static size_t
+charged_bytes (TopObject* top)
+{
+#if NPGMP_MEMORY
+    return top->gmp_bytes;
+#else
+    return 0;
+#endif
+}
 
-static NPObject*
-MpzRef_allocate (NPP npp, NPClass *aClass)
+/* Raise an error and return false if a number of BITS bits would
+   take TOP over its memory quota.  */
+static bool
+quota_check (TopObject* top, double bits)
 {
-    MpzRef* ret = (MpzRef*) NPN_MemAlloc (sizeof (MpzRef));
-#if DEBUG_ALLOC
-    fprintf (stderr, "MpzRef allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret) {
-        ret->owner = 0;
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, MpzRef, aClass));
+    if (top->quota && charged_bytes (top) + bits / 8 > top->quota) {
+        raisef ((NPObject*) top, "memory quota exceeded");
+        return false;
     }
-    return &ret->npobj;
+    return true;
 }
 
+/* Clear TOP's over-quota flag.  If it was set and the call otherwise
+   succeeded (OK is true), raise an error and discard *RESULT if
+   RESULT is not null.  */
 static void
-MpzRef_deallocate (NPObject *npobj)
-{
-    MpzRef* ref = (MpzRef*) npobj;
-#if DEBUG_ALLOC
-    fprintf (stderr, "MpzRef deallocate %p; %p\n", npobj, ref->owner);
-#endif  /* DEBUG_ALLOC */
-    TopObject* top = MpzRef_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
-    if (ref->owner)
-        /* Decrement the Rational's reference count.  See comments in
-           Mpz_deallocate.  */
-        NPN_ReleaseObject (ref->owner);
-    NPN_MemFree (npobj);
+quota_report (TopObject* top, bool ok, NPVariant* result)
+{
+#if NPGMP_MEMORY
+    if (top->over_quota) {
+        top->over_quota = false;
+        if (ok && !top->errmsg) {
+            if (result)
+                NPN_ReleaseVariantValue (result);
+            raisef ((NPObject*) top, "memory quota exceeded");
+        }
+    }
+#endif
 }
 
-static bool
-MpzRef_invoke (NPObject *npobj, NPIdentifier name,
-               const NPVariant *args, uint32_t argCount, NPVariant *result)
-{
-    MpzRef* ref = (MpzRef*) npobj;
-    if (name == ID_toString)
-        return integer_toString (MpzRef_getTop (npobj),
-                                 ref->mpp, args, argCount, result);
-    return false;
+/* Add the limb bytes held by TOP's live objects of class CLS and
+   SIZE bytes, as measured by LIMBS, to *BYTES.  */
+static void
+census_limbs (TopObject* top, NPClass* cls, size_t size,
+              size_t (*limbs) (NPObject*), size_t* bytes)
+{
+    size_t osize = (pool_class (size) + 1) * POOL_GRAIN;
+    size_t count = (POOL_SLAB_SIZE - sizeof (PoolSlab)) / osize;
+
+    /* A free object starts with a free list link, which is never
+       CLS.  Recycled bodies have a null class.  */
+    for (PoolSlab* slab = top->pools[pool_class (size)].slabs; slab;
+         slab = slab->next)
+        for (size_t i = 0; i < count; i++) {
+            NPObject* npobj = (NPObject*) ((char*) (slab + 1) + i * osize);
+            if (npobj->_class == cls)
+                *bytes += limbs (npobj) * sizeof (mp_limb_t);
+        }
 }
 
-static void
-init_mpzref (MpzRef* ref, mpz_ptr z, mpq_ptr q)
+#if NPGMP_MPZ
+static size_t
+integer_limbs (NPObject* npobj)
 {
-    ref->mpp = z;
-    ref->owner = NPN_RetainObject (&CONTAINING (Rational, mp[0], q)->npobj);
+    mpz_ptr z = ((Integer*) npobj)->mp;
+#if MPZ_INLINE_LIMBS
+    if (z->_mp_d == ((Integer*) npobj)->limbs)
+        return 0;
+#endif
+    return z->_mp_alloc;
 }
+#endif
 
-static NPObject*
-x_x_mpq_ref (TopObject* top, mpz_ptr z, mpq_ptr q) {
-    NPObject* ret = NPN_CreateObject (top->instance, &top->MpzRef.npclass);
+#if NPGMP_MPQ
+static size_t
+rational_limbs (NPObject* npobj)
+{
+    mpq_ptr q = ((Rational*) npobj)->mp;
+    return mpq_numref (q)->_mp_alloc + mpq_denref (q)->_mp_alloc;
+}
+#endif
 
-    if (ret)
-        init_mpzref ((MpzRef*) ret, z, q);
-    else
-        raise_oom ((NPObject*) top);
-    return ret;
+#if NPGMP_MPF
+static size_t
+float_limbs (NPObject* npobj)
+{
+    Float* f = (Float*) npobj;
+    if (f->mp->_mp_d == ZeroLimbs)
+        return 0;
+    /* GMP allocates two limbs more than mpf_get_prec implies.  */
+    return (f->oprec ?: mpf_get_prec (f->mp)) / mp_bits_per_limb + 2;
 }
+#endif
 
-#define x_mpq_numref(q) x_x_mpq_ref (vTop, mpq_numref (q), q)
-#define x_mpq_denref(q) x_x_mpq_ref (vTop, mpq_denref (q), q)
+#if NPGMP_RAND
+static size_t
+rand_limbs (NPObject* npobj)
+{
+    return ((Rand*) npobj)->state->_mp_seed->_mp_alloc;
+}
+#endif
 
-#endif  /* NPGMP_MPQ */
+/* gmp.memory() returns one row per type: Integer, Rational, Float,
+   Rand, Tuple, Stack and Root.  Each is [live objects, peak live
+   objects, limb bytes].  A last row holds [GMP bytes, peak GMP bytes,
+   quota] for the instance as a whole.  */
+static NPObject*
+x_x_memory (TopObject* top)
+{
+    Census census[CENSUS_TYPES];
+    size_t bytes[CENSUS_TYPES] = { 0 };
+    Tuple* ret;
 
-/*
- * Integer argument conversion.
- */
+    /* Do not count the tuples that we return.  */
+    memcpy (census, top->census, sizeof census);
+    ret = make_tuple (top, CENSUS_TYPES + 1);
 
-static bool
-in_mpz_ptr (TopObject* top, const NPVariant* var, mpz_ptr* arg)
-{
-    if (!NPVARIANT_IS_OBJECT (*var))
-        return false;
-    if (NPVARIANT_TO_OBJECT (*var)->_class == (NPClass*) &top->Integer)
-        *arg = &((Integer*) NPVARIANT_TO_OBJECT (*var))->mp[0];
+    if (!ret) {
+        raise_oom ((NPObject*) top);
+        return 0;
+    }
+#if NPGMP_MPZ
+    census_limbs (top, &top->Integer.npclass, sizeof (Integer),
+                  integer_limbs, &bytes[CENSUS_Integer]);
+#endif
 #if NPGMP_MPQ
-    else if (NPVARIANT_TO_OBJECT (*var)->_class == (NPClass*) &top->MpzRef)
-        *arg = ((MpzRef*) NPVARIANT_TO_OBJECT (*var))->mpp;
+    census_limbs (top, &top->Rational.npclass, sizeof (Rational),
+                  rational_limbs, &bytes[CENSUS_Rational]);
 #endif
-    else
-        return false;
-    return true;
+#if NPGMP_MPF
+    census_limbs (top, &top->Float.npclass, sizeof (Float),
+                  float_limbs, &bytes[CENSUS_Float]);
+#endif
+#if NPGMP_RAND
+    census_limbs (top, &top->Rand.npclass, sizeof (Rand),
+                  rand_limbs, &bytes[CENSUS_Rand]);
+#endif
+
+    for (int t = 0; t <= CENSUS_TYPES; t++) {
+        Tuple* row = make_tuple (top, 3);
+
+        if (!row) {
+            NPN_ReleaseObject (&ret->npobj);
+            raise_oom ((NPObject*) top);
+            return 0;
+        }
+        OBJECT_TO_NPVARIANT (&row->npobj, ret->start[t]);
+        if (t < CENSUS_TYPES) {
+            (void) out_size_t (top, census[t].live, &row->start[0]);
+            (void) out_size_t (top, census[t].peak, &row->start[1]);
+            (void) out_size_t (top, bytes[t], &row->start[2]);
+        }
+        else {
+            (void) out_size_t (top, charged_bytes (top), &row->start[0]);
+#if NPGMP_MEMORY
+            (void) out_size_t (top, top->gmp_peak, &row->start[1]);
+#else
+            INT32_TO_NPVARIANT (0, row->start[1]);
+#endif
+            (void) out_size_t (top, top->quota, &row->start[2]);
+        }
+    }
+    return &ret->npobj;
 }
 
-static bool
-in_uninit_mpz (TopObject* top, const NPVariant* var, mpz_ptr* arg)
+#define x_memory() x_x_memory (vTop)
+
+/* gmp.set_memory_quota(bytes) limits the GMP memory that TOP may hold
+   to BYTES, or removes the limit if BYTES is 0.  */
+static void
+x_x_set_memory_quota (TopObject* top, size_t bytes)
 {
-    bool ret = in_mpz_ptr (top, var, arg);
-    if (ret)
-        mpz_clear (*arg);
-    return ret;
+    top->quota = bytes;
 }
 
-#define del_mpz_ptr(arg)
-#define del_uninit_mpz(arg)
+#define x_set_memory_quota(bytes) x_x_set_memory_quota (vTop, bytes)
+
 
 /*
- * Rational objects wrap mpq_t.
+ * Radix conversion.
+ *
+ * mpz_get_str and mpz_set_str are subquadratic, but they compute the
+ * powers of the base from scratch on every call.  Above
+ * RADIX_DC_THRESHOLD digits, we split numbers ourselves using powers
+ * BASE^(RADIX_LEAF_DIGITS * 2^K), which each instance computes once
+ * per base and keeps until it dies.  GMP converts the pieces.  Bases
+ * that are powers of 2 take linear time in GMP and need no powers.
  */
 
-#if NPGMP_MPQ
+#if NPGMP_MPZ
 
-static NPObject*
-Rational_allocate (NPP npp, NPClass *aClass)
+#ifndef RADIX_LEAF_DIGITS
+# define RADIX_LEAF_DIGITS 2048
+#endif
+#define RADIX_DC_THRESHOLD (4 * RADIX_LEAF_DIGITS)
+#define RADIX_MAX_LEVELS (8 * sizeof (size_t))
+
+typedef struct _RadixPowers {
+    int count;  /* number of initialized elements of pow */
+    mpz_t pow[RADIX_MAX_LEVELS];  /* pow[k] = base^(RADIX_LEAF_DIGITS << k) */
+} RadixPowers;
+
+static inline bool
+radix_cached_p (int base)
 {
-    Rational* ret = (Rational*) NPN_MemAlloc (sizeof (Rational));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Rational allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret)
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Rational, aClass));
-    return &ret->npobj;
+    return (base & (base - 1)) != 0;
 }
 
-static void
-Rational_deallocate (NPObject *npobj)
+/* Return the largest K such that (RADIX_LEAF_DIGITS << K) is at most
+   half of N_DIGITS.  */
+static int
+radix_level (size_t n_digits)
 {
-#if DEBUG_ALLOC
-    fprintf (stderr, "Rational deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
-    if (npobj)
-        mpq_clear (((Rational*) npobj)->mp);
-    TopObject* top = Rational_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
-    NPN_MemFree (npobj);
+    int k = 0;
+    while (((size_t) RADIX_LEAF_DIGITS << (k + 2)) <= n_digits)
+        k++;
+    return k;
 }
 
-static bool
-rational_toString (TopObject* top, mpq_ptr mpp, const NPVariant *args,
-                   uint32_t argCount, NPVariant *result)
+/* Return BASE^(RADIX_LEAF_DIGITS << LEVEL), or null if out of memory.
+   BASE must be from 2 to 62.  */
+static mpz_srcptr
+radix_power (TopObject* top, int base, int level)
 {
-    int base = 0;
+    RadixPowers* rp = top->radix_powers[base - 2];
 
-    if (argCount < 1 || !in_int (top, &args[0], &base))
-        base = 10;
+    if (!rp) {
+        rp = (RadixPowers*) NPN_MemAlloc (sizeof *rp);
+        if (!rp)
+            return 0;
+        rp->count = 0;
+        top->radix_powers[base - 2] = rp;
+    }
 
-    if (base >= -36 && base <= 62 && base != 0 && base != -1 && base != 1) {
-        size_t len = mpz_sizeinbase (mpq_numref (mpp), base)
-            + mpz_sizeinbase (mpq_denref (mpp), base) + 3;
-        NPUTF8* s = (NPUTF8*) NPN_MemAlloc (len);
-        if (s) {
-            mpq_get_str (s, base, mpp);
-            STRINGN_TO_NPVARIANT (s, len-5 + strlen (s + len-5), *result);
-        }
+    for (; rp->count <= level; rp->count++) {
+        mpz_init (rp->pow[rp->count]);
+        if (rp->count == 0)
+            mpz_ui_pow_ui (rp->pow[0], base, RADIX_LEAF_DIGITS);
         else
-            return oom ((NPObject*) top, result, true);
+            mpz_mul (rp->pow[rp->count], rp->pow[rp->count - 1],
+                     rp->pow[rp->count - 1]);
     }
-    else
-        return set_exception ((NPObject*) top, "invalid argument", result,
-                              true);
-    return true;
+    return rp->pow[level];
 }
 
-static bool
-Rational_invoke (NPObject *npobj, NPIdentifier name,
-                 const NPVariant *args, uint32_t argCount, NPVariant *result)
+static void
+free_radix_powers (TopObject* top)
+{
+    for (int i = 0; i < 61; i++) {
+        RadixPowers* rp = top->radix_powers[i];
+        if (rp) {
+            while (rp->count)
+                mpz_clear (rp->pow[--rp->count]);
+            NPN_MemFree (rp);
+            top->radix_powers[i] = 0;
+        }
+    }
+}
+
+/* Write the digits of X to DEST as mpz_get_str would, but without the
+   terminating NUL.  If WIDTH is nonzero, X must be nonnegative and
+   less than BASE^WIDTH, and the result is left-padded with zeros to
+   WIDTH digits.  Return the number of characters written.  */
+static size_t
+radix_get_str (TopObject* top, char* dest, int base, mpz_srcptr x,
+               size_t width)
+{
+    int abase = (base < 0 ? -base : base);
+    size_t n_digits = width ?: mpz_sizeinbase (x, abase);
+    mpz_srcptr power = 0;
+    size_t len, m, off = 0;
+    int k = 0;
+
+    if (n_digits >= RADIX_DC_THRESHOLD) {
+        k = radix_level (n_digits);
+        power = radix_power (top, abase, k);
+    }
+
+    if (!power) {
+        if (width && mpz_sgn (x) == 0) {
+            memset (dest, '0', width);
+            return width;
+        }
+        mpz_get_str (dest, base, x);
+        len = strlen (dest);
+        if (width > len) {
+            memmove (dest + (width - len), dest, len);
+            memset (dest, '0', width - len);
+            len = width;
+        }
+        return len;
+    }
+
+    mpz_t q, r;
+    mpz_init (q);
+    mpz_init (r);
+    mpz_tdiv_qr (q, r, x, power);
+    if (mpz_sgn (x) < 0) {
+        dest[off++] = '-';
+        mpz_neg (q, q);
+        mpz_neg (r, r);
+    }
+
+    m = (size_t) RADIX_LEAF_DIGITS << k;
+    if (width || mpz_sgn (q))
+        off += radix_get_str (top, dest + off, base, q, width ? width - m : 0);
+    off += radix_get_str (top, dest + off, base, r,
+                          width || mpz_sgn (q) ? m : 0);
+    mpz_clear (q);
+    mpz_clear (r);
+    return off;
+}
+
+/* Like mpz_get_str (DEST, BASE, Z) but return the length.  */
+static size_t
+x_mpz_get_str (TopObject* top, char* dest, int base, mpz_srcptr z)
 {
-    Rational* z = (Rational*) npobj;
-    if (name == ID_toString)
-        return rational_toString (Rational_getTop (npobj),
-                                  z->mp, args, argCount, result);
-    return false;
+    int abase = (base < 0 ? -base : base);
+    size_t len;
+
+    if (!radix_cached_p (abase) ||
+        mpz_sizeinbase (z, abase) < RADIX_DC_THRESHOLD) {
+        mpz_get_str (dest, base, z);
+        return strlen (dest);
+    }
+    len = radix_get_str (top, dest, base, z, 0);
+    dest[len] = '\0';
+    return len;
 }
 
-static bool
-in_mpq_ptr (TopObject* top, const NPVariant* var, mpq_ptr* arg)
+/* Set ROP from the N digits at S, which must not contain whitespace
+   or signs.  Return 0 or -1 as mpz_set_str does.  */
+static int
+radix_set_str (TopObject* top, mpz_ptr rop, char* s, size_t n, int base)
 {
-    if (!NPVARIANT_IS_OBJECT (*var)
-        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Rational)
-        return false;
-    *arg = &((Rational*) NPVARIANT_TO_OBJECT (*var))->mp[0];
-    return true;
+    mpz_srcptr power = 0;
+    size_t m;
+    int k = 0;
+    int ret;
+
+    if (n >= RADIX_DC_THRESHOLD) {
+        k = radix_level (n);
+        power = radix_power (top, base, k);
+    }
+
+    if (!power) {
+        char c = s[n];
+        s[n] = '\0';
+        ret = mpz_set_str (rop, s, base);
+        s[n] = c;
+        return ret;
+    }
+
+    m = (size_t) RADIX_LEAF_DIGITS << k;
+    ret = radix_set_str (top, rop, s, n - m, base);
+    if (ret == 0) {
+        mpz_t low;
+        mpz_init (low);
+        ret = radix_set_str (top, low, s + (n - m), m, base);
+        mpz_mul (rop, rop, power);
+        mpz_add (rop, rop, low);
+        mpz_clear (low);
+    }
+    return ret;
 }
 
-static bool
-in_uninit_mpq (TopObject* top, const NPVariant* var, mpq_ptr* arg)
+/* Like mpz_set_str, but STR must have come from in_stringz, since we
+   modify it temporarily.  */
+static int
+x_x_mpz_set_str (TopObject* top, mpz_ptr rop, stringz str, int base)
 {
-    bool ret = in_mpq_ptr (top, var, arg);
-    if (ret)
-        mpq_clear (*arg);
+    char* s = (char*) str;
+    bool negative = (*s == '-');
+    size_t n;
+    int ret;
+
+    if (base < 2 || !radix_cached_p (base))
+        return mpz_set_str (rop, str, base);
+
+    s += negative;
+    n = strlen (s);
+    if (n < RADIX_DC_THRESHOLD || strpbrk (s, "- \t\n\v\f\r"))
+        return mpz_set_str (rop, str, base);
+
+    ret = radix_set_str (top, rop, s, n, base);
+    if (negative)
+        mpz_neg (rop, rop);
     return ret;
 }
 
-#define del_mpq_ptr(arg)
-#define del_uninit_mpq(arg)
+#define x_mpz_set_str(rop, str, base) x_x_mpz_set_str (vTop, rop, str, base)
 
-static NPObject*
-x_x_mpq (TopObject* top)
+static int
+x_x_mpz_init_set_str (TopObject* top, mpz_ptr rop, stringz str, int base)
 {
-    NPObject* ret = NPN_CreateObject (top->instance, &top->Rational.npclass);
-    if (ret)
-        mpq_init (&((Rational*) ret)->mp[0]);
-    else
-        raise_oom ((NPObject*) top);
-    return ret;
+    mpz_init (rop);
+    return x_x_mpz_set_str (top, rop, str, base);
 }
 
-#define x_mpq() x_x_mpq (vTop)
+#define x_mpz_init_set_str(rop, str, base)      \
+    x_x_mpz_init_set_str (vTop, rop, str, base)
 
-static Bool
-is_mpq (Variant var)
+#if NPGMP_MPQ
+
+static int
+x_x_mpq_set_str (TopObject* top, mpq_ptr rop, stringz str, int base)
 {
-    if (!NPVARIANT_IS_OBJECT (*var.arg))
-        return false;
-    NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
-    if (npobj->_class == (NPClass*) &var.top->Rational)
-        return true;
-    return false;
+    char* slash = strchr (str, '/');
+    int ret;
+
+    if (!slash) {
+        mpz_set_ui (mpq_denref (rop), 1);
+        return x_x_mpz_set_str (top, mpq_numref (rop), str, base);
+    }
+    *slash = '\0';
+    ret = x_x_mpz_set_str (top, mpq_numref (rop), str, base);
+    *slash = '/';
+    if (ret == 0)
+        ret = x_x_mpz_set_str (top, mpq_denref (rop), slash + 1, base);
+    return ret;
 }
 
+#define x_mpq_set_str(rop, str, base) x_x_mpq_set_str (vTop, rop, str, base)
+
 #endif  /* NPGMP_MPQ */
+
 #endif  /* NPGMP_MPZ */
 
+
 /*
- * Float objects wrap mpf_t.
+ * Integer objects wrap mpz_t.
  */
 
-#if NPGMP_MPF
+#if NPGMP_MPZ
 
-static NPObject*
-Float_allocate (NPP npp, NPClass *aClass)
-{
-    Float* ret = (Float*) NPN_MemAlloc (sizeof (Float));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Float allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret)
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Float, aClass));
-    return &ret->npobj;
+/* Initialize Z's number to use its inline limbs.  */
+static void
+integer_init (TopObject* top, Integer* z)
+{
+#if MPZ_INLINE_LIMBS
+    z->header.h.owner = top;
+    z->header.h.capacity = 0;
+    limb_set_magic (z->limbs);
+    z->mp->_mp_alloc = MPZ_INLINE_LIMBS;
+    z->mp->_mp_size = 0;
+    z->mp->_mp_d = z->limbs;
+#else
+    mpz_init (z->mp);
+#endif
 }
 
+/* mpz.clone makes Integers that share limbs.  They form a ring linked
+   both ways through their twin and prev_twin fields, and none may
+   change the limbs until it leaves the ring.  A constant from
+   mpz.const is its own twin and never leaves.  */
 static void
-Float_deallocate (NPObject *npobj)
+integer_link (Integer* z, Integer* after)
 {
-#if DEBUG_ALLOC
-    fprintf (stderr, "Float deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
-    if (npobj)
-        mpf_clear (((Float*) npobj)->mp);
-    TopObject* top = Float_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
-    NPN_MemFree (npobj);
+    Integer* next = (after->twin ? after->twin : after);
+
+    z->twin = next;
+    z->prev_twin = after;
+    next->prev_twin = z;
+    after->twin = z;
 }
 
 static void
-x_gmp_free (void *ptr, size_t size)
+integer_unlink (Integer* z)
 {
-    void *(*alloc_func_ptr) (size_t);
-    void *(*realloc_func_ptr) (void *, size_t, size_t);
-    void (*free_func_ptr) (void *, size_t);
+    Integer* prev = z->prev_twin;
+    Integer* next = z->twin;
 
-    mp_get_memory_functions (&alloc_func_ptr, &realloc_func_ptr,
-                             &free_func_ptr);
-    (*free_func_ptr) (ptr, size);
+    if (next == prev)
+        next->twin = next->prev_twin = 0;
+    else {
+        prev->twin = next;
+        next->prev_twin = prev;
+    }
+    z->twin = z->prev_twin = 0;
 }
 
-/* XXX toString should behave a little differently.  toExponential would
-   be closer, but not exactly this.  */
-static bool
-float_toString (TopObject *top, mpf_ptr mpp, const NPVariant *args,
-                uint32_t argCount, NPVariant *result)
+/* A and B have swapped values, so each takes the other's place in
+   its ring, if any.  They must not share limbs.  */
+static void
+integer_exchange (Integer* a, Integer* b)
 {
-    int base;
-    size_t n_digits;
-    mp_exp_t expt;
-    char* str;
-    size_t allocated;
-    bool ret = true;
-
-    if (argCount < 1 || !in_int (top, args, &base))
-        base = 10;
-
-    if (argCount < 2 || !in_size_t (top, args + 1, &n_digits))
-        n_digits = 0;
-
-    if (base >= -36 && base <= 62 && base != 0 && base != -1 && base != 1) {
-        NPUTF8* s;
-
-        /* XXX could preallocate for n_digits != 0. */
-        str = mpf_get_str (NULL, &expt, base, n_digits, mpp);
-        if (!str)
-            return oom ((NPObject*) top, result, true);
-
-        allocated = strlen (str) + 1;
-        if (allocated == 1) {
-            s = (NPUTF8*) NPN_MemAlloc (sizeof "0");
-            if (s) {
-                strcpy (s, "0");
-                STRINGZ_TO_NPVARIANT (s, *result);
-            }
-            else
-                ret = oom ((NPObject*) top, result, true);
-        }
-        else {
-            size_t len = allocated + 4 + 3 * sizeof expt;
-            size_t pos = 0;
+    Integer* next = a->twin;
+    Integer* prev = a->prev_twin;
 
-            s = (NPUTF8*) NPN_MemAlloc (len);
-            if (s) {
-                if (str[pos] == '-') {
-                    s[pos] = str[pos];
-                    pos++;
-                }
-                sprintf (&s[pos], "%c.%se%ld", str[pos], str + pos + 1,
-                         (long) expt - 1);
-                STRINGZ_TO_NPVARIANT (s, *result);
-            }
-            else
-                ret = oom ((NPObject*) top, result, true);
-        }
-
-        x_gmp_free (str, allocated);
+    a->twin = b->twin;
+    a->prev_twin = b->prev_twin;
+    if (a->twin) {
+        a->twin->prev_twin = a;
+        a->prev_twin->twin = a;
+    }
+    b->twin = next;
+    b->prev_twin = prev;
+    if (next) {
+        next->prev_twin = b;
+        prev->twin = b;
     }
-    else
-        return set_exception ((NPObject*) top, "invalid base", result, true);
-    return ret;
-}
-
-static bool
-Float_invoke (NPObject *npobj, NPIdentifier name,
-              const NPVariant *args, uint32_t argCount, NPVariant *result)
-{
-    Float* z = (Float*) npobj;
-    if (name == ID_toString)
-        return float_toString (Float_getTop (npobj),
-                               z->mp, args, argCount, result);
-    return false;
-}
-
-static bool
-in_mpf_ptr (TopObject* top, const NPVariant* var, mpf_ptr* arg)
-{
-    if (!NPVARIANT_IS_OBJECT (*var)
-        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Float)
-        return false;
-    *arg = &((Float*) NPVARIANT_TO_OBJECT (*var))->mp[0];
-    return true;
 }
 
+/* Give Z limbs of its own, copying the shared value unless the caller
+   is about to reinitialize Z.  */
 static void
-restore_prec (mpf_ptr mpp)
+integer_unshare (TopObject* top, Integer* z, bool copy)
 {
-    Float* f = CONTAINING (Float, mp[0], mpp);
+    if (z->twin) {
+        __mpz_struct shared = *z->mp;
 
-    if (f->oprec) {
-        mpf_set_prec_raw (mpp, f->oprec);
-        f->oprec = 0;
+        integer_unlink (z);
+        integer_init (top, z);
+        if (copy)
+            mpz_set (z->mp, &shared);
     }
 }
 
-static bool
-in_uninit_mpf (TopObject* top, const NPVariant* var, mpf_ptr* arg)
+static NPObject*
+Integer_allocate (NPP npp, NPClass *aClass)
 {
-    bool ret = in_mpf_ptr (top, var, arg);
+    TopObject* top = CONTAINING (TopObject, Integer, aClass);
+    Recycle* bin = &top->recycled_mpz;
+    Integer* ret = (Integer*) (recycle_take (bin, top->mpz_hint, mpz_capacity)
+                               ?: recycle_take (bin, 0, 0));
 
+    top->mpz_hint = 0;
+    if (ret)
+        mpz_set_ui (ret->mp, 0);
+    else {
+        ret = (Integer*) pool_alloc (top, sizeof (Integer));
+        if (ret) {
+            ret->twin = ret->prev_twin = 0;
+            integer_init (top, ret);
+        }
+    }
+#if DEBUG_ALLOC
+    fprintf (stderr, "Integer allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
     if (ret) {
-        restore_prec (*arg);
-        mpf_clear (*arg);
+        NPN_RetainObject ((NPObject*) top);
+        census_born (top, CENSUS_Integer);
     }
-    return ret;
+    return (NPObject*) ret;
 }
 
-static mp_bitcnt_t
-x_x_mpf_get_default_prec (TopObject* top)
+static void
+Integer_deallocate (NPObject *npobj)
 {
-    return top->default_mpf_prec ?: mpf_get_default_prec ();
+#if DEBUG_ALLOC
+    fprintf (stderr, "Integer deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    TopObject* top = Integer_getTop (npobj);
+    mpz_ptr z = ((Integer*) npobj)->mp;
+
+    if (((Integer*) npobj)->twin == (Integer*) npobj)
+        ((Integer*) npobj)->twin = 0;  /* a constant */
+    if (((Integer*) npobj)->twin) {
+        /* Leave the limbs to our clones.  */
+        integer_unlink ((Integer*) npobj);
+        pool_free (top, npobj, sizeof (Integer));
+    }
+    else if (!recycle_put (top, &top->recycled_mpz, npobj, z->_mp_alloc)) {
+        mpz_clear (z);
+        pool_free (top, npobj, sizeof (Integer));
+    }
+    census_died (top, CENSUS_Integer);
+    NPN_ReleaseObject ((NPObject*) top);
 }
 
-#define x_mpf_get_default_prec() x_x_mpf_get_default_prec (vTop)
-
-static void
-x_x_mpf_set_default_prec (TopObject* top, mp_bitcnt_t prec)
+static bool
+integer_toString (TopObject *top, mpz_ptr mpp, const NPVariant *args,
+                  uint32_t argCount, NPVariant *result)
 {
-    top->default_mpf_prec = (prec ?: 1);
-}
+    int base = 0;
 
-#define x_mpf_set_default_prec(prec) x_x_mpf_set_default_prec (vTop, prec)
+    if (argCount < 1)
+        base = 10;
 
-static void
-x_x_mpf_init (TopObject* top, mpf_ptr f)
-{
-    if (top->default_mpf_prec)
-        mpf_init2 (f, top->default_mpf_prec);
-    else
-        mpf_init (f);
+    else if (!in_output_base (top, &args[0], &base)) {
+        return set_exception ((NPObject*) top, "invalid argument", result,
+                              true);
+    }
+
+    size_t len = mpz_sizeinbase (mpp, base < 0 ? -base : base) + 2;
+    NPUTF8* s = (NPUTF8*) NPN_MemAlloc (len);
+    if (!s)
+        return oom ((NPObject*) top, result, true);
+
+    len = x_mpz_get_str (top, s, base, mpp);
+    STRINGN_TO_NPVARIANT (s, len, *result);
+    return true;
 }
 
 static bool
-in_defprec_mpf (TopObject* top, const NPVariant* var, mpf_ptr* arg)
+Integer_invoke (NPObject *npobj, NPIdentifier name,
+                const NPVariant *args, uint32_t argCount, NPVariant *result)
 {
-    bool ret = in_uninit_mpf (top, var, arg);
-    if (ret)
-        x_x_mpf_init (top, *arg);
-    return ret;
+    Integer* z = (Integer*) npobj;
+    if (name == ID_toString)
+        return integer_toString (Integer_getTop (npobj),
+                                 z->mp, args, argCount, result);
+    return false;
 }
 
-#define del_mpf_ptr(arg)
-#define del_uninit_mpf(arg)
-#define del_defprec_mpf(arg)
-
+/* Return a new Integer.  LIMBS is the size of the value it will
+   receive, if known, so that Integer_allocate can pick a recycled
+   body with room for it.  */
 static NPObject*
-x_x_mpf (TopObject* top)
+x_x_mpz (TopObject* top, size_t limbs)
 {
-    NPObject* ret = NPN_CreateObject (top->instance, &top->Float.npclass);
-    if (ret)
-        x_x_mpf_init (top, &((Float*) ret)->mp[0]);
-    else
+    NPObject* ret;
+
+    top->mpz_hint = limbs;
+    ret = NPN_CreateObject (top->instance, &top->Integer.npclass);
+    if (!ret)
         raise_oom ((NPObject*) top);
     return ret;
 }
 
-#define x_mpf() x_x_mpf (vTop)
+/* XXX Could avoid macro use of vTop by making x_mpz a no-op and having the
+   entry return a new type that creates the object in its output method. */
+#define x_mpz() x_x_mpz (vTop, 0)
 
 static Bool
-is_mpf (Variant var)
+is_mpz (Variant var)
 {
     if (!NPVARIANT_IS_OBJECT (*var.arg))
         return false;
     NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
-    if (npobj->_class == (NPClass*) &var.top->Float)
+    if (npobj->_class == (NPClass*) &var.top->Integer)
+        return true;
+#if NPGMP_MPQ
+    if (npobj->_class == (NPClass*) &var.top->MpzRef)
         return true;
+#endif  /* NPGMP_MPQ */
     return false;
 }
 
-#define x_mpf_init(f) x_x_mpf_init (vTop, f)
+/*
+ * Class of objects "returned" by the mpq_numref and mpq_denref macros.
+ */
 
-static void
-x_mpf_clear (mpf_ptr f)
+#if NPGMP_MPQ
+
+static NPObject*
+MpzRef_allocate (NPP npp, NPClass *aClass)
 {
-    mpf_init2 (f, 1);
+    TopObject* top = CONTAINING (TopObject, MpzRef, aClass);
+    MpzRef* ret = (MpzRef*) pool_alloc (top, sizeof (MpzRef));
+#if DEBUG_ALLOC
+    fprintf (stderr, "MpzRef allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        ret->owner = 0;
+        NPN_RetainObject ((NPObject*) top);
+    }
+    return &ret->npobj;
 }
 
 static void
-x_mpf_set_prec (mpf_ptr f, mp_bitcnt_t prec)
+MpzRef_deallocate (NPObject *npobj)
 {
-    restore_prec (f);
-    mpf_set_prec (f, prec);
+    MpzRef* ref = (MpzRef*) npobj;
+#if DEBUG_ALLOC
+    fprintf (stderr, "MpzRef deallocate %p; %p\n", npobj, ref->owner);
+#endif  /* DEBUG_ALLOC */
+    TopObject* top = MpzRef_getTop (npobj);
+    NPObject* owner = ref->owner;
+    if (owner) {
+        /* The Rational's cache does not count as a reference.  */
+        Rational* q = (Rational*) owner;
+        q->ref[q->ref[1] == ref] = 0;
+    }
+    pool_free (top, npobj, sizeof (MpzRef));
+    if (owner)
+        /* Decrement the Rational's reference count.  See comments in
+           Mpz_deallocate.  */
+        NPN_ReleaseObject (owner);
+    NPN_ReleaseObject ((NPObject*) top);
 }
 
-static void
-x_mpf_set_prec_raw (mpf_ptr mpp, mp_bitcnt_t prec)
+static bool
+MpzRef_invoke (NPObject *npobj, NPIdentifier name,
+               const NPVariant *args, uint32_t argCount, NPVariant *result)
 {
-    Float* f = CONTAINING (Float, mp[0], mpp);
-
-    if (!f->oprec)
-        f->oprec = mpf_get_prec (mpp);
-    if (prec <= f->oprec)
-        mpf_set_prec_raw (mpp, prec);
+    MpzRef* ref = (MpzRef*) npobj;
+    if (name == ID_toString)
+        return integer_toString (MpzRef_getTop (npobj),
+                                 ref->mpp, args, argCount, result);
+    return false;
 }
 
-static NPString
-x_mpf_get_str (mp_exp_t* exp, int base, size_t n_digits, mpf_ptr f)
+static void
+init_mpzref (MpzRef* ref, mpz_ptr z, mpq_ptr q)
 {
-    char* str;
-    size_t len;
-    NPUTF8* s;
-    NPString ret;
+    ref->mpp = z;
+    ref->owner = NPN_RetainObject (&CONTAINING (Rational, mp[0], q)->npobj);
+}
 
-    /* XXX could preallocate the buffer for n_digits != 0. */
-    str = mpf_get_str (NULL, exp, base, n_digits, f);
-    if (str) {
-        len = strlen (str);
-        s = (NPUTF8*) NPN_MemAlloc (len);
-        if (s || !len)
-            memcpy (s, str, len);
-    }
-    else {
-        /* Tell out_npstring to raise out-of-memory.  */
-        len = 1;
-        s = 0;
+/* A Rational keeps its numerator and denominator views while any
+   script holds them, so repeated mpq.numref calls return one object.  */
+static NPObject*
+x_x_mpq_ref (TopObject* top, mpz_ptr z, mpq_ptr q) {
+    Rational* owner = CONTAINING (Rational, mp[0], q);
+    MpzRef** slot = &owner->ref[z == mpq_denref (q)];
+    NPObject* ret;
+
+    /* Integer functions write through the view.  */
+    rational_touch (owner);
+    if (*slot)
+        return NPN_RetainObject (&(*slot)->npobj);
+    ret = NPN_CreateObject (top->instance, &top->MpzRef.npclass);
+    if (ret) {
+        init_mpzref ((MpzRef*) ret, z, q);
+        *slot = (MpzRef*) ret;
     }
-
-    x_gmp_free (str, len + 1);
-    ret.UTF8Length = len;
-    ret.UTF8Characters = s;
+    else
+        raise_oom ((NPObject*) top);
     return ret;
 }
 
-#endif  /* NPGMP_MPF */
+#define x_mpq_numref(q) x_x_mpq_ref (vTop, mpq_numref (q), q)
+#define x_mpq_denref(q) x_x_mpq_ref (vTop, mpq_denref (q), q)
+
+#endif  /* NPGMP_MPQ */
 
 /*
- * Rand objects wrap gmp_randstate_t.
+ * Integer argument conversion.
  */
 
-#if NPGMP_RAND
+static bool
+in_mpz_ptr (TopObject* top, const NPVariant* var, mpz_ptr* arg)
+{
+    NPObject* npobj;
 
-static NPObject*
-Rand_allocate (NPP npp, NPClass *aClass)
-{
-    Rand* ret = (Rand*) NPN_MemAlloc (sizeof (Rand));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Rand allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret)
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Rand, aClass));
-    return &ret->npobj;
+    if (!NPVARIANT_IS_OBJECT (*var))
+        return false;
+    npobj = NPVARIANT_TO_OBJECT (*var);
+    if (npobj->_class == (NPClass*) &top->Integer)
+        *arg = &((Integer*) npobj)->mp[0];
+#if NPGMP_MPQ
+    else if (npobj->_class == (NPClass*) &top->MpzRef)
+        *arg = ((MpzRef*) npobj)->mpp;
+#endif
+    else
+        return false;
+    return true;
 }
 
-static void
-Rand_deallocate (NPObject *npobj)
+#if NPGMP_MPQ
+static void rational_unshare (TopObject* top, Rational* q, bool copy);
+#endif
+
+/* Stop the mpz in VAR sharing limbs with clones, so that it may be
+   changed.  COPY is as for integer_unshare.  Constants may not be
+   changed.  */
+static bool
+unshare_mpz (TopObject* top, const NPVariant* var, bool copy)
 {
-#if DEBUG_ALLOC
-    fprintf (stderr, "Rand deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
-    if (npobj)
-        gmp_randclear (((Rand*) npobj)->state);
-    TopObject* top = Rand_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
-    NPN_MemFree (npobj);
+    NPObject* npobj = NPVARIANT_TO_OBJECT (*var);
+
+    if (npobj->_class == (NPClass*) &top->Integer) {
+        if (((Integer*) npobj)->twin == (Integer*) npobj) {
+            raisef ((NPObject*) top, "mpz constant is read-only");
+            return false;
+        }
+        integer_unshare (top, (Integer*) npobj, copy);
+    }
+#if NPGMP_MPQ
+    else
+        rational_unshare (top, (Rational*) ((MpzRef*) npobj)->owner, true);
+#endif
+    return true;
 }
 
 static bool
-in_x_gmp_randstate_ptr (TopObject* top, const NPVariant* var,
-                        x_gmp_randstate_ptr* arg)
+in_uninit_mpz (TopObject* top, const NPVariant* var, mpz_ptr* arg)
 {
-    if (!NPVARIANT_IS_OBJECT (*var)
-        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Rand)
+    if (!in_mpz_ptr (top, var, arg) || !unshare_mpz (top, var, false))
         return false;
-    *arg = &((Rand*) NPVARIANT_TO_OBJECT (*var))->state[0];
+    mpz_clear (*arg);
     return true;
 }
 
+/* A dest_mpz argument receives a result.  */
 static bool
-in_uninit_rand (TopObject* top, const NPVariant* var, x_gmp_randstate_ptr* arg)
+in_dest_mpz (TopObject* top, const NPVariant* var, mpz_ptr* arg)
 {
-    bool ret = in_x_gmp_randstate_ptr (top, var, arg);
-    if (ret)
-        gmp_randclear (*arg);
-    return ret;
+    return in_mpz_ptr (top, var, arg) && unshare_mpz (top, var, true);
 }
 
-#define del_x_gmp_randstate_ptr(arg)
-#define del_uninit_rand(arg)
+#define del_mpz_ptr(arg)
+#define del_uninit_mpz(arg)
+#define del_dest_mpz(arg)
 
-static NPObject*
-x_x_randstate (TopObject* top)
+#if MPZ_INLINE_LIMBS
+static inline bool
+mpz_inline_p (mpz_srcptr z)
 {
-    NPObject* ret = NPN_CreateObject (top->instance, &top->Rand.npclass);
-    if (ret)
-        gmp_randinit_default (&((Rand*) ret)->state[0]);
-    else
-        raise_oom ((NPObject*) top);
-    return ret;
+    return z->_mp_alloc && ((LimbHeader*) z->_mp_d - 1)->h.capacity == 0;
 }
+#endif
 
-#define x_randstate() x_x_randstate (vTop)
+/* Inline limbs must stay with their Integer, so swapping copies a
+   number that uses them.  */
+static void
+swap_limbs (mpz_ptr a, mpz_ptr b)
+{
+#if MPZ_INLINE_LIMBS
+    if (mpz_inline_p (a) || mpz_inline_p (b)) {
+        mpz_ptr small = (mpz_inline_p (a) ? a : b);
+        mpz_ptr other = (small == a ? b : a);
+        mpz_t t;
+
+        mpz_init_set (t, small);
+        if (mpz_inline_p (other)) {
+            mpz_set (small, other);
+            mpz_set (other, t);
+            mpz_clear (t);
+        }
+        else {
+            /* SMALL takes OTHER's limbs and abandons its own.  */
+            *small = *other;
+            *other = *t;
+        }
+        return;
+    }
+#endif
+    mpz_swap (a, b);
+}
 
-static Bool
-is_randstate (Variant var)
+/* mpz.swap(a, b) exchanges the values of A and B.  Clones trade places
+   in their rings rather than copying the shared limbs.  */
+static void
+x_mpz_swap (Variant va, Variant vb)
 {
-    if (!NPVARIANT_IS_OBJECT (*var.arg))
-        return false;
-    NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
-    if (npobj->_class == (NPClass*) &var.top->Rand)
-        return true;
-    return false;
+    TopObject* top = va.top;
+    NPObject* oa;
+    NPObject* ob;
+    mpz_ptr a, b;
+
+    if (!in_mpz_ptr (top, va.arg, &a) || !in_mpz_ptr (top, vb.arg, &b)) {
+        raisef ((NPObject*) top, "not an mpz");
+        return;
+    }
+    oa = NPVARIANT_TO_OBJECT (*va.arg);
+    ob = NPVARIANT_TO_OBJECT (*vb.arg);
+    if (oa->_class != (NPClass*) &top->Integer
+        || ob->_class != (NPClass*) &top->Integer) {
+        /* An MpzRef's limbs belong to its Rational.  */
+        if (unshare_mpz (top, va.arg, true) && unshare_mpz (top, vb.arg, true))
+            swap_limbs (a, b);
+        return;
+    }
+    if (((Integer*) oa)->twin == (Integer*) oa
+        || ((Integer*) ob)->twin == (Integer*) ob) {
+        raisef ((NPObject*) top, "mpz constant is read-only");
+        return;
+    }
+    if (a->_mp_d == b->_mp_d)
+        return;  /* the same number, or clones of one */
+    swap_limbs (a, b);
+    integer_exchange ((Integer*) oa, (Integer*) ob);
 }
 
-static int
-x_randinit_lc_2exp_size (uninit_rand state, mp_bitcnt_t size)
+/* mpz.clone(op) returns a new mpz equal to OP.  When OP is an Integer
+   with limbs on the heap, the two share them until either is used as
+   a destination.  */
+static NPObject*
+x_mpz_clone (Variant var)
 {
-    int ret = gmp_randinit_lc_2exp_size (state, size);
-    if (!ret)
-        /* Rand_deallocate calls gmp_randclear, so must init.  */
-        gmp_randinit_default (state);
-    return ret;
-}
+    TopObject* top = var.top;
+    mpz_ptr op;
+    Integer* src;
+    Integer* ret;
 
-#endif  /* NPGMP_RAND */
+    if (!in_mpz_ptr (top, var.arg, &op)) {
+        raisef ((NPObject*) top, "not an mpz");
+        return 0;
+    }
+    src = (Integer*) NPVARIANT_TO_OBJECT (*var.arg);
+    if (src->npobj._class != (NPClass*) &top->Integer || op->_mp_alloc == 0
+        || src->twin == src
+#if MPZ_INLINE_LIMBS
+        || mpz_inline_p (op)
+#endif
+        )
+        src = 0;
 
-typedef char EntryInfo;
+    ret = (Integer*) x_x_mpz (top, src ? 0 : mpz_size (op));
+    if (!ret)
+        return 0;
+    if (!src)
+        mpz_set (ret->mp, op);
+    else {
+        mpz_clear (ret->mp);
+        *ret->mp = *op;
+        integer_link (ret, src);
+    }
+    return &ret->npobj;
+}
 
 /*
- * Class of ordinary functions like mpz_init and mpz_add.
+ * mpz.const(k) and mpz.pow2(n) return read-only Integers holding
+ * small values, so that scripts need not allocate an mpz for every
+ * comparison or increment.  Each is made on first use and kept until
+ * the instance is destroyed.
  */
 
-typedef struct _Entry {
-    NPObject npobj;
-    int number;  /* unique ID; currently, a line number in gmp-entries.h */
-    const EntryInfo* info;
-} Entry;
+static NPObject*
+mpz_constant (TopObject* top, NPObject** slot, long value, mp_bitcnt_t shift)
+{
+    Integer* z = (Integer*) *slot;
+
+    if (!z) {
+        z = (Integer*) x_x_mpz (top, shift / GMP_NUMB_BITS + 1);
+        if (!z)
+            return 0;
+        mpz_set_si (z->mp, value);
+        mpz_mul_2exp (z->mp, z->mp, shift);
+        z->twin = z;
+        *slot = &z->npobj;
+    }
+    return NPN_RetainObject (&z->npobj);
+}
 
 static NPObject*
-Entry_allocate (NPP npp, NPClass *aClass)
+x_x_mpz_const (TopObject* top, long k)
 {
-    Entry* ret = (Entry*) NPN_MemAlloc (sizeof (Entry));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Entry allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret)
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Entry, aClass));
-    return &ret->npobj;
+    if (k < MPZ_CONST_MIN || k > MPZ_CONST_MAX) {
+        raisef ((NPObject*) top, "no such constant");
+        return 0;
+    }
+    return mpz_constant (top, &top->mpz_const[k - MPZ_CONST_MIN], k, 0);
 }
 
-static const char Properties[] =
-
-#define ENTRY(nargs, nret, string, id)    "\0" STRINGIFY(__LINE__) "|" string
-#include "gmp-entries.h"
+#define x_mpz_const(k) x_x_mpz_const (vTop, k)
 
-#define CONSTANT(constval, string, type)  "\0|" string
-#include "gmp-constants.h"
+static NPObject*
+x_x_mpz_pow2 (TopObject* top, mp_bitcnt_t n)
+{
+    if (n < 16 && (1L << n) <= MPZ_CONST_MAX)
+        return x_x_mpz_const (top, 1L << n);
+    if (n >= MPZ_POW2_COUNT) {
+        raisef ((NPObject*) top, "no such constant");
+        return 0;
+    }
+    return mpz_constant (top, &top->mpz_pow2[n], 1, n);
+}
 
-    "\0";
+#define x_mpz_pow2(n) x_x_mpz_pow2 (vTop, n)
 
-static const EntryInfo*
-first_entry ()
+static void
+free_constants (TopObject* top)
 {
-    return &Properties[1];
+    for (size_t i = 0; i < MPZ_CONST_MAX - MPZ_CONST_MIN + 1; i++)
+        if (top->mpz_const[i]) {
+            NPN_ReleaseObject (top->mpz_const[i]);
+            top->mpz_const[i] = 0;
+        }
+    for (size_t i = 0; i < MPZ_POW2_COUNT; i++)
+        if (top->mpz_pow2[i]) {
+            NPN_ReleaseObject (top->mpz_pow2[i]);
+            top->mpz_pow2[i] = 0;
+        }
 }
 
-static const EntryInfo*
-next_entry (const EntryInfo* info)
+/*
+ * Functions that can make a huge number from small arguments check
+ * the memory quota first, using an upper bound on the result's size
+ * in bits.
+ */
+
+static void
+x_x_mpz_init2 (TopObject* top, mpz_ptr z, mp_bitcnt_t n)
 {
-    const char* ret = info + strlen (info) + 1;
-    return (*ret ? ret : 0);
+    if (quota_check (top, n))
+        mpz_init2 (z, n);
+    else
+        mpz_init (z);  /* Leave Z valid.  */
 }
 
-static const char*
-EntryInfo_name (const EntryInfo* info)
+#define x_mpz_init2(z, n) x_x_mpz_init2 (vTop, z, n)
+
+static void
+x_x_mpz_realloc2 (TopObject* top, mpz_ptr z, mp_bitcnt_t n)
 {
-    return strchr (info, '|') + 1;
+    if (quota_check (top, n))
+        mpz_realloc2 (z, n);
 }
 
-static bool
-is_table_entry (const char* info)
+#define x_mpz_realloc2(z, n) x_x_mpz_realloc2 (vTop, z, n)
+
+static void
+x_x_mpz_mul_2exp (TopObject* top, mpz_ptr rop, mpz_ptr op, mp_bitcnt_t n)
 {
-    return info >= &Properties[0] &&
-        info < &Properties[sizeof Properties];
+    if (mpz_sgn (op) == 0 ||
+        quota_check (top, (double) mpz_sizeinbase (op, 2) + n))
+        mpz_mul_2exp (rop, op, n);
 }
 
-static const EntryInfo*
-lookup (const NPUTF8* name)
+#define x_mpz_mul_2exp(rop, op, n) x_x_mpz_mul_2exp (vTop, rop, op, n)
+
+static void
+x_x_mpz_pow_ui (TopObject* top, mpz_ptr rop, mpz_ptr base, ulong exp)
 {
-    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
-        if (!strcmp (name, EntryInfo_name (i)))
-            return i;
-    }
-    return 0;
+    if (mpz_cmpabs_ui (base, 1) <= 0 ||
+        quota_check (top, (double) mpz_sizeinbase (base, 2) * exp))
+        mpz_pow_ui (rop, base, exp);
 }
 
+#define x_mpz_pow_ui(rop, base, exp) x_x_mpz_pow_ui (vTop, rop, base, exp)
+
 static void
-EntryInfo_deallocate (const EntryInfo* info)
+x_x_mpz_ui_pow_ui (TopObject* top, mpz_ptr rop, ulong base, ulong exp)
 {
-    /* If it's not in our const table, it came from NPN_MemAlloc. */
-    if (!is_table_entry (info))
-        NPN_MemFree ((void*) info);
+    if (base <= 1 || quota_check (top, (log2 (base) + 1) * exp))
+        mpz_ui_pow_ui (rop, base, exp);
 }
 
-static int
-EntryInfo_number (const EntryInfo* info)
+#define x_mpz_ui_pow_ui(rop, base, exp)         \
+    x_x_mpz_ui_pow_ui (vTop, rop, base, exp)
+
+static void
+x_x_mpz_fac_ui (TopObject* top, mpz_ptr rop, ulong n)
 {
-    return atoi (info);
+    if (quota_check (top, n * log2 (n + 1.0)))
+        mpz_fac_ui (rop, n);
 }
 
-static bool
-has_properties (const NPUTF8* name)
+#define x_mpz_fac_ui(rop, n) x_x_mpz_fac_ui (vTop, rop, n)
+
+/* C(n, k) is a product of k factors of at most N over k!, and for N
+   at least zero it equals C(n, n - k), so only min(k, n - k) factors
+   count.  It is zero when K exceeds such an N.  */
+static void
+x_x_mpz_bin_ui (TopObject* top, mpz_ptr rop, mpz_ptr n, ulong k)
 {
-    size_t len = strlen (name);
+    double factors = k;
 
-    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
-        const char* iname = EntryInfo_name (i);
-        if (!strncmp (name, iname, len) && iname[len] == '.')
-            return true;
+    if (mpz_sgn (n) >= 0) {
+        mpz_t rest;
+
+        mpz_init (rest);
+        mpz_sub_ui (rest, n, k);
+        if (mpz_sgn (rest) < 0)
+            factors = 0;
+        else if (mpz_cmp_ui (rest, k) < 0)
+            factors = mpz_get_ui (rest);
+        mpz_clear (rest);
     }
-    return false;
+    if (quota_check (top, (double) mpz_sizeinbase (n, 2) * factors))
+        mpz_bin_ui (rop, n, k);
 }
 
-static const char*
-Entry_name (Entry* entry)
+#define x_mpz_bin_ui(rop, n, k) x_x_mpz_bin_ui (vTop, rop, n, k)
+
+static void
+x_x_mpz_bin_uiui (TopObject* top, mpz_ptr rop, ulong n, ulong k)
 {
-    const EntryInfo* ret = entry->info;
-    if (is_table_entry (ret))
-        return EntryInfo_name (ret);
-    return (const char*) ret;
+    if (quota_check (top, n))
+        mpz_bin_uiui (rop, n, k);
 }
 
+#define x_mpz_bin_uiui(rop, n, k) x_x_mpz_bin_uiui (vTop, rop, n, k)
+
+/* Fibonacci and Lucas numbers grow by log2 of the golden ratio,
+   under 0.7 bits, per step.  */
 static void
-Entry_deallocate (NPObject *npobj)
+x_x_mpz_fib_ui (TopObject* top, mpz_ptr fn, ulong n)
 {
-#if DEBUG_ALLOC
-    fprintf (stderr, "Entry deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
-    TopObject* top = Entry_getTop (npobj);
-    EntryInfo_deallocate (((Entry*) npobj)->info);
-    NPN_ReleaseObject ((NPObject*) top);
-    NPN_MemFree (npobj);
+    if (quota_check (top, 0.7 * n))
+        mpz_fib_ui (fn, n);
 }
 
-enum Entry_number {
+#define x_mpz_fib_ui(fn, n) x_x_mpz_fib_ui (vTop, fn, n)
 
-    FIRST_ENTRY =
-#define ENTRY_GET_FIRST
-#include "gmp-entries.h"
+static void
+x_x_mpz_fib2_ui (TopObject* top, mpz_ptr fn, mpz_ptr fnsub1, ulong n)
+{
+    if (quota_check (top, 1.4 * n))
+        mpz_fib2_ui (fn, fnsub1, n);
+}
 
-#define ENTRY(nargs, nret, string, id) , id = __LINE__
-#include "gmp-entries.h"
-};
+#define x_mpz_fib2_ui(fn, fnsub1, n) x_x_mpz_fib2_ui (vTop, fn, fnsub1, n)
 
-static const unsigned char EntryNargs[] = {
-#define ENTRY(nargs, nret, string, id) [__LINE__ - FIRST_ENTRY] = nargs,
-#include "gmp-entries.h"
-    0
-};
-static const unsigned char EntryNret[] = {
-#define ENTRY(nargs, nret, string, id) [__LINE__ - FIRST_ENTRY] = nret,
-#include "gmp-entries.h"
-    0
-};
+static void
+x_x_mpz_lucnum_ui (TopObject* top, mpz_ptr ln, ulong n)
+{
+    if (quota_check (top, 0.7 * n))
+        mpz_lucnum_ui (ln, n);
+}
 
-static inline size_t
-Entry_length (NPObject *npobj) {
-    return EntryNargs[((Entry*) npobj)->number - FIRST_ENTRY];
+#define x_mpz_lucnum_ui(ln, n) x_x_mpz_lucnum_ui (vTop, ln, n)
+
+static void
+x_x_mpz_lucnum2_ui (TopObject* top, mpz_ptr ln, mpz_ptr lnsub1, ulong n)
+{
+    if (quota_check (top, 1.4 * n))
+        mpz_lucnum2_ui (ln, lnsub1, n);
 }
 
-static inline size_t
-Entry_outLength (NPObject *npobj) {
-    return EntryNret[((Entry*) npobj)->number - FIRST_ENTRY];
+#define x_mpz_lucnum2_ui(ln, lnsub1, n)         \
+    x_x_mpz_lucnum2_ui (vTop, ln, lnsub1, n)
+
+static void
+x_x_mpz_setbit (TopObject* top, mpz_ptr rop, mp_bitcnt_t bit)
+{
+    if (bit < mpz_sizeinbase (rop, 2) || quota_check (top, bit))
+        mpz_setbit (rop, bit);
 }
 
-/* Convert arguments from NPVariant to C types and free them when done.  */
+#define x_mpz_setbit(rop, bit) x_x_mpz_setbit (vTop, rop, bit)
 
-#undef IN
-#define IN(i, t) LIKELY (in_ ## t (vTop, vArgs + i, &vEntryArgs->a ## i))
+#if NPGMP_RAND
+static void
+x_x_mpz_urandomb (TopObject* top, mpz_ptr rop, x_gmp_randstate_ptr state,
+                  mp_bitcnt_t n)
+{
+    if (quota_check (top, n))
+        mpz_urandomb (rop, state, n);
+}
 
-#undef DEL
-#define DEL(i, t) del_ ## t (vEntryArgs->a ## i)
+#define x_mpz_urandomb(rop, state, n) x_x_mpz_urandomb (vTop, rop, state, n)
 
-#undef PROTO_IN
-#define PROTO_IN(id)                                            \
-    static inline bool ALWAYS_INLINE                            \
-    in__ ## id (TopObject *vTop, const NPVariant *vArgs,        \
-                Args_ ## id* vEntryArgs)
+static void
+x_x_mpz_rrandomb (TopObject* top, mpz_ptr rop, x_gmp_randstate_ptr state,
+                  mp_bitcnt_t n)
+{
+    if (quota_check (top, n))
+        mpz_rrandomb (rop, state, n);
+}
 
-#undef PROTO_DEL
-#define PROTO_DEL(id)                                           \
-    static inline void ALWAYS_INLINE                            \
-    del__ ## id (Args_ ## id* vEntryArgs)
+#define x_mpz_rrandomb(rop, state, n) x_x_mpz_rrandomb (vTop, rop, state, n)
+#endif  /* NPGMP_RAND */
 
-#define ENTRY0(fun, string, id)                                 \
-    typedef struct { char dummy; } Args_ ## id;                 \
-    PROTO_IN (id)                                               \
-    {                                                           \
-        return true;                                            \
-    }                                                           \
-    PROTO_DEL (id)                                              \
-    {                                                           \
-    }
+/*
+ * Binary transfer via mpz_import and mpz_export.  Unlike conversion
+ * to and from text, these take time linear in the size of the number.
+ */
 
-#define ENTRY1(fun, string, id, t0)                             \
-    typedef struct { t0 a0; } Args_ ## id;                      \
-    PROTO_IN (id)                                               \
-    {                                                           \
-        if (!IN (0, t0)) goto del0_ ## id;                      \
-        return true; del0_ ## id:                               \
-        return false;                                           \
-    }                                                           \
-    PROTO_DEL (id)                                              \
-    {                                                           \
-        DEL (0, t0);                                            \
-    }
+static bool
+check_word_format (TopObject* top, int order, size_t size, int endian)
+{
+    if (order != 1 && order != -1)
+        raisef ((NPObject*) top, "order must be 1 or -1");
+    else if (size == 0)
+        raisef ((NPObject*) top, "size must be positive");
+    else if (endian < -1 || endian > 1)
+        raisef ((NPObject*) top, "endian must be 1, 0, or -1");
+    else
+        return true;
+    return false;
+}
 
-#define ENTRY2(fun, string, id, t0, t1)                         \
-    typedef struct { t0 a0; t1 a1; } Args_ ## id;               \
-    PROTO_IN (id)                                               \
-    {                                                           \
-        if (!IN (0, t0)) goto del0_ ## id;                      \
-        if (!IN (1, t1)) goto del1_ ## id;                      \
-        return true; del1_ ## id:                               \
-        DEL (0, t0); del0_ ## id:                               \
-        return false;                                           \
-    }                                                           \
-    PROTO_DEL (id)                                              \
-    {                                                           \
-        DEL (1, t1);                                            \
-        DEL (0, t0);                                            \
+/* mpz.import(rop, order, size, endian, data) sets ROP to the
+   nonnegative integer whose SIZE-byte words are the characters of
+   binary string DATA.  */
+static void
+x_x_mpz_import (TopObject* top, mpz_ptr rop, int order, size_t size,
+                int endian, bytes data)
+{
+    if (!check_word_format (top, order, size, endian))
+        return;
+    if (data.length % size) {
+        raisef ((NPObject*) top, "data length is not a multiple of size");
+        return;
     }
+    mpz_import (rop, data.length / size, order, size, endian, 0, data.data);
+}
 
-#define ENTRY3(fun, string, id, t0, t1, t2)                     \
-    typedef struct { t0 a0; t1 a1; t2 a2; } Args_ ## id;        \
-    PROTO_IN (id)                                               \
-    {                                                           \
-        if (!IN (0, t0)) goto del0_ ## id;                      \
-        if (!IN (1, t1)) goto del1_ ## id;                      \
-        if (!IN (2, t2)) goto del2_ ## id;                      \
-        return true; del2_ ## id:                               \
-        DEL (1, t1); del1_ ## id:                               \
-        DEL (0, t0); del0_ ## id:                               \
-        return false;                                           \
-    }                                                           \
-    PROTO_DEL (id)                                              \
-    {                                                           \
-        DEL (2, t2);                                            \
-        DEL (1, t1);                                            \
-        DEL (0, t0);                                            \
-    }
+#define x_mpz_import(rop, order, size, endian, data)    \
+    x_x_mpz_import (vTop, rop, order, size, endian, data)
 
-#define ENTRY4(fun, string, id, t0, t1, t2, t3)                 \
-    typedef struct { t0 a0; t1 a1; t2 a2; t3 a3; } Args_ ## id; \
-    PROTO_IN (id)                                               \
-    {                                                           \
-        if (!IN (0, t0)) goto del0_ ## id;                      \
-        if (!IN (1, t1)) goto del1_ ## id;                      \
-        if (!IN (2, t2)) goto del2_ ## id;                      \
-        if (!IN (3, t3)) goto del3_ ## id;                      \
-        return true; del3_ ## id:                               \
-        DEL (2, t2); del2_ ## id:                               \
-        DEL (1, t1); del1_ ## id:                               \
-        DEL (0, t0); del0_ ## id:                               \
-        return false;                                           \
-    }                                                           \
-    PROTO_DEL (id)                                              \
-    {                                                           \
-        DEL (3, t3);                                            \
-        DEL (2, t2);                                            \
-        DEL (1, t1);                                            \
-        DEL (0, t0);                                            \
-    }
+/* mpz.export(op, order, size, endian) returns the absolute value of
+   OP as a binary string of SIZE-byte words.  Zero yields "".  Use
+   mpz.sgn to get the sign.  */
+static bytes
+x_x_mpz_export (TopObject* top, mpz_ptr op, int order, size_t size,
+                int endian)
+{
+    bytes ret = { 0, 0 };
+    size_t count;
 
-#define ENTRY5(fun, string, id, t0, t1, t2, t3, t4)             \
-    typedef struct { t0 a0; t1 a1; t2 a2; t3 a3; t4 a4; }       \
-        Args_ ## id;                                            \
-    PROTO_IN (id)                                               \
-    {                                                           \
-        if (!IN (0, t0)) goto del0_ ## id;                      \
-        if (!IN (1, t1)) goto del1_ ## id;                      \
-        if (!IN (2, t2)) goto del2_ ## id;                      \
-        if (!IN (3, t3)) goto del3_ ## id;                      \
-        if (!IN (4, t4)) goto del4_ ## id;                      \
-        return true; del4_ ## id:                               \
-        DEL (3, t3); del3_ ## id:                               \
-        DEL (2, t2); del2_ ## id:                               \
-        DEL (1, t1); del1_ ## id:                               \
-        DEL (0, t0); del0_ ## id:                               \
-        return false;                                           \
-    }                                                           \
-    PROTO_DEL (id)                                              \
-    {                                                           \
-        DEL (4, t4);                                            \
-        DEL (3, t3);                                            \
-        DEL (2, t2);                                            \
-        DEL (1, t1);                                            \
-        DEL (0, t0);                                            \
-    }
+    if (!check_word_format (top, order, size, endian))
+        return ret;
 
-#include "gmp-entries.h"
+    count = (mpz_sizeinbase (op, 2) + 8 * size - 1) / (8 * size);
+    if (mpz_sgn (op) == 0)
+        return ret;
 
-/* Convert C function results to NPVariant and deallocate the C values.  */
+    ret.data = (unsigned char*) NPN_MemAlloc (count * size);
+    if (!ret.data) {
+        /* Tell out_bytes to raise out-of-memory.  */
+        ret.length = 1;
+        return ret;
+    }
+    mpz_export (ret.data, &count, order, size, endian, 0, op);
+    ret.length = count * size;
+    return ret;
+}
 
-#undef OUT
-#define OUT(i, t)                                               \
-    (outdel_ ## t (vTop, vEntryResults->a ## i, vResults + i)   \
-     || (del_ ## t (vEntryResults->a ## i), false))
+#define x_mpz_export(op, order, size, endian)           \
+    x_x_mpz_export (vTop, op, order, size, endian)
 
-#undef DEL
-#define DEL(i, t) del_ ## t (vEntryResults->a ## i)
+/*
+ * Rational objects wrap mpq_t.
+ */
 
-#undef PROTO_OUT
-#define PROTO_OUT(id)                                           \
-    static inline bool ALWAYS_INLINE                            \
-    out__ ## id (TopObject *vTop, Results_ ## id* vEntryResults,\
-                 NPVariant *vResults)
+#if NPGMP_MPQ
 
-#define ENTRYR0(fun, string, id)                                \
-    typedef struct { char dummy; } Results_ ## id;              \
-    PROTO_OUT (id)                                              \
-    {                                                           \
-        return true;                                            \
-    }
+/* Rationals made by mpq.clone share limbs as Integers do; see
+   integer_link.  */
+static void
+rational_link (Rational* q, Rational* after)
+{
+    Rational* next = (after->twin ? after->twin : after);
 
-/* XXX not scalable to more return values */
-#define ENTRYR1(fun, string, id, r0)                            \
-    typedef struct { r0 a0; } Results_ ## id;                   \
-    PROTO_OUT (id)                                              \
-    {                                                           \
-        return OUT (0, r0);                                     \
-    }
+    q->twin = next;
+    q->prev_twin = after;
+    next->prev_twin = q;
+    after->twin = q;
+}
 
-/* XXX not scalable to more return values */
-#define ENTRYR2(fun, string, id, r0, r1)                        \
-    typedef struct { r0 a0; r1 a1; } Results_ ## id;            \
-    PROTO_OUT (id)                                              \
-    {                                                           \
-        bool ret = true;                                        \
-        if (ret) ret = OUT (0, r0); else DEL (0, r0);           \
-        if (ret) {                                              \
-            ret = OUT (1, r1);                                  \
-            if (!ret)                                           \
-                NPN_ReleaseVariantValue (&vResults[0]);         \
-        }                                                       \
-        else                                                    \
-            DEL (1, r1);                                        \
-        return ret;                                             \
-    }
+static void
+rational_unlink (Rational* q)
+{
+    Rational* prev = q->prev_twin;
+    Rational* next = q->twin;
 
-#include "gmp-entries.h"
+    if (next == prev)
+        next->twin = next->prev_twin = 0;
+    else {
+        prev->twin = next;
+        next->prev_twin = prev;
+    }
+    q->twin = q->prev_twin = 0;
+}
 
-#undef PROTO
-#define PROTO(id)                                               \
-    static inline void ALWAYS_INLINE                            \
-    call__ ## id (TopObject *vTop, Args_ ## id* i, Results_ ## id* o)
+static void
+rational_exchange (Rational* a, Rational* b)
+{
+    Rational* next = a->twin;
+    Rational* prev = a->prev_twin;
 
-#define ENTRY0R1(fun, string, id, r0)                           \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun ();                                         \
+    a->twin = b->twin;
+    a->prev_twin = b->prev_twin;
+    if (a->twin) {
+        a->twin->prev_twin = a;
+        a->prev_twin->twin = a;
     }
-
-#define ENTRY1R0(fun, string, id, t0)                           \
-    PROTO (id)                                                  \
-    {                                                           \
-        fun (i->a0);                                            \
+    b->twin = next;
+    b->prev_twin = prev;
+    if (next) {
+        next->prev_twin = b;
+        prev->twin = b;
     }
+}
 
-#define ENTRY1R1(fun, string, id, r0, t0)                       \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun (i->a0);                                    \
-    }
+static void
+rational_unshare (TopObject* top, Rational* q, bool copy)
+{
+    if (q->twin) {
+        __mpq_struct shared = *q->mp;
 
-#define ENTRY1R2(fun, string, id, r0, r1, t0)                   \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun (&o->a1, i->a0);                            \
+        rational_unlink (q);
+        rational_untouch (q->mp);
+        if (copy)
+            mpq_set (rational_touch (q), &shared);
     }
+}
 
-#define ENTRY2R0(fun, string, id, t0, t1)                       \
-    PROTO (id)                                                  \
-    {                                                           \
-        fun (i->a0, i->a1);                                     \
-    }
+static NPObject*
+Rational_allocate (NPP npp, NPClass *aClass)
+{
+    TopObject* top = CONTAINING (TopObject, Rational, aClass);
+    Rational* ret = (Rational*) recycle_take (&top->recycled_mpq, 0, 0);
 
-#define ENTRY2R1(fun, string, id, r0, t0, t1)                   \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun (i->a0, i->a1);                             \
+    if (ret)
+        mpq_set_ui (ret->mp, 0, 1);
+    else {
+        ret = (Rational*) pool_alloc (top, sizeof (Rational));
+        if (ret) {
+            ret->twin = ret->prev_twin = 0;
+            ret->ref[0] = ret->ref[1] = 0;
+            rational_untouch (ret->mp);
+        }
     }
-
-#define ENTRY3R0(fun, string, id, t0, t1, t2)                   \
-    PROTO (id)                                                  \
-    {                                                           \
-        fun (i->a0, i->a1, i->a2);                              \
+#if DEBUG_ALLOC
+    fprintf (stderr, "Rational allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        NPN_RetainObject ((NPObject*) top);
+        census_born (top, CENSUS_Rational);
     }
+    return &ret->npobj;
+}
 
-#define ENTRY3R1(fun, string, id, r0, t0, t1, t2)               \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun (i->a0, i->a1, i->a2);                      \
-    }
+static void
+Rational_deallocate (NPObject *npobj)
+{
+#if DEBUG_ALLOC
+    fprintf (stderr, "Rational deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    TopObject* top = Rational_getTop (npobj);
+    mpq_ptr q = ((Rational*) npobj)->mp;
 
-#define ENTRY3R2(fun, string, id, r0, r1, t0, t1, t2)           \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun (&o->a1, i->a0, i->a1, i->a2);              \
+    if (((Rational*) npobj)->twin) {
+        /* Leave the limbs to our clones.  */
+        rational_unlink ((Rational*) npobj);
+        pool_free (top, npobj, sizeof (Rational));
+    }
+    else if (rational_untouched_p (q))
+        pool_free (top, npobj, sizeof (Rational));
+    else if (!recycle_put (top, &top->recycled_mpq, npobj,
+                           mpq_numref (q)->_mp_alloc
+                           + mpq_denref (q)->_mp_alloc)) {
+        mpq_clear (q);
+        pool_free (top, npobj, sizeof (Rational));
     }
+    census_died (top, CENSUS_Rational);
+    NPN_ReleaseObject ((NPObject*) top);
+}
 
-#define ENTRY4R0(fun, string, id, t0, t1, t2, t3)               \
-    PROTO (id)                                                  \
-    {                                                           \
-        fun (i->a0, i->a1, i->a2, i->a3);                       \
-    }
+static bool
+rational_toString (TopObject* top, mpq_ptr mpp, const NPVariant *args,
+                   uint32_t argCount, NPVariant *result)
+{
+    int base = 0;
 
-#define ENTRY4R1(fun, string, id, r0, t0, t1, t2, t3)           \
-    PROTO (id)                                                  \
-    {                                                           \
-        o->a0 = fun (i->a0, i->a1, i->a2, i->a3);               \
-    }
+    if (argCount < 1 || !in_int (top, &args[0], &base))
+        base = 10;
 
-#define ENTRY5R0(fun, string, id, t0, t1, t2, t3, t4)           \
-    PROTO (id)                                                  \
-    {                                                           \
-        fun (i->a0, i->a1, i->a2, i->a3, i->a4);                \
+    if (base >= -36 && base <= 62 && base != 0 && base != -1 && base != 1) {
+        int abase = (base < 0 ? -base : base);
+        size_t len = mpz_sizeinbase (mpq_numref (mpp), abase)
+            + mpz_sizeinbase (mpq_denref (mpp), abase) + 3;
+        NPUTF8* s = (NPUTF8*) NPN_MemAlloc (len);
+        if (s) {
+            len = x_mpz_get_str (top, s, base, mpq_numref (mpp));
+            if (mpz_cmp_ui (mpq_denref (mpp), 1) != 0) {
+                s[len++] = '/';
+                len += x_mpz_get_str (top, s + len, base, mpq_denref (mpp));
+            }
+            STRINGN_TO_NPVARIANT (s, len, *result);
+        }
+        else
+            return oom ((NPObject*) top, result, true);
     }
+    else
+        return set_exception ((NPObject*) top, "invalid argument", result,
+                              true);
+    return true;
+}
 
-#include "gmp-entries.h"
+static bool
+Rational_invoke (NPObject *npobj, NPIdentifier name,
+                 const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    Rational* z = (Rational*) npobj;
+    if (name == ID_toString)
+        return rational_toString (Rational_getTop (npobj),
+                                  z->mp, args, argCount, result);
+    return false;
+}
 
 static bool
-enter (TopObject* top, int entryNumber,
-       const NPVariant *args, NPVariant *results)
+in_mpq_ptr (TopObject* top, const NPVariant* var, mpq_ptr* arg)
 {
-    switch (entryNumber) {
+    if (!NPVARIANT_IS_OBJECT (*var)
+        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Rational)
+        return false;
+    *arg = ((Rational*) NPVARIANT_TO_OBJECT (*var))->mp;
+    return true;
+}
 
-        /* XXX Could distinguish pre-call from post-call errors.  */
-#define ENTRY(nargs, nret, string, id)                  \
-        case __LINE__: {                                \
-            Args_    ## id i;                           \
-            Results_ ## id o;                           \
-            if (!in__ ## id (top, args, &i))            \
-                return false;                           \
-            call__ ## id (top, &i, &o);                 \
-            del__ ## id (&i);                           \
-            return out__ ## id (top, &o, results);      \
-        }
-            
-#include "gmp-entries.h"
+static bool
+in_uninit_mpq (TopObject* top, const NPVariant* var, mpq_ptr* arg)
+{
+    if (!NPVARIANT_IS_OBJECT (*var)
+        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Rational)
+        return false;
+    rational_unshare (top, (Rational*) NPVARIANT_TO_OBJECT (*var), false);
+    *arg = &((Rational*) NPVARIANT_TO_OBJECT (*var))->mp[0];
+    if (!rational_untouched_p (*arg))
+        mpq_clear (*arg);
+    return true;
+}
 
-    default:
+static bool
+in_dest_mpq (TopObject* top, const NPVariant* var, mpq_ptr* arg)
+{
+    if (!in_mpq_ptr (top, var, arg))
         return false;
+    rational_touch ((Rational*) NPVARIANT_TO_OBJECT (*var));
+    rational_unshare (top, (Rational*) NPVARIANT_TO_OBJECT (*var), true);
+    return true;
+}
+
+#define del_mpq_ptr(arg)
+#define del_uninit_mpq(arg)
+#define del_dest_mpq(arg)
+
+static NPObject*
+x_x_mpq (TopObject* top)
+{
+    NPObject* ret = NPN_CreateObject (top->instance, &top->Rational.npclass);
+    if (!ret)
+        raise_oom ((NPObject*) top);
+    return ret;
+}
+
+#define x_mpq() x_x_mpq (vTop)
+
+/* mpq.clone(op) returns a new mpq equal to OP, sharing its limbs as
+   mpz.clone does.  */
+static NPObject*
+x_mpq_clone (Variant var)
+{
+    TopObject* top = var.top;
+    mpq_ptr op;
+    Rational* src;
+    Rational* ret;
+
+    if (!in_mpq_ptr (top, var.arg, &op)) {
+        raisef ((NPObject*) top, "not an mpq");
+        return 0;
     }
+    src = (Rational*) NPVARIANT_TO_OBJECT (*var.arg);
+    ret = (Rational*) x_x_mpq (top);
+    if (!ret)
+        return 0;
+    if (rational_untouched_p (op))
+        return &ret->npobj;  /* already zero, like OP */
+    if (!rational_untouched_p (ret->mp))
+        mpq_clear (ret->mp);
+    *ret->mp = *op;
+    rational_link (ret, src);
+    return &ret->npobj;
 }
 
-static bool
-Entry_invokeDefault (NPObject *npobj,
-                     const NPVariant *args, uint32_t argCount,
-                     NPVariant *result)
+/* mpq.swap(a, b) exchanges the values of A and B, moving clones
+   between rings as mpz.swap does.  */
+static void
+x_mpq_swap (Variant va, Variant vb)
 {
-    TopObject* top = Entry_getTop (npobj);
-    Entry* entry = (Entry*) npobj;
-    size_t nargs, nret;
-    Tuple* tuple = 0;  /* avoid a warning */
-    NPVariant* out;
+    TopObject* top = va.top;
+    mpq_ptr a, b;
 
-    if (entry->number == 0)
+    if (!in_mpq_ptr (top, va.arg, &a) || !in_mpq_ptr (top, vb.arg, &b)) {
+        raisef ((NPObject*) top, "not an mpq");
+        return;
+    }
+    if (mpq_numref (a)->_mp_d == mpq_numref (b)->_mp_d)
+        return;  /* the same number, or clones of one */
+    mpq_swap (a, b);
+    rational_exchange ((Rational*) NPVARIANT_TO_OBJECT (*va.arg),
+                       (Rational*) NPVARIANT_TO_OBJECT (*vb.arg));
+}
+
+static Bool
+is_mpq (Variant var)
+{
+    if (!NPVARIANT_IS_OBJECT (*var.arg))
         return false;
+    NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
+    if (npobj->_class == (NPClass*) &var.top->Rational)
+        return true;
+    return false;
+}
 
-    nargs = Entry_length (npobj);
-    nret = Entry_outLength (npobj);
-    if (argCount != nargs)
-        return throwf ((NPObject*) top, result, true,
-                       "wrong argument count: %d, expected %d",
-                       argCount, nargs);
+#endif  /* NPGMP_MPQ */
+#endif  /* NPGMP_MPZ */
 
-    if (nret <= 1)
-        out = result;
-    else {
-        tuple = make_tuple (top, nret);
-        if (!tuple)
-            return oom (npobj, result, true);
-        out = tuple->start;
+/*
+ * Float objects wrap mpf_t.
+ */
+
+#if NPGMP_MPF
+
+static void
+restore_prec (mpf_ptr mpp)
+{
+    Float* f = CONTAINING (Float, mp[0], mpp);
+
+    if (f->oprec) {
+        mpf_set_prec_raw (mpp, f->oprec);
+        f->oprec = 0;
     }
+}
 
-    if (!enter (top, entry->number, args, out)) {
-        if (nret > 1)
-            NPN_ReleaseObject ((NPObject*) tuple);
-        return throwf ((NPObject*) top, result, true,
-                       "%s: %s", Entry_name (entry),
-                       top->errmsg ?: "wrong argument type");
+/* Like a Rational, a new Float holds no limbs until it first
+   receives a value.  Until then, it is zero at its precision, with
+   its limb pointer at ZeroLimbs.  */
+static inline mpf_ptr
+float_touch (Float* f)
+{
+    if (f->mp->_mp_d == ZeroLimbs)
+        mpf_init2 (f->mp, mpf_get_prec (f->mp));
+    return f->mp;
+}
+
+static NPObject*
+Float_allocate (NPP npp, NPClass *aClass)
+{
+    TopObject* top = CONTAINING (TopObject, Float, aClass);
+    mp_bitcnt_t prec = top->default_mpf_prec ?: mpf_get_default_prec ();
+    Float* ret = (Float*) recycle_take (&top->recycled_mpf, prec,
+                                        mpf_capacity);
+
+    if (ret) {
+        /* Emulate mpf_init2 in a body at least as large.  */
+        mpf_set_ui (ret->mp, 0);
+        if (mpf_get_prec (ret->mp) != prec) {
+            ret->oprec = mpf_get_prec (ret->mp);
+            mpf_set_prec_raw (ret->mp, prec);
+        }
+    }
+    else {
+        ret = (Float*) pool_alloc (top, sizeof (Float));
+        if (ret) {
+            /* As mpf_init2 would set it, in limbs.  */
+            ret->mp->_mp_prec = ((prec + 2 * mp_bits_per_limb - 1)
+                                 / mp_bits_per_limb);
+            ret->mp->_mp_size = 0;
+            ret->mp->_mp_exp = 0;
+            ret->mp->_mp_d = ZeroLimbs;
+            ret->oprec = 0;
+        }
+    }
+#if DEBUG_ALLOC
+    fprintf (stderr, "Float allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        NPN_RetainObject ((NPObject*) top);
+        census_born (top, CENSUS_Float);
     }
+    return &ret->npobj;
+}
 
-    if (nret == 0)
-        VOID_TO_NPVARIANT (*result);
+static void
+Float_deallocate (NPObject *npobj)
+{
+#if DEBUG_ALLOC
+    fprintf (stderr, "Float deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    TopObject* top = Float_getTop (npobj);
+    mpf_ptr f = ((Float*) npobj)->mp;
 
-    else if (nret > 1) {
-        if (retain_for_js (top, (NPObject*) tuple))
-            OBJECT_TO_NPVARIANT ((NPObject*) tuple, *result);
-        else {
-            NPN_ReleaseObject ((NPObject*) tuple);
-            raise_oom ((NPObject*) top);
+    if (f->_mp_d == ZeroLimbs)
+        pool_free (top, npobj, sizeof (Float));
+    else {
+        restore_prec (f);
+        if (!recycle_put (top, &top->recycled_mpf, npobj,
+                          mpf_get_prec (f) / mp_bits_per_limb)) {
+            mpf_clear (f);
+            pool_free (top, npobj, sizeof (Float));
         }
     }
+    census_died (top, CENSUS_Float);
+    NPN_ReleaseObject ((NPObject*) top);
+}
 
-    return check_ex (top, npobj, result, true);
+static void
+x_gmp_free (void *ptr, size_t size)
+{
+#if NPGMP_MEMORY
+    gmp_free (ptr, size);
+#else
+    void *(*alloc_func_ptr) (size_t);
+    void *(*realloc_func_ptr) (void *, size_t, size_t);
+    void (*free_func_ptr) (void *, size_t);
+
+    mp_get_memory_functions (&alloc_func_ptr, &realloc_func_ptr,
+                             &free_func_ptr);
+    (*free_func_ptr) (ptr, size);
+#endif
+}
+
+/* XXX toString should behave a little differently.  toExponential would
+   be closer, but not exactly this.  */
+static bool
+float_toString (TopObject *top, mpf_ptr mpp, const NPVariant *args,
+                uint32_t argCount, NPVariant *result)
+{
+    int base;
+    size_t n_digits;
+    mp_exp_t expt;
+    char* str;
+    size_t allocated;
+    bool ret = true;
+
+    if (argCount < 1 || !in_int (top, args, &base))
+        base = 10;
+
+    if (argCount < 2 || !in_size_t (top, args + 1, &n_digits))
+        n_digits = 0;
+
+    if (base >= -36 && base <= 62 && base != 0 && base != -1 && base != 1) {
+        NPUTF8* s;
+
+        /* XXX could preallocate for n_digits != 0. */
+        str = mpf_get_str (NULL, &expt, base, n_digits, mpp);
+        if (!str)
+            return oom ((NPObject*) top, result, true);
+
+        allocated = strlen (str) + 1;
+        if (allocated == 1) {
+            s = (NPUTF8*) NPN_MemAlloc (sizeof "0");
+            if (s) {
+                strcpy (s, "0");
+                STRINGZ_TO_NPVARIANT (s, *result);
+            }
+            else
+                ret = oom ((NPObject*) top, result, true);
+        }
+        else {
+            size_t len = allocated + 4 + 3 * sizeof expt;
+            size_t pos = 0;
+
+            s = (NPUTF8*) NPN_MemAlloc (len);
+            if (s) {
+                if (str[pos] == '-') {
+                    s[pos] = str[pos];
+                    pos++;
+                }
+                sprintf (&s[pos], "%c.%se%ld", str[pos], str + pos + 1,
+                         (long) expt - 1);
+                STRINGZ_TO_NPVARIANT (s, *result);
+            }
+            else
+                ret = oom ((NPObject*) top, result, true);
+        }
+
+        x_gmp_free (str, allocated);
+    }
+    else
+        return set_exception ((NPObject*) top, "invalid base", result, true);
+    return ret;
+}
+
+static bool
+Float_invoke (NPObject *npobj, NPIdentifier name,
+              const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    Float* z = (Float*) npobj;
+    if (name == ID_toString)
+        return float_toString (Float_getTop (npobj),
+                               z->mp, args, argCount, result);
+    return false;
+}
+
+static bool
+in_mpf_ptr (TopObject* top, const NPVariant* var, mpf_ptr* arg)
+{
+    if (!NPVARIANT_IS_OBJECT (*var)
+        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Float)
+        return false;
+    *arg = ((Float*) NPVARIANT_TO_OBJECT (*var))->mp;
+    return true;
+}
+
+static bool
+in_dest_mpf (TopObject* top, const NPVariant* var, mpf_ptr* arg)
+{
+    if (!NPVARIANT_IS_OBJECT (*var)
+        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Float)
+        return false;
+    *arg = float_touch ((Float*) NPVARIANT_TO_OBJECT (*var));
+    return true;
+}
+
+static bool
+in_uninit_mpf (TopObject* top, const NPVariant* var, mpf_ptr* arg)
+{
+    if (!NPVARIANT_IS_OBJECT (*var)
+        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Float)
+        return false;
+    *arg = &((Float*) NPVARIANT_TO_OBJECT (*var))->mp[0];
+    if ((*arg)->_mp_d != ZeroLimbs) {
+        restore_prec (*arg);
+        mpf_clear (*arg);
+    }
+    return true;
+}
+
+static mp_bitcnt_t
+x_x_mpf_get_default_prec (TopObject* top)
+{
+    return top->default_mpf_prec ?: mpf_get_default_prec ();
+}
+
+#define x_mpf_get_default_prec() x_x_mpf_get_default_prec (vTop)
+
+static void
+x_x_mpf_set_default_prec (TopObject* top, mp_bitcnt_t prec)
+{
+    if (quota_check (top, prec))
+        top->default_mpf_prec = (prec ?: 1);
+}
+
+#define x_mpf_set_default_prec(prec) x_x_mpf_set_default_prec (vTop, prec)
+
+static void
+x_x_mpf_init (TopObject* top, mpf_ptr f)
+{
+    if (top->default_mpf_prec)
+        mpf_init2 (f, top->default_mpf_prec);
+    else
+        mpf_init (f);
+}
+
+static bool
+in_defprec_mpf (TopObject* top, const NPVariant* var, mpf_ptr* arg)
+{
+    bool ret = in_uninit_mpf (top, var, arg);
+    if (ret)
+        x_x_mpf_init (top, *arg);
+    return ret;
+}
+
+#define del_mpf_ptr(arg)
+#define del_dest_mpf(arg)
+#define del_uninit_mpf(arg)
+#define del_defprec_mpf(arg)
+
+static NPObject*
+x_x_mpf (TopObject* top)
+{
+    NPObject* ret = NPN_CreateObject (top->instance, &top->Float.npclass);
+    if (!ret)
+        raise_oom ((NPObject*) top);
+    return ret;
+}
+
+#define x_mpf() x_x_mpf (vTop)
+
+static Bool
+is_mpf (Variant var)
+{
+    if (!NPVARIANT_IS_OBJECT (*var.arg))
+        return false;
+    NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
+    if (npobj->_class == (NPClass*) &var.top->Float)
+        return true;
+    return false;
+}
+
+#define x_mpf_init(f) x_x_mpf_init (vTop, f)
+
+static void
+x_mpf_clear (mpf_ptr f)
+{
+    mpf_init2 (f, 1);
+}
+
+static void
+x_x_mpf_set_prec (TopObject* top, mpf_ptr f, mp_bitcnt_t prec)
+{
+    if (!quota_check (top, prec))
+        return;
+    restore_prec (f);
+    mpf_set_prec (f, prec);
+}
+
+#define x_mpf_set_prec(f, prec) x_x_mpf_set_prec (vTop, f, prec)
+
+static void
+x_x_mpf_init2 (TopObject* top, mpf_ptr f, mp_bitcnt_t prec)
+{
+    if (quota_check (top, prec))
+        mpf_init2 (f, prec);
+    else
+        x_x_mpf_init (top, f);  /* Leave F valid.  */
+}
+
+#define x_mpf_init2(f, prec) x_x_mpf_init2 (vTop, f, prec)
+
+static void
+x_mpf_set_prec_raw (mpf_ptr mpp, mp_bitcnt_t prec)
+{
+    Float* f = CONTAINING (Float, mp[0], mpp);
+
+    if (!f->oprec)
+        f->oprec = mpf_get_prec (mpp);
+    if (prec <= f->oprec)
+        mpf_set_prec_raw (mpp, prec);
+}
+
+static NPString
+x_mpf_get_str (mp_exp_t* exp, int base, size_t n_digits, mpf_ptr f)
+{
+    char* str;
+    size_t len;
+    NPUTF8* s;
+    NPString ret;
+
+    /* XXX could preallocate the buffer for n_digits != 0. */
+    str = mpf_get_str (NULL, exp, base, n_digits, f);
+    if (str) {
+        len = strlen (str);
+        s = (NPUTF8*) NPN_MemAlloc (len);
+        if (s || !len)
+            memcpy (s, str, len);
+    }
+    else {
+        /* Tell out_npstring to raise out-of-memory.  */
+        len = 1;
+        s = 0;
+    }
+
+    x_gmp_free (str, len + 1);
+    ret.UTF8Length = len;
+    ret.UTF8Characters = s;
+    return ret;
+}
+
+#endif  /* NPGMP_MPF */
+
+/*
+ * Digit streams: iterators over the digits of a large number.
+ *
+ * A stream keeps a stack of pieces of the number not yet converted.
+ * Each piece is split at a cached power of the base (see Radix
+ * conversion above) until it is short enough for GMP to convert, with
+ * the high part on top.  Memory use stays near the size of the
+ * number, however many digits it has.
+ */
+
+#if NPGMP_MPZ
+
+typedef struct _Digits {
+    NPObject npobj;
+    int base;
+    size_t chunk;         /* digits per call to next() */
+    bool minus;           /* a '-' remains to be output */
+    bool has_exponent;
+    mp_exp_t exponent;    /* for mpf: as returned by mpf_get_str */
+    size_t depth;         /* number of pieces on the stack */
+    struct {
+        mpz_t x;
+        size_t width;     /* digits to output, or 0 if unpadded */
+    } stack[RADIX_MAX_LEVELS + 1];
+    size_t pos, len;      /* unread part of buf */
+    char buf[RADIX_DC_THRESHOLD + 2];
+} Digits;
+
+static NPObject*
+Digits_allocate (NPP npp, NPClass *aClass)
+{
+    Digits* ret = (Digits*) NPN_MemAlloc (sizeof (Digits));
+#if DEBUG_ALLOC
+    fprintf (stderr, "Digits allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Digits, aClass));
+        ret->minus = false;
+        ret->has_exponent = false;
+        ret->depth = 0;
+        ret->pos = 0;
+        ret->len = 0;
+    }
+    return &ret->npobj;
+}
+
+static void
+Digits_deallocate (NPObject *npobj)
+{
+    Digits* d = (Digits*) npobj;
+#if DEBUG_ALLOC
+    fprintf (stderr, "Digits deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    while (d->depth)
+        mpz_clear (d->stack[--d->depth].x);
+    NPN_ReleaseObject ((NPObject*) Digits_getTop (npobj));
+    NPN_MemFree (npobj);
+}
+
+/* Refill D->buf with the next leaf's digits.  Return false at end.  */
+static bool
+digits_fill (TopObject* top, Digits* d)
+{
+    int abase = (d->base < 0 ? -d->base : d->base);
+
+    while (d->depth) {
+        mpz_ptr x = d->stack[d->depth - 1].x;
+        size_t width = d->stack[d->depth - 1].width;
+        size_t n_digits = width ?: mpz_sizeinbase (x, abase);
+        mpz_srcptr power = 0;
+        int k = 0;
+
+        if (n_digits >= RADIX_DC_THRESHOLD) {
+            k = radix_level (n_digits);
+            power = radix_power (top, abase, k);
+        }
+
+        if (!power) {
+            /* radix_get_str will not split X, so it fits in buf.  */
+            d->len = radix_get_str (top, d->buf, d->base, x, width);
+            d->pos = 0;
+            mpz_clear (x);
+            d->depth--;
+            return true;
+        }
+
+        /* Leave the low part in place and push the high part.  */
+        size_t m = (size_t) RADIX_LEAF_DIGITS << k;
+        mpz_ptr q = d->stack[d->depth].x;
+        mpz_init (q);
+        mpz_tdiv_qr (q, x, x, power);
+        d->stack[d->depth - 1].width = m;
+        if (width || mpz_sgn (q)) {
+            d->stack[d->depth].width = (width ? width - m : 0);
+            d->depth++;
+        }
+        else {
+            d->stack[d->depth - 1].width = 0;
+            mpz_clear (q);
+        }
+    }
+    return false;
+}
+
+/* Return an upper bound on the characters that D has yet to output.  */
+static size_t
+digits_remaining (const Digits* d)
+{
+    int abase = (d->base < 0 ? -d->base : d->base);
+    size_t ret = d->minus + (d->len - d->pos);
+
+    for (size_t i = 0; i < d->depth; i++)
+        ret += d->stack[i].width ?: mpz_sizeinbase (d->stack[i].x, abase);
+    return ret;
+}
+
+static bool
+digits_next (TopObject* top, Digits* d, NPVariant* result)
+{
+    size_t len = 0, size;
+    NPUTF8* s;
+
+    if (d->pos == d->len && !d->minus && !digits_fill (top, d)) {
+        /* End of stream.  */
+        NULL_TO_NPVARIANT (*result);
+        return true;
+    }
+
+    /* The last chunk may be short.  */
+    size = digits_remaining (d);
+    if (size > d->chunk)
+        size = d->chunk;
+    s = (NPUTF8*) NPN_MemAlloc (size);
+    if (!s)
+        return oom ((NPObject*) top, result, true);
+
+    if (d->minus) {
+        s[len++] = '-';
+        d->minus = false;
+    }
+    while (len < size) {
+        size_t n;
+        if (d->pos == d->len && !digits_fill (top, d))
+            break;
+        n = d->len - d->pos;
+        if (n > size - len)
+            n = size - len;
+        memcpy (s + len, d->buf + d->pos, n);
+        d->pos += n;
+        len += n;
+    }
+    STRINGN_TO_NPVARIANT (s, len, *result);
+    return true;
+}
+
+static bool
+Digits_hasMethod (NPObject *npobj, NPIdentifier name)
+{
+    return name == ID_next;
+}
+
+static bool
+Digits_invoke (NPObject *npobj, NPIdentifier name,
+               const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    if (name == ID_next) {
+        TopObject* top = Digits_getTop (npobj);
+        TopObject* owner = gmp_owner_enter (top);
+        bool ret = digits_next (top, (Digits*) npobj, result);
+        gmp_owner_leave (owner);
+        quota_report (top, ret, result);
+        return check_ex (top, npobj, result, ret);
+    }
+    return false;
+}
+
+static bool
+Digits_hasProperty (NPObject *npobj, NPIdentifier key)
+{
+    return ((Digits*) npobj)->has_exponent &&
+        key == ID_exponent;
+}
+
+static bool
+Digits_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
+{
+    Digits* d = (Digits*) npobj;
+
+    if (Digits_hasProperty (npobj, key))
+        return out_mp_exp_t (Digits_getTop (npobj), d->exponent, result);
+    VOID_TO_NPVARIANT (*result);
+    return true;
+}
+
+/* Create a stream with no digits yet.  */
+static Digits*
+make_digits (TopObject* top, int base, size_t chunk)
+{
+    Digits* d;
+
+    if (chunk == 0) {
+        raisef ((NPObject*) top, "chunk size must be positive");
+        return 0;
+    }
+    d = (Digits*) NPN_CreateObject (top->instance, &top->Digits.npclass);
+    if (!d) {
+        raise_oom ((NPObject*) top);
+        return 0;
+    }
+    d->base = base;
+    d->chunk = chunk;
+    return d;
+}
+
+/* mpz.digits(z, base, chunkSize) returns an object whose next()
+   method returns the next chunkSize characters of z.toString(base),
+   or null after the last.  */
+static NPObject*
+x_x_mpz_digits (TopObject* top, mpz_ptr z, int base, size_t chunk)
+{
+    Digits* d = make_digits (top, base, chunk);
+
+    if (d) {
+        mpz_init (d->stack[0].x);
+        mpz_abs (d->stack[0].x, z);
+        d->stack[0].width = 0;
+        d->depth = 1;
+        d->minus = (mpz_sgn (z) < 0);
+    }
+    return (NPObject*) d;
+}
+
+#define x_mpz_digits(z, base, chunk) x_x_mpz_digits (vTop, z, base, chunk)
+
+#if NPGMP_MPF
+
+/* Set N to abs(F) rounded to N_DIGITS significant digits in base
+   BASE, without trailing zeros, and return the exponent as
+   mpf_get_str would.  */
+static mp_exp_t
+mpf_to_digits (mpz_ptr n, int base, size_t n_digits, mpf_srcptr f)
+{
+    long exp2, shift, e;
+    mpf_t t;
+    mpz_t m, p;
+
+    if (mpf_sgn (f) == 0) {
+        mpz_set_ui (n, 0);
+        return 0;
+    }
+    (void) mpf_get_d_2exp (&exp2, f);
+
+    /* Find M with abs(F) = M / 2^SHIFT exactly.  The lowest bit of
+       F's mantissa is at least 2^(EXP2 - mpf_size(F) * limb bits).  */
+    shift = (long) (mpf_size (f) * mp_bits_per_limb) - exp2;
+    mpf_init2 (t, (mpf_size (f) + 1) * mp_bits_per_limb);
+    mpf_abs (t, f);
+    if (shift >= 0)
+        mpf_mul_2exp (t, t, shift);
+    else
+        mpf_div_2exp (t, t, -shift);
+    mpz_init (m);
+    mpz_set_f (m, t);
+    mpf_clear (t);
+
+    /* Guess the exponent E, so BASE^(E-1) <= abs(F) < BASE^E, from
+       EXP2.  Correct it until N has N_DIGITS + 1 digits.  */
+    e = (long) floor (exp2 * (log (2) / log (base))) + 1;
+    mpz_init (p);
+    for (;;) {
+        long scale = (long) n_digits + 1 - e;
+        size_t len;
+
+        /* N = floor (M * BASE^SCALE / 2^SHIFT), with P the divisor.  */
+        mpz_set_ui (p, 1);
+        if (scale >= 0) {
+            mpz_ui_pow_ui (n, base, scale);
+            mpz_mul (n, n, m);
+        }
+        else {
+            mpz_set (n, m);
+            mpz_ui_pow_ui (p, base, -scale);
+        }
+        if (shift >= 0)
+            mpz_mul_2exp (p, p, shift);
+        else
+            mpz_mul_2exp (n, n, -shift);
+        mpz_fdiv_q (n, n, p);
+
+        len = mpz_sizeinbase (n, base);
+        if (len > 1) {
+            mpz_ui_pow_ui (p, base, len - 1);
+            if (mpz_cmp (n, p) < 0)
+                len--;
+        }
+        if (len == n_digits + 1)
+            break;
+        e += (long) len - (long) (n_digits + 1);
+    }
+
+    /* Round on the extra digit as mpf_get_str does.  */
+    if (mpz_fdiv_q_ui (n, n, base) * 2 >= (unsigned long) base) {
+        mpz_add_ui (n, n, 1);
+        mpz_ui_pow_ui (p, base, n_digits);
+        if (mpz_cmp (n, p) == 0)
+            e++;
+    }
+
+    mpz_set_ui (p, base);
+    mpz_remove (n, n, p);
+    mpz_clear (p);
+    mpz_clear (m);
+    return e;
+}
+
+/* mpf.digits(f, base, n_digits, chunkSize) is to mpf.get_str(base,
+   n_digits, f) as mpz.digits is to toString.  The stream's exponent
+   property holds the exponent.  */
+static NPObject*
+x_x_mpf_digits (TopObject* top, mpf_ptr f, int base, size_t n_digits,
+                size_t chunk)
+{
+    int abase = (base < 0 ? -base : base);
+    Digits* d = make_digits (top, base, chunk);
+
+    if (d) {
+        /* Like mpf_get_str, limit digits to F's precision.  */
+        size_t max_digits = 2 + (size_t) (mpf_get_prec (f)
+                                          * (log (2) / log (abase)));
+        if (n_digits == 0 || n_digits > max_digits)
+            n_digits = max_digits;
+        mpz_init (d->stack[0].x);
+        d->exponent = mpf_to_digits (d->stack[0].x, abase, n_digits, f);
+        d->has_exponent = true;
+        d->stack[0].width = 0;
+        d->depth = (mpf_sgn (f) != 0);
+        if (!d->depth)
+            mpz_clear (d->stack[0].x);
+        d->minus = (mpf_sgn (f) < 0);
+    }
+    return (NPObject*) d;
+}
+
+#define x_mpf_digits(f, base, n_digits, chunk)          \
+    x_x_mpf_digits (vTop, f, base, n_digits, chunk)
+
+#endif  /* NPGMP_MPF */
+
+#endif  /* NPGMP_MPZ */
+
+/*
+ * Digit parsers: the inverse of digit streams.
+ *
+ * A parser buffers up to RADIX_LEAF_DIGITS digits and converts each
+ * full buffer with GMP.  Converted pieces go on a stack like the bits
+ * of a binary counter: two pieces of RADIX_LEAF_DIGITS << K digits
+ * combine into one of twice the size using the cached power, so the
+ * tree stays balanced and the pieces together are no larger than
+ * the result.
+ */
+
+#if NPGMP_MPZ
+
+typedef struct _Parser {
+    NPObject npobj;
+    int base;
+    bool minus;           /* saw a leading '-' */
+    size_t depth;         /* number of pieces on the stack */
+    struct {
+        mpz_t x;
+        int level;        /* X has RADIX_LEAF_DIGITS << LEVEL digits */
+    } stack[RADIX_MAX_LEVELS];
+    size_t len;           /* digits in buf */
+    char buf[RADIX_LEAF_DIGITS + 1];
+} Parser;
+
+static void
+parser_reset (Parser* p)
+{
+    while (p->depth)
+        mpz_clear (p->stack[--p->depth].x);
+    p->minus = false;
+    p->len = 0;
+}
+
+static NPObject*
+Parser_allocate (NPP npp, NPClass *aClass)
+{
+    Parser* ret = (Parser*) NPN_MemAlloc (sizeof (Parser));
+#if DEBUG_ALLOC
+    fprintf (stderr, "Parser allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Parser, aClass));
+        ret->depth = 0;
+        parser_reset (ret);
+    }
+    return &ret->npobj;
+}
+
+static void
+Parser_deallocate (NPObject *npobj)
+{
+#if DEBUG_ALLOC
+    fprintf (stderr, "Parser deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    parser_reset ((Parser*) npobj);
+    NPN_ReleaseObject ((NPObject*) Parser_getTop (npobj));
+    NPN_MemFree (npobj);
+}
+
+/* Return the value of digit C as mpz_set_str reads it, or -1 if C is
+   not a digit in BASE.  */
+static int
+digit_value (int c, int base)
+{
+    int v;
+
+    if (c >= '0' && c <= '9')
+        v = c - '0';
+    else if (c >= 'A' && c <= 'Z')
+        v = c - 'A' + 10;
+    else if (c >= 'a' && c <= 'z')
+        v = c - 'a' + (base <= 36 ? 10 : 36);
+    else
+        return -1;
+    return (v < base ? v : -1);
+}
+
+/* Convert the full buffer and push it, merging equal pieces.  Return
+   false if out of memory.  */
+static bool
+parser_push (TopObject* top, Parser* p)
+{
+    mpz_ptr x = p->stack[p->depth].x;
+
+    p->buf[p->len] = '\0';
+    mpz_init_set_str (x, p->buf, p->base);
+    p->stack[p->depth].level = 0;
+    p->depth++;
+    p->len = 0;
+
+    while (p->depth >= 2 &&
+           p->stack[p->depth - 1].level == p->stack[p->depth - 2].level) {
+        int level = p->stack[p->depth - 1].level;
+        mpz_srcptr power = radix_power (top, p->base, level);
+        if (!power)
+            return false;
+        x = p->stack[p->depth - 2].x;
+        mpz_mul (x, x, power);
+        mpz_add (x, x, p->stack[p->depth - 1].x);
+        mpz_clear (p->stack[--p->depth].x);
+        p->stack[p->depth - 1].level = level + 1;
+    }
+    return true;
+}
+
+static bool
+parser_feed (TopObject* top, Parser* p, const NPString* chunk,
+             NPVariant* result)
+{
+    const NPUTF8* s = chunk->UTF8Characters;
+    const NPUTF8* end = s + chunk->UTF8Length;
+
+    for (; s < end; s++) {
+        int c = (unsigned char) *s;
+
+        /* mpz_set_str ignores white space anywhere.  */
+        if (isspace (c))
+            continue;
+        if (c == '-' && !p->minus && p->depth == 0 && p->len == 0) {
+            p->minus = true;
+            continue;
+        }
+        if (digit_value (c, p->base) < 0) {
+            parser_reset (p);
+            return throwf ((NPObject*) p, result, true,
+                           "invalid digit in base %d", p->base);
+        }
+        p->buf[p->len++] = c;
+        if (p->len == RADIX_LEAF_DIGITS && !parser_push (top, p)) {
+            parser_reset (p);
+            return oom ((NPObject*) p, result, true);
+        }
+    }
+    VOID_TO_NPVARIANT (*result);
+    return true;
+}
+
+/* Store the number parsed so far in ROP and reset P.  */
+static bool
+parser_finish (TopObject* top, Parser* p, mpz_ptr rop, NPVariant* result)
+{
+    mpz_t scale;
+    bool ok = true;
+
+    if (p->depth == 0 && p->len == 0) {
+        parser_reset (p);
+        return throwf ((NPObject*) p, result, true, "no digits");
+    }
+
+    /* Add pieces from the low end, with SCALE the power of the base
+       by which to multiply the next.  */
+    mpz_init (scale);
+    if (p->len) {
+        p->buf[p->len] = '\0';
+        mpz_set_str (rop, p->buf, p->base);
+        mpz_ui_pow_ui (scale, p->base, p->len);
+    }
+    else {
+        mpz_set_ui (rop, 0);
+        mpz_set_ui (scale, 1);
+    }
+    while (p->depth) {
+        size_t i = --p->depth;
+        mpz_addmul (rop, p->stack[i].x, scale);
+        if (i) {
+            mpz_srcptr power = radix_power (top, p->base, p->stack[i].level);
+            if (!power) {
+                ok = false;
+                p->depth++;
+                break;
+            }
+            mpz_mul (scale, scale, power);
+        }
+        mpz_clear (p->stack[i].x);
+    }
+    mpz_clear (scale);
+    if (p->minus)
+        mpz_neg (rop, rop);
+    parser_reset (p);
+    if (!ok)
+        return oom ((NPObject*) p, result, true);
+    VOID_TO_NPVARIANT (*result);
+    return true;
+}
+
+static bool
+Parser_hasMethod (NPObject *npobj, NPIdentifier name)
+{
+    return name == ID_feed || name == ID_finish;
+}
+
+static bool
+parser_invoke (TopObject* top, Parser* p, NPIdentifier name,
+               const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    NPObject* npobj = &p->npobj;
+
+    if (name == ID_feed) {
+        NPString chunk;
+        if (argCount < 1)
+            return throwf (npobj, result, true, "missing argument");
+        if (!in_npstring (top, &args[0], &chunk))
+            return check_ex (top, npobj, result, true);
+        return parser_feed (top, p, &chunk, result);
+    }
+    if (name == ID_finish) {
+        mpz_ptr rop;
+        if (argCount < 1)
+            return throwf (npobj, result, true, "missing argument");
+        if (!in_dest_mpz (top, &args[0], &rop)) {
+            /* unshare_mpz refuses read-only constants.  */
+            if (top->errmsg)
+                return check_ex (top, npobj, result, true);
+            return throwf (npobj, result, true, "not an mpz");
+        }
+        return parser_finish (top, p, rop, result);
+    }
+    return false;
+}
+
+static bool
+Parser_invoke (NPObject *npobj, NPIdentifier name,
+               const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    TopObject* top = Parser_getTop (npobj);
+    TopObject* owner = gmp_owner_enter (top);
+    bool ret = parser_invoke (top, (Parser*) npobj, name, args, argCount,
+                              result);
+    gmp_owner_leave (owner);
+    quota_report (top, ret, result);
+    return check_ex (top, npobj, result, ret);
+}
+
+/* mpz.parser(base) returns an object whose feed(chunk) method accepts
+   successive pieces of a number's digits as mpz.set_str would, and
+   whose finish(z) method stores the number in z.  */
+static NPObject*
+x_x_mpz_parser (TopObject* top, int base)
+{
+    Parser* p = (Parser*) NPN_CreateObject (top->instance,
+                                            &top->Parser.npclass);
+    if (!p)
+        raise_oom ((NPObject*) top);
+    else
+        p->base = base;
+    return (NPObject*) p;
+}
+
+#define x_mpz_parser(base) x_x_mpz_parser (vTop, base)
+
+#endif  /* NPGMP_MPZ */
+
+/*
+ * Rand objects wrap gmp_randstate_t.
+ */
+
+#if NPGMP_RAND
+
+static NPObject*
+Rand_allocate (NPP npp, NPClass *aClass)
+{
+    TopObject* top = CONTAINING (TopObject, Rand, aClass);
+    Rand* ret = (Rand*) pool_alloc (top, sizeof (Rand));
+#if DEBUG_ALLOC
+    fprintf (stderr, "Rand allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        NPN_RetainObject ((NPObject*) top);
+        census_born (top, CENSUS_Rand);
+    }
+    return &ret->npobj;
+}
+
+static void
+Rand_deallocate (NPObject *npobj)
+{
+#if DEBUG_ALLOC
+    fprintf (stderr, "Rand deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    if (npobj)
+        gmp_randclear (((Rand*) npobj)->state);
+    TopObject* top = Rand_getTop (npobj);
+    pool_free (top, npobj, sizeof (Rand));
+    census_died (top, CENSUS_Rand);
+    NPN_ReleaseObject ((NPObject*) top);
+}
+
+static bool
+in_x_gmp_randstate_ptr (TopObject* top, const NPVariant* var,
+                        x_gmp_randstate_ptr* arg)
+{
+    if (!NPVARIANT_IS_OBJECT (*var)
+        || NPVARIANT_TO_OBJECT (*var)->_class != (NPClass*) &top->Rand)
+        return false;
+    *arg = &((Rand*) NPVARIANT_TO_OBJECT (*var))->state[0];
+    return true;
+}
+
+static bool
+in_uninit_rand (TopObject* top, const NPVariant* var, x_gmp_randstate_ptr* arg)
+{
+    bool ret = in_x_gmp_randstate_ptr (top, var, arg);
+    if (ret)
+        gmp_randclear (*arg);
+    return ret;
+}
+
+#define del_x_gmp_randstate_ptr(arg)
+#define del_uninit_rand(arg)
+
+static NPObject*
+x_x_randstate (TopObject* top)
+{
+    NPObject* ret = NPN_CreateObject (top->instance, &top->Rand.npclass);
+    if (ret)
+        gmp_randinit_default (&((Rand*) ret)->state[0]);
+    else
+        raise_oom ((NPObject*) top);
+    return ret;
+}
+
+#define x_randstate() x_x_randstate (vTop)
+
+static Bool
+is_randstate (Variant var)
+{
+    if (!NPVARIANT_IS_OBJECT (*var.arg))
+        return false;
+    NPObject* npobj = NPVARIANT_TO_OBJECT (*var.arg);
+    if (npobj->_class == (NPClass*) &var.top->Rand)
+        return true;
+    return false;
+}
+
+static int
+x_randinit_lc_2exp_size (uninit_rand state, mp_bitcnt_t size)
+{
+    int ret = gmp_randinit_lc_2exp_size (state, size);
+    if (!ret)
+        /* Rand_deallocate calls gmp_randclear, so must init.  */
+        gmp_randinit_default (state);
+    return ret;
+}
+
+#endif  /* NPGMP_RAND */
+
+typedef char EntryInfo;
+
+/*
+ * Class of ordinary functions like mpz_init and mpz_add.
+ */
+
+typedef struct _Entry {
+    NPObject npobj;
+    int number;  /* unique ID; currently, a line number in gmp-entries.h */
+    const EntryInfo* info;
+} Entry;
+
+static NPObject*
+Entry_allocate (NPP npp, NPClass *aClass)
+{
+    TopObject* top = CONTAINING (TopObject, Entry, aClass);
+    Entry* ret = (Entry*) pool_alloc (top, sizeof (Entry));
+#if DEBUG_ALLOC
+    fprintf (stderr, "Entry allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret)
+        NPN_RetainObject ((NPObject*) top);
+    return &ret->npobj;
+}
+
+static const char Properties[] =
+
+#define ENTRY(nargs, nret, string, id)    "\0" STRINGIFY(__LINE__) "|" string
+#include "gmp-entries.h"
+
+#define CONSTANT(constval, string, type)  "\0|" string
+#include "gmp-constants.h"
+
+    "\0";
+
+static const EntryInfo*
+first_entry ()
+{
+    return &Properties[1];
+}
+
+static const EntryInfo*
+next_entry (const EntryInfo* info)
+{
+    const char* ret = info + strlen (info) + 1;
+    return (*ret ? ret : 0);
+}
+
+static const char*
+EntryInfo_name (const EntryInfo* info)
+{
+    return strchr (info, '|') + 1;
+}
+
+static bool
+is_table_entry (const char* info)
+{
+    return info >= &Properties[0] &&
+        info < &Properties[sizeof Properties];
+}
+
+static const EntryInfo*
+lookup (const NPUTF8* name)
+{
+    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
+        if (!strcmp (name, EntryInfo_name (i)))
+            return i;
+    }
+    return 0;
+}
+
+static void
+EntryInfo_deallocate (const EntryInfo* info)
+{
+    /* If it's not in our const table, it came from NPN_MemAlloc. */
+    if (!is_table_entry (info))
+        NPN_MemFree ((void*) info);
+}
+
+static int
+EntryInfo_number (const EntryInfo* info)
+{
+    return atoi (info);
+}
+
+static bool
+has_properties (const NPUTF8* name)
+{
+    size_t len = strlen (name);
+
+    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
+        const char* iname = EntryInfo_name (i);
+        if (!strncmp (name, iname, len) && iname[len] == '.')
+            return true;
+    }
+    return false;
+}
+
+static const char*
+Entry_name (Entry* entry)
+{
+    const EntryInfo* ret = entry->info;
+    if (is_table_entry (ret))
+        return EntryInfo_name (ret);
+    return (const char*) ret;
+}
+
+static void
+Entry_deallocate (NPObject *npobj)
+{
+#if DEBUG_ALLOC
+    fprintf (stderr, "Entry deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    TopObject* top = Entry_getTop (npobj);
+    EntryInfo_deallocate (((Entry*) npobj)->info);
+    pool_free (top, npobj, sizeof (Entry));
+    NPN_ReleaseObject ((NPObject*) top);
+}
+
+enum Entry_number {
+
+    FIRST_ENTRY =
+#define ENTRY_GET_FIRST
+#include "gmp-entries.h"
+
+#define ENTRY(nargs, nret, string, id) , id = __LINE__
+#include "gmp-entries.h"
+};
+
+static const unsigned char EntryNargs[] = {
+#define ENTRY(nargs, nret, string, id) [__LINE__ - FIRST_ENTRY] = nargs,
+#include "gmp-entries.h"
+    0
+};
+static const unsigned char EntryNret[] = {
+#define ENTRY(nargs, nret, string, id) [__LINE__ - FIRST_ENTRY] = nret,
+#include "gmp-entries.h"
+    0
+};
+
+static inline size_t
+Entry_length (NPObject *npobj) {
+    return EntryNargs[((Entry*) npobj)->number - FIRST_ENTRY];
+}
+
+static inline size_t
+Entry_outLength (NPObject *npobj) {
+    return EntryNret[((Entry*) npobj)->number - FIRST_ENTRY];
+}
+
+/* Convert arguments from NPVariant to C types and free them when done.  */
+
+#undef IN
+#define IN(i, t) LIKELY (in_ ## t (vTop, vArgs + i, &vEntryArgs->a ## i))
+
+#undef DEL
+#define DEL(i, t) del_ ## t (vEntryArgs->a ## i)
+
+#undef PROTO_IN
+#define PROTO_IN(id)                                            \
+    static inline bool ALWAYS_INLINE                            \
+    in__ ## id (TopObject *vTop, const NPVariant *vArgs,        \
+                Args_ ## id* vEntryArgs)
+
+#undef PROTO_DEL
+#define PROTO_DEL(id)                                           \
+    static inline void ALWAYS_INLINE                            \
+    del__ ## id (Args_ ## id* vEntryArgs)
+
+#define ENTRY0(fun, string, id)                                 \
+    typedef struct { char dummy; } Args_ ## id;                 \
+    PROTO_IN (id)                                               \
+    {                                                           \
+        return true;                                            \
+    }                                                           \
+    PROTO_DEL (id)                                              \
+    {                                                           \
+    }
+
+#define ENTRY1(fun, string, id, t0)                             \
+    typedef struct { t0 a0; } Args_ ## id;                      \
+    PROTO_IN (id)                                               \
+    {                                                           \
+        if (!IN (0, t0)) goto del0_ ## id;                      \
+        return true; del0_ ## id:                               \
+        return false;                                           \
+    }                                                           \
+    PROTO_DEL (id)                                              \
+    {                                                           \
+        DEL (0, t0);                                            \
+    }
+
+#define ENTRY2(fun, string, id, t0, t1)                         \
+    typedef struct { t0 a0; t1 a1; } Args_ ## id;               \
+    PROTO_IN (id)                                               \
+    {                                                           \
+        if (!IN (0, t0)) goto del0_ ## id;                      \
+        if (!IN (1, t1)) goto del1_ ## id;                      \
+        return true; del1_ ## id:                               \
+        DEL (0, t0); del0_ ## id:                               \
+        return false;                                           \
+    }                                                           \
+    PROTO_DEL (id)                                              \
+    {                                                           \
+        DEL (1, t1);                                            \
+        DEL (0, t0);                                            \
+    }
+
+#define ENTRY3(fun, string, id, t0, t1, t2)                     \
+    typedef struct { t0 a0; t1 a1; t2 a2; } Args_ ## id;        \
+    PROTO_IN (id)                                               \
+    {                                                           \
+        if (!IN (0, t0)) goto del0_ ## id;                      \
+        if (!IN (1, t1)) goto del1_ ## id;                      \
+        if (!IN (2, t2)) goto del2_ ## id;                      \
+        return true; del2_ ## id:                               \
+        DEL (1, t1); del1_ ## id:                               \
+        DEL (0, t0); del0_ ## id:                               \
+        return false;                                           \
+    }                                                           \
+    PROTO_DEL (id)                                              \
+    {                                                           \
+        DEL (2, t2);                                            \
+        DEL (1, t1);                                            \
+        DEL (0, t0);                                            \
+    }
+
+#define ENTRY4(fun, string, id, t0, t1, t2, t3)                 \
+    typedef struct { t0 a0; t1 a1; t2 a2; t3 a3; } Args_ ## id; \
+    PROTO_IN (id)                                               \
+    {                                                           \
+        if (!IN (0, t0)) goto del0_ ## id;                      \
+        if (!IN (1, t1)) goto del1_ ## id;                      \
+        if (!IN (2, t2)) goto del2_ ## id;                      \
+        if (!IN (3, t3)) goto del3_ ## id;                      \
+        return true; del3_ ## id:                               \
+        DEL (2, t2); del2_ ## id:                               \
+        DEL (1, t1); del1_ ## id:                               \
+        DEL (0, t0); del0_ ## id:                               \
+        return false;                                           \
+    }                                                           \
+    PROTO_DEL (id)                                              \
+    {                                                           \
+        DEL (3, t3);                                            \
+        DEL (2, t2);                                            \
+        DEL (1, t1);                                            \
+        DEL (0, t0);                                            \
+    }
+
+#define ENTRY5(fun, string, id, t0, t1, t2, t3, t4)             \
+    typedef struct { t0 a0; t1 a1; t2 a2; t3 a3; t4 a4; }       \
+        Args_ ## id;                                            \
+    PROTO_IN (id)                                               \
+    {                                                           \
+        if (!IN (0, t0)) goto del0_ ## id;                      \
+        if (!IN (1, t1)) goto del1_ ## id;                      \
+        if (!IN (2, t2)) goto del2_ ## id;                      \
+        if (!IN (3, t3)) goto del3_ ## id;                      \
+        if (!IN (4, t4)) goto del4_ ## id;                      \
+        return true; del4_ ## id:                               \
+        DEL (3, t3); del3_ ## id:                               \
+        DEL (2, t2); del2_ ## id:                               \
+        DEL (1, t1); del1_ ## id:                               \
+        DEL (0, t0); del0_ ## id:                               \
+        return false;                                           \
+    }                                                           \
+    PROTO_DEL (id)                                              \
+    {                                                           \
+        DEL (4, t4);                                            \
+        DEL (3, t3);                                            \
+        DEL (2, t2);                                            \
+        DEL (1, t1);                                            \
+        DEL (0, t0);                                            \
+    }
+
+#include "gmp-entries.h"
+
+/* Convert C function results to NPVariant and deallocate the C values.  */
+
+#undef OUT
+#define OUT(i, t)                                               \
+    (outdel_ ## t (vTop, vEntryResults->a ## i, vResults + i)   \
+     || (del_ ## t (vEntryResults->a ## i), false))
+
+#undef DEL
+#define DEL(i, t) del_ ## t (vEntryResults->a ## i)
+
+#undef PROTO_OUT
+#define PROTO_OUT(id)                                           \
+    static inline bool ALWAYS_INLINE                            \
+    out__ ## id (TopObject *vTop, Results_ ## id* vEntryResults,\
+                 NPVariant *vResults)
+
+#define ENTRYR0(fun, string, id)                                \
+    typedef struct { char dummy; } Results_ ## id;              \
+    PROTO_OUT (id)                                              \
+    {                                                           \
+        return true;                                            \
+    }
+
+/* XXX not scalable to more return values */
+#define ENTRYR1(fun, string, id, r0)                            \
+    typedef struct { r0 a0; } Results_ ## id;                   \
+    PROTO_OUT (id)                                              \
+    {                                                           \
+        return OUT (0, r0);                                     \
+    }
+
+/* XXX not scalable to more return values */
+#define ENTRYR2(fun, string, id, r0, r1)                        \
+    typedef struct { r0 a0; r1 a1; } Results_ ## id;            \
+    PROTO_OUT (id)                                              \
+    {                                                           \
+        bool ret = true;                                        \
+        if (ret) ret = OUT (0, r0); else DEL (0, r0);           \
+        if (ret) {                                              \
+            ret = OUT (1, r1);                                  \
+            if (!ret)                                           \
+                NPN_ReleaseVariantValue (&vResults[0]);         \
+        }                                                       \
+        else                                                    \
+            DEL (1, r1);                                        \
+        return ret;                                             \
+    }
+
+#include "gmp-entries.h"
+
+#undef PROTO
+#define PROTO(id)                                               \
+    static inline void ALWAYS_INLINE                            \
+    call__ ## id (TopObject *vTop, Args_ ## id* i, Results_ ## id* o)
+
+#define ENTRY0R1(fun, string, id, r0)                           \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun ();                                         \
+    }
+
+#define ENTRY1R0(fun, string, id, t0)                           \
+    PROTO (id)                                                  \
+    {                                                           \
+        fun (i->a0);                                            \
+    }
+
+#define ENTRY1R1(fun, string, id, r0, t0)                       \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun (i->a0);                                    \
+    }
+
+#define ENTRY1R2(fun, string, id, r0, r1, t0)                   \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun (&o->a1, i->a0);                            \
+    }
+
+#define ENTRY2R0(fun, string, id, t0, t1)                       \
+    PROTO (id)                                                  \
+    {                                                           \
+        fun (i->a0, i->a1);                                     \
+    }
+
+#define ENTRY2R1(fun, string, id, r0, t0, t1)                   \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun (i->a0, i->a1);                             \
+    }
+
+#define ENTRY3R0(fun, string, id, t0, t1, t2)                   \
+    PROTO (id)                                                  \
+    {                                                           \
+        fun (i->a0, i->a1, i->a2);                              \
+    }
+
+#define ENTRY3R1(fun, string, id, r0, t0, t1, t2)               \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun (i->a0, i->a1, i->a2);                      \
+    }
+
+#define ENTRY3R2(fun, string, id, r0, r1, t0, t1, t2)           \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun (&o->a1, i->a0, i->a1, i->a2);              \
+    }
+
+#define ENTRY4R0(fun, string, id, t0, t1, t2, t3)               \
+    PROTO (id)                                                  \
+    {                                                           \
+        fun (i->a0, i->a1, i->a2, i->a3);                       \
+    }
+
+#define ENTRY4R1(fun, string, id, r0, t0, t1, t2, t3)           \
+    PROTO (id)                                                  \
+    {                                                           \
+        o->a0 = fun (i->a0, i->a1, i->a2, i->a3);               \
+    }
+
+#define ENTRY5R0(fun, string, id, t0, t1, t2, t3, t4)           \
+    PROTO (id)                                                  \
+    {                                                           \
+        fun (i->a0, i->a1, i->a2, i->a3, i->a4);                \
+    }
+
+#include "gmp-entries.h"
+
+static bool
+dispatch (TopObject* top, int entryNumber,
+          const NPVariant *args, NPVariant *results)
+{
+    switch (entryNumber) {
+
+        /* XXX Could distinguish pre-call from post-call errors.  */
+#define ENTRY(nargs, nret, string, id)                  \
+        case __LINE__: {                                \
+            Args_    ## id i;                           \
+            Results_ ## id o;                           \
+            if (!in__ ## id (top, args, &i))            \
+                return false;                           \
+            call__ ## id (top, &i, &o);                 \
+            del__ ## id (&i);                           \
+            return out__ ## id (top, &o, results);      \
+        }
+            
+#include "gmp-entries.h"
+
+    default:
+        return false;
+    }
+}
+
+static bool
+enter (TopObject* top, int entryNumber,
+       const NPVariant *args, NPVariant *results)
+{
+    TopObject* owner = gmp_owner_enter (top);
+    bool ret = dispatch (top, entryNumber, args, results);
+    gmp_owner_leave (owner);
+    quota_report (top, ret, 0);
+    return ret;
+}
+
+static bool
+Entry_invokeDefault (NPObject *npobj,
+                     const NPVariant *args, uint32_t argCount,
+                     NPVariant *result)
+{
+    TopObject* top = Entry_getTop (npobj);
+    Entry* entry = (Entry*) npobj;
+    size_t nargs, nret;
+    Tuple* tuple = 0;  /* avoid a warning */
+    NPVariant* out;
+
+    if (entry->number == 0)
+        return false;
+
+    gc_safe_point (top);
+    nargs = Entry_length (npobj);
+    nret = Entry_outLength (npobj);
+    if (argCount != nargs)
+        return throwf ((NPObject*) top, result, true,
+                       "wrong argument count: %d, expected %d",
+                       argCount, nargs);
+
+    if (nret <= 1)
+        out = result;
+    else {
+        tuple = make_tuple (top, nret);
+        if (!tuple)
+            return oom (npobj, result, true);
+        out = tuple->start;
+    }
+
+    if (!enter (top, entry->number, args, out)) {
+        if (nret > 1)
+            NPN_ReleaseObject ((NPObject*) tuple);
+        return throwf ((NPObject*) top, result, true,
+                       "%s: %s", Entry_name (entry),
+                       top->errmsg ?: "wrong argument type");
+    }
+
+    if (nret == 0)
+        VOID_TO_NPVARIANT (*result);
+
+    else if (nret > 1)
+        OBJECT_TO_NPVARIANT ((NPObject*) tuple, *result);
+
+    if (NPVARIANT_IS_OBJECT (*result)) {
+        NPObject* obj = retain_for_js (top, NPVARIANT_TO_OBJECT (*result));
+        if (obj)
+            OBJECT_TO_NPVARIANT (obj, *result);
+        else {
+            VOID_TO_NPVARIANT (*result);
+            raise_oom ((NPObject*) top);
+        }
+    }
+
+    /* Discard results if the call raised an error after all.  */
+    if (top->errmsg)
+        NPN_ReleaseVariantValue (result);
+    return check_ex (top, npobj, result, true);
+}
+
+/* Non-detachable Entry methods.  XXX Should implement call and apply.  */
+
+static bool
+Entry_hasMethod(NPObject *npobj, NPIdentifier name)
+{
+    return name == ID_toString;
+}
+
+static bool
+Entry_invoke (NPObject *npobj, NPIdentifier name,
+              const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    if (name == ID_toString) {
+        const char* name = Entry_name ((Entry*) npobj);
+        const char format[] = "function %s() { [native code] }";
+        size_t len = sizeof format + strlen (name) - 2;
+        char* ret = (char*) NPN_MemAlloc (len);
+
+        if (!ret)
+            return oom (npobj, result, true);
+
+        sprintf (ret, format, name);
+        STRINGN_TO_NPVARIANT (ret, len, *result);
+        return true;
+    }
+    return false;
+}
+
+static NPUTF8*
+get_fullname (TopObject* top, Entry* entry, NPIdentifier key)
+{
+    size_t len;
+    NPUTF8* name;
+    const NPUTF8* ename;
+    NPUTF8* fullname;
+
+    name = NPN_UTF8FromIdentifier (key);
+    if (!name) {
+        raise_oom ((NPObject*) top);
+        return 0;
+    }
+
+    if (!entry)
+        return name;
+
+    ename = Entry_name (entry);
+    len = strlen (ename) + strlen (name) + 2;
+    fullname = (NPUTF8*) NPN_MemAlloc (len);
+    if (fullname)
+        sprintf (fullname, "%s.%s", ename, name);
+    NPN_MemFree (name);
+    if (fullname)
+        return fullname;
+    raise_oom ((NPObject*) top);
+    return 0;
+}
+
+static bool
+has_subproperty (TopObject* top, NPObject *npobj, NPIdentifier key)
+{
+    Entry* entry = (Entry*) npobj;
+    NPUTF8* fullname;
+    bool ret;
+
+    if (entry && entry->number &&
+        (key == ID_length || key == NPN_GetStringIdentifier ("outLength")))
+        return true;
+
+    if (!NPN_IdentifierIsString (key))
+        return false;
+
+    fullname = get_fullname (top, entry, key);
+    if (!fullname)
+        return check_ex (top, npobj, 0, false);
+
+    ret = lookup (fullname) != 0 || has_properties (fullname);
+
+    NPN_MemFree (fullname);
+    return ret;
+}
+
+static bool
+Entry_hasProperty(NPObject *npobj, NPIdentifier key)
+{
+    return has_subproperty (Entry_getTop (npobj), npobj, key);
+}
+
+static bool
+get_entry (TopObject* top, const EntryInfo* info, NPVariant *result)
+{
+    int number = EntryInfo_number (info);
+    Entry* entry;
+
+    if (number == 0)
+        return false;
+
+    entry = (Entry*) NPN_CreateObject (top->instance, &top->Entry.npclass);
+
+    if (entry) {
+        entry->info = info;
+        entry->number = number;
+        OBJECT_TO_NPVARIANT ((NPObject*) entry, *result);
+    }
+    else
+        raise_oom ((NPObject*) top);
+
+    return true;
+}
+
+static bool
+get_subproperty (TopObject* top, NPObject *npobj, NPIdentifier key,
+                 NPVariant *result)
+{
+    Entry* entry = (Entry*) npobj;
+    NPUTF8* fullname;
+    const EntryInfo* info;
+
+    if (!NPN_IdentifierIsString (key)) {
+        VOID_TO_NPVARIANT (*result);
+        return true;
+    }
+
+    if (entry && entry->number) {
+        if (key == ID_length) {
+            INT32_TO_NPVARIANT (Entry_length (npobj), *result);
+            return true;
+        }
+        if (key == NPN_GetStringIdentifier ("outLength")) {
+            INT32_TO_NPVARIANT (Entry_outLength (npobj), *result);
+            return true;
+        }
+    }
+
+    fullname = get_fullname (top, entry, key);
+    if (!fullname)
+        return check_ex (top, npobj, result, true);
+
+    info = lookup (fullname);
+    if (!info) {
+        if (has_properties (fullname)) {
+            Entry* subentry = (Entry*) NPN_CreateObject
+                (top->instance, &top->Entry.npclass);
+            if (subentry) {
+                subentry->number = 0;
+                subentry->info = fullname;
+                OBJECT_TO_NPVARIANT ((NPObject*) subentry, *result);
+                return true;
+            }
+        }
+        else
+            VOID_TO_NPVARIANT (*result);
+    }
+    else if (get_entry (top, info, result))
+        /* ok */ ;
+
+#define CONSTANT(value, string, type)           \
+    else if (!strcmp (string, fullname))        \
+        out_ ## type (top, value, result);
+#include "gmp-constants.h"
+
+    NPN_MemFree (fullname);
+    return check_ex (top, npobj, result, true);
+}
+
+static bool
+Entry_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
+{
+    return get_subproperty (Entry_getTop (npobj), npobj, key, result);
+}
+
+static bool
+enumerate_sub (TopObject* top, NPObject *npobj, NPIdentifier **value,
+               uint32_t *count)
+{
+    Entry* entry = (Entry*) npobj;
+    uint32_t cnt = 0;
+    NPIdentifier *ptr = 0;
+    char* prefix;
+    size_t prefix_len;
+    const char* last;
+    size_t last_len;
+    size_t max_len = 0;
+    NPUTF8* buf = 0;
+
+    if (entry) {
+        const char* name = Entry_name (entry);
+        prefix_len = strlen (name) + 1;
+        prefix = NPN_MemAlloc (prefix_len + 1);
+        if (!prefix) {
+            *count = 0;
+            *value = 0;
+            return oom (npobj ?: (NPObject*) top, 0, true);
+        }
+        sprintf (prefix, "%s.", name);
+    }
+    else {
+        prefix = "";
+        prefix_len = 0;
+    }
+
+    /* For simplicity, assume every entry and its subentries are
+       contiguous, not like this:
+       gmp.mpz
+       gmp.mpq      <-- interrupts the gmp.mpz subtree
+       gmp.mpz.init
+
+       Such interruptions will result in duplicates returned by (a in b).
+     */
+    /* Scan once for count, then allocate, and scan to fill the array.  */
+    last = 0;
+    last_len = 0;
+    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
+        const char* iname = EntryInfo_name (i);
+        if (strncmp (prefix, iname, prefix_len) != 0)
+            continue;
+        const char* sub = iname + prefix_len;
+        size_t sub_len = strcspn (sub, ".");
+        if (last && last_len == sub_len && !strncmp (last, sub, sub_len))
+            continue;  /* seen already */
+        cnt++;
+        last = sub;
+        last_len = sub_len;
+        if (sub_len > max_len)
+            max_len = sub_len;
+    }
+
+    if (cnt)
+        ptr = (NPIdentifier*) NPN_MemAlloc (cnt * sizeof ptr[0]);
+    if (ptr)
+        buf = (NPUTF8*) NPN_MemAlloc (max_len + 1);
+
+    if (!buf) {
+        if (entry)
+            NPN_MemFree (prefix);
+        if (ptr)
+            NPN_MemFree (ptr);
+        *count = 0;
+        *value = 0;
+        if (cnt)
+            return oom (npobj ?: (NPObject*) top, 0, true);
+        return true;
+    }
+
+    last = 0;
+    last_len = 0;
+    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
+        const char* iname = EntryInfo_name (i);
+        if (strncmp (prefix, iname, prefix_len) != 0)
+            continue;
+        const char* sub = iname + prefix_len;
+        size_t sub_len = strcspn (sub, ".");
+        if (last && last_len == sub_len && !strncmp (last, sub, sub_len))
+            continue;  /* seen already */
+        last = sub;
+        last_len = sub_len;
+        strncpy (buf, sub, sub_len);
+        buf[sub_len] = '\0';
+        *ptr++ = NPN_GetStringIdentifier (buf);
+    }
+
+    *count = cnt;
+    *value = ptr - cnt;
+
+    NPN_MemFree (buf);
+    if (entry)
+        NPN_MemFree (prefix);
+    return true;
+}
+
+static bool
+Entry_enumerate (NPObject *npobj, NPIdentifier **value, uint32_t *count)
+{
+    return enumerate_sub (Entry_getTop (npobj), npobj, value, count);
+}
+
+#if NPGMP_SCRIPT
+
+/*
+ * Stack-based script support.
+ */
+
+#include <time.h>
+
+/* Optimize for optimizability only.  */
+
+/* A run of free NPVariant structures below a heap's allocation point.  */
+typedef struct _Hole {
+    NPVariant* start;
+    size_t size;
+} Hole;
+
+typedef struct _Heap {
+    struct _Heap* above;
+    struct _Heap* below;
+    size_t height;
+    size_t size;         /* size in NPVariant structures */
+    NPVariant* end;      /* array end (start is end - size) */
+    NPVariant* pointer;  /* point of allocation, END except in Thread.bump */
+    unsigned char markbits[];
+} Heap;
+
+/* Free runs of up to SMALL_VECTOR_MAX positions go on a list for their
+   exact size, linked through the first position's objectValue.  Longer
+   runs go in an array sorted by size.  */
+#define SMALL_VECTOR_MAX 64
+
+#if NPGMP_NURSERY
+/* Vectors of up to NURSERY_MAX_VECTOR positions start out in the
+   nursery, a heap outside the list, and move to the list if they
+   survive a minor collection.  */
+#define NURSERY_SIZE 8192
+#define NURSERY_MAX_VECTOR 256
+#endif
+
+/* An incremental collection marks about GC_DEFAULT_BUDGET positions
+   per safe point, unless the thread's gcBudget says otherwise.  */
+#define GC_DEFAULT_BUDGET 4096
+
+/* Collection pauses are counted by log2 of their microseconds.  */
+#define GC_PAUSE_BUCKETS 20
+
+/* A run with a sliceTime reads the clock every SLICE_CLOCK_STEPS
+   instructions.  */
+#define SLICE_CLOCK_STEPS 1024
+
+/* A vector waiting to be marked by an incremental collection.  */
+typedef struct _Gray {
+    NPVariant* start;
+    NPVariant* end;
+} Gray;
+
+#if NPGMP_COMPACT
+/* A run of live positions that compaction moves as a unit.  */
+typedef struct _Extent {
+    NPVariant* start;
+    NPVariant* end;
+    NPVariant* to;     /* new start */
+} Extent;
+
+/* A pointer that compaction must update, and its value when marked.
+   AFTER means OLD may be the end of a vector rather than within it.  */
+typedef struct _Fixup {
+    NPVariant** ptr;
+    NPVariant* old;
+    bool after;
+} Fixup;
+#endif
+
+typedef struct _Gc {
+    Heap** heaps;  /* ordered by address */
+    size_t nheaps;
+    TopObject* top;
+    bool minor;        /* collecting only the nursery */
+    bool incremental;  /* mark() leaves vectors on the gray list */
+    bool gray_lost;    /* out of memory for the gray list */
+    Gray* gray;
+    size_t ngray, gray_alloc;
+#if NPGMP_COMPACT
+    bool compacting;   /* recording extents and fixups */
+    Extent* extents;
+    size_t nextents, extents_alloc;
+    Fixup* fixups;
+    size_t nfixups, fixups_alloc;
+#endif
+} Gc;
+
+enum Opcode {
+#define OP(op) OP_ ## op = __LINE__,
+#include "gmp-ops.h"
+    OP_DATA
+};
+
+#define NUM_OPS OP_DATA
+
+static NPObject Ops[NUM_OPS];
+
+static enum Opcode
+op_to_opcode (const NPObject* npobj)
+{
+    int ret = npobj - &Ops[0];
+    if (ret >= 0 && ret < NUM_OPS)
+        return ret;
+    return OP_DATA;
+}
+
+static NPClass Opcode_npclass;
+
+static enum Opcode
+var_to_opcode (const NPVariant *value)
+{
+    if (NPVARIANT_IS_OBJECT (*value)) {
+        NPObject* obj = NPVARIANT_TO_OBJECT (*value);
+        if (obj->_class == &Opcode_npclass)
+            return op_to_opcode (obj);
+    }
+    return OP_DATA;
+}
+
+/* What a compiled instruction does, if not an opcode.  */
+enum InsnKind {
+    INSN_PUSH = OP_DATA,  /* push a literal */
+    INSN_CALL_TUPLE,      /* call a script */
+    INSN_CALL_ENTRY,      /* call a gmp function */
+    INSN_CALL             /* call some other function */
+};
+
+/* A compiled instruction.  Objects belong to the code tuple.  */
+typedef struct _Insn {
+    int kind;             /* enum Opcode or enum InsnKind */
+    uint32_t nargs;       /* arity of calls */
+    uint32_t nret;
+    union {
+        NPVariant literal;
+        struct _Tuple* tuple;
+        NPObject* fun;
+    } u;
+} Insn;
+
+/* A code tuple compiled for the interpreter.  Literals and functions
+   are resolved, and a quotation is one instruction.  */
+typedef struct _Code {
+    size_t length;
+    Insn insn[];
+} Code;
+
+static const char OpNames[] = "|"
+#define OP(op) # op "," STRINGIFY (__LINE__) "|"
+#include "gmp-ops.h"
+    ;
+
+static int
+id_to_opnum (NPObject *npobj, NPIdentifier key)
+{
+    char buf[16];
+    NPUTF8* name;
+    size_t len;
+    const char* p = 0;
+    int ret;
+
+    if (!NPN_IdentifierIsString (key))
+        return -1;
+
+    name = NPN_UTF8FromIdentifier (key);
+    if (!name) {
+        raise_oom (npobj);
+        return -2;
+    }
+
+    len = strlen (name);
+    if (len + 3 <= sizeof buf) {
+        buf[0] = '|';
+        memcpy (&buf[1], name, len);
+        buf[len+1] = ',';
+        buf[len+2] = '\0';
+        p = strstr (OpNames, buf);
+    }
+
+    if (p)
+        ret = atoi (strchr (p, ',') + 1);
+    else
+        ret = -1;
+
+    NPN_MemFree (name);
+    return ret;
+}
+
+static const char*
+opcode_to_string (enum Opcode opcode, size_t* len)
+{
+    char buf[16];
+    const char* p;
+    size_t l;
+
+    if (opcode < 0 || opcode >= NUM_OPS)
+        return 0;
+    sprintf (buf, ",%d|", (int) opcode);
+    p = strstr (OpNames, buf);
+    if (!p)
+        return 0;  /* should not happen */
+    for (l = 0; p[-1] != '|'; p--, l++)
+        continue;
+    *len = l;
+    return p;
+}
+
+/* Give ops a toString method.  */
+static bool
+Opcode_invoke (NPObject *npobj, NPIdentifier name,
+               const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    const char* s;
+    char* ret;
+    size_t len;
+
+    if (name != ID_toString)
+        return false;
+    s = opcode_to_string (op_to_opcode (npobj), &len);
+    if (!s)
+        return false;  /* should not happen */
+    ret = (char*) NPN_MemAlloc (len);
+    memcpy (ret, s, len);
+    STRINGN_TO_NPVARIANT (ret, len, *result);
+    return true;
+}
+
+static NPClass Opcode_npclass = {
+    structVersion   : NP_CLASS_STRUCT_VERSION,
+    deallocate      : obj_noop,
+    invalidate      : obj_invalidate,
+    hasMethod       : hasMethod_only_toString,
+    invoke          : Opcode_invoke,
+    hasProperty     : obj_id_false,
+    getProperty     : obj_id_var_void,
+    setProperty     : setProperty_ro,
+    removeProperty  : removeProperty_ro,
+    enumerate       : enumerate_empty
+};
+
+/* What a frame does when its code runs out.  */
+enum FrameKind {
+    FRAME_CALL,  /* return */
+    FRAME_LOOP,  /* loop: pop a condition, and rerun body if true */
+    FRAME_TEST,  /* while: pop a condition, and run body if true */
+    FRAME_BODY   /* while: run cond */
+};
+
+/* XXX Should frames be reference-counted or garbage-collected?  */
+typedef struct _Frame {
+    struct _Frame* next;
+    Tuple* code;
+    const Insn* ip;  /* next instruction in code->code */
+    int kind;        /* enum FrameKind */
+    Tuple* body;     /* retained, for branches and loops */
+    Tuple* cond;     /* retained, for while */
+    /*void* locals;*/
+} Frame;
+
+/* Return from FRAME to its caller, if any, dropping what FRAME
+   retains.  Return false if FRAME was the outermost.  */
+static bool
+frame_leave (Frame* frame)
+{
+    Frame* next = frame->next;
+
+    if (frame->body)
+        NPN_ReleaseObject (&frame->body->npobj);
+    if (frame->cond)
+        NPN_ReleaseObject (&frame->cond->npobj);
+    frame->body = frame->cond = 0;
+    if (!next)
+        return false;
+    *frame = *next;
+    NPN_MemFree (next);
+    return true;
+}
+
+typedef struct _Stack {
+    Tuple tuple;
+    size_t length;  /* includes substacks.
+                       XXX probably should include *only* substacks
+                       and be called something like segment_height. */
+    ulong segment;  /* number of segments below this one */
+    struct _Stack** table;
+} Stack;
+
+/* XXX Consider moving to C++.  */
+
+#define SEGMENT_THRESHOLD 32
+
+static inline size_t
+Stack_length (const Stack* stack)
+{
+    return stack->length;
+}
+
+static inline void
+Stack_set_length (Stack* stack, size_t length)
+{
+    stack->length = length;
+}
+
+static inline NPVariant*
+Segment_start (const Stack* stack) { return stack->tuple.start; }
+static inline NPVariant*
+Segment_end (const Stack* stack) { return stack->tuple.end; }
+
+static inline void
+Segment_set_start (Stack* stack, NPVariant* start)
+{
+    stack->tuple.start = start;
+}
+
+static inline void
+Segment_set_end (Stack* stack, NPVariant* end)
+{
+    stack->tuple.end = end;
+}
+
+static inline bool
+Segment_shared_p (const Stack* seg)
+{
+    return seg->tuple.npobj.referenceCount > 1;
+}
+
+static inline size_t
+Segment_length (const Stack* stack)
+{
+    return Segment_end (stack) - Segment_start (stack);
+}
+
+static inline bool
+Segment_contains (const Stack* stack, size_t index)
+{
+    /* Careful!  This relies on unsigned modular arithmetic.  */
+    return (size_t) (stack->length - 1 - index) < Segment_length (stack);
+}
+
+static inline size_t
+Segment_height (const Stack* stack)
+{
+    return stack->length - Segment_length (stack);
+}
+
+static inline void
+Segment_set_height (Stack* stack, size_t height)
+{
+    stack->length = height + Segment_length (stack);
+}
+
+static inline Stack**
+Segment_table (const Stack* stack)
+{
+    return stack->table;
+}
+
+static inline void
+Segment_set_table (Stack* stack, Stack** table)
+{
+    stack->table = table;
+}
+
+#if __GNUC__
+#define popcount(x) __builtin_popcount (x)
+#else
+
+static int
+popcount (unsigned int x)
+{
+    int ret;
+    for (ret = 0; x; x >>= 1)
+        ret += (x & 1);
+    return ret;
+}
+
+#endif  /* __GNUC__ */
+
+static Stack**
+Segment_copy_table (const Stack* stack)
+{
+    Stack** table;
+    size_t n = popcount (stack->segment);
+
+    table = NPN_MemAlloc (n * sizeof table[0]);
+    if (table)
+        memcpy (table, Segment_table (stack), n * sizeof table[0]);
+    return table;
+}
+
+/* The following four functions share knowledge of stack->table.  The
+   table supports lookup by index or segment number in a segmented
+   array in O(log(N)) time and O(N*log(N)) space, where N is the
+   number of segments.
+
+   XXX The order of pointers in the table should probably be reversed,
+   shifting the popcount() burden from sequential to random access.
+   Alternatively, one could add the table length to the Stack
+   structure.  */
+
+static Stack* Stack_get_segment (const Stack* stack, unsigned int segment);
+
+/* Place this segment atop an arbitrary stack.  Return false if memory
+   allocation fails.  Assumes STACK->table is *not* live on entry.  */
+static bool
+Segment_set_prev (Stack* stack, const Stack* prev)
+{
+    assert (!stack->table);
+
+    if (prev) {
+        size_t n;
+        Stack** table;
+        unsigned int mask;
+
+        stack->segment = prev->segment + 1;
+        n = popcount (stack->segment);
+        table = (Stack**) NPN_MemAlloc (n * sizeof table[0]);
+        if (!table)
+            return false;
+
+        Segment_set_table (stack, table);
+        NPN_RetainObject ((NPObject*) prev);
+        mask = stack->segment;
+        for (unsigned int bit = 1; bit < stack->segment; bit <<= 1) {
+            if (stack->segment & bit)
+                table[--n] = Stack_get_segment (prev, mask &~ bit);
+            mask |= bit;
+        }
+        assert (n == 0);
+        Stack_set_length (stack, Segment_length (stack) + Stack_length (prev));
+    }
+    else {
+        stack->segment = 0;
+        Segment_set_table (stack, 0);
+        Stack_set_length (stack, Segment_length (stack));
+    }
+    return true;
+}
+
+/* Return the segment containing INDEX.  */
+static Stack*
+Stack_segment_containing (const Stack* stack, size_t index)
+{
+    assert (index < Stack_length (stack));
+    while (!Segment_contains (stack, index)) {
+        Stack** table = Segment_table (stack);
+        size_t i;
+        for (i = 0; index >= Stack_length (table[i]); i++)
+            continue;
+        stack = table[i];
+    }
+    return (Stack*) stack;
+}
+
+/* Return segment number SEGMENT.  */
+static Stack*
+Stack_get_segment (const Stack* stack, unsigned int segment)
+{
+    assert (segment <= stack->segment);
+    while (segment != stack->segment) {
+        Stack** table = Segment_table (stack);
+        size_t i;
+        for (i = 0; segment >= table[i]->segment; i++)
+            continue;
+        stack = table[i];
+    }
+    return (Stack*) stack;
+}
+
+/* Return a pointer to the table element holding a pointer to the
+   previous segment.  The stack is valid so long as the previous
+   segment's number is one less than STACK->segment, every segment's
+   length field is correct, and there are no empty segments.  */
+static inline Stack**
+Segment_prev_ref (const Stack* stack)
+{
+    return Segment_table (stack) + (popcount (stack->segment) - 1);
+}
+
+/* End of functions intimate with stack->table.  */
+
+#if EXAMPLE_FOR_DOCUMENTATION
+static bool
+Stack_valid_p (const Stack* stack)
+{
+    size_t segment_length = Segment_length (stack);
+    const Stack* prev = *(Stack_wprev_ref (stack));
+    size_t prev_length = (prev ? prev->length : 0);
+    size_t prev_number = (prev ? prev->segment : 0);
+
+    /* This assumes all STACK->table elements point to segments of STACK.  */
+    return segment_length > 0 &&
+        stack->length == prev_length + segment_length &&
+        stack->segment == prev_segment + 1 &&
+        (prev == 0 || Stack_valid_p (prev));
+}
+#endif  /* EXAMPLE_FOR_DOCUMENTATION */
+
+static NPVariant*
+Stack_ref (const Stack* stack, size_t index)
+{
+    stack = Stack_segment_containing (stack, index);
+    return Segment_start (stack) + (index - Segment_height (stack));
+}
+
+static Stack*
+Segment_prev (const Stack* stack)
+{
+    return (stack->segment ? *Segment_prev_ref (stack) : 0);
+}
+
+static inline void
+Segment_init (Stack* stack, NPVariant* start, NPVariant* end,
+              size_t height, unsigned int segment, Stack** table)
+{
+    Segment_set_start  (stack, start);
+    Segment_set_end    (stack, end);
+    Segment_set_height (stack, height);
+    stack->segment = segment;
+    Segment_set_table  (stack, table);
+}
+
+static Stack*
+Stack_create (TopObject* top, NPVariant* start, NPVariant* end,
+              size_t height, unsigned int segment, Stack** table)
+{
+    Stack* stack;
+
+    stack = (Stack*) NPN_CreateObject (top->instance, &top->Stack.npclass);
+
+    if (stack)
+        Segment_init (stack, start, end, height, segment, table);
+    return stack;
+}
+
+/* Return a pass-thru copy of the part of STACK from 0 to INDEX, or
+   null if allocation fails.  Requires INDEX > 0.  */
+
+static Stack*
+Stack_substack (TopObject* top, const Stack* stack, size_t index)
+{
+    Stack* copy;
+    Stack** table;
+    assert (index <= Stack_length (stack));
+    assert (index > 0);
+
+    copy = Stack_segment_containing (stack, index - 1);
+
+    if (index == Stack_length (copy)) {
+        NPN_RetainObject ((NPObject*) copy);
+        return copy;
+    }
+    assert (Segment_length (copy) > 1);
+
+    table = Segment_copy_table (copy);
+    if (!table)
+        return 0;
+
+    copy = Stack_create (top, Segment_start (copy),
+                         Segment_start (copy) + (index - Segment_height (copy)),
+                         Segment_height (copy), copy->segment, table);
+    if (!copy)
+        NPN_MemFree (table);
+    return copy;
+}
+
+static void
+Segment_clear (Stack* stack)
+{
+    Stack* prev = Segment_prev (stack);
+    if (prev) {
+        NPN_ReleaseObject ((NPObject*) prev);
+        NPN_MemFree (stack->table);
+#ifndef NDEBUG
+        stack->table = 0;
+#endif
+    }
+}
+
+static NPObject*
+Stack_allocate (NPP npp, NPClass *aClass)
+{
+    Stack* ret = (Stack*) NPN_MemAlloc (sizeof (Stack));
+#if DEBUG_ALLOC
+    fprintf (stderr, "Stack allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        memset (ret, '\0', sizeof *ret);
+        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Stack, aClass));
+        census_born (CONTAINING (TopObject, Stack, aClass), CENSUS_Stack);
+    }
+    return (NPObject*) ret;
+}
+
+static void
+Stack_deallocate (NPObject *npobj)
+{
+    Stack* stack = (Stack*) npobj;
+#if DEBUG_ALLOC
+    fprintf (stderr, "Stack deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+    if (stack->table)
+        Segment_clear (stack);
+    census_died (Stack_getTop (npobj), CENSUS_Stack);
+    NPN_ReleaseObject ((NPObject*) Stack_getTop (npobj));
+    NPN_MemFree (npobj);
+}
+
+static NPIdentifier ID_segment, ID_previousSegment;
+
+static bool
+Stack_hasProperty (NPObject *npobj, NPIdentifier key)
+{
+    return Tuple_hasProperty (npobj, key) ||
+        key == ID_segment || key == ID_previousSegment;
+}
+
+static bool
+stack_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
+{
+    const Stack* stack = (Stack*) npobj;
+
+    if (tuple_getProperty (npobj, key, result))
+        return true;
+    if (key == ID_segment)
+        DOUBLE_TO_NPVARIANT ((double) stack->segment, *result);
+    else if (key == ID_previousSegment) {
+        stack = Segment_prev (stack);
+        if (stack)
+            OBJECT_TO_NPVARIANT (NPN_RetainObject ((NPObject*) stack), *result);
+        else
+            VOID_TO_NPVARIANT (*result);
+    }
+    else
+        VOID_TO_NPVARIANT (*result);
+    return true;
+}
+
+static bool
+Stack_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
+{
+    if (!stack_getProperty (npobj, key, result))
+        VOID_TO_NPVARIANT (*result);
+    return true;
+}
+
+static NPObject*
+Root_allocate (NPP npp, NPClass *aClass)
+{
+    Root* ret = (Root*) NPN_MemAlloc (sizeof (Root));
+#if DEBUG_ALLOC
+    fprintf (stderr, "Root allocate %p\n", ret);
+#endif  /* DEBUG_ALLOC */
+    if (ret) {
+        memset (ret, '\0', sizeof *ret);
+        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Root, aClass));
+        census_born (CONTAINING (TopObject, Root, aClass), CENSUS_Root);
+        ret->payload = 0;
+    }
+    return (NPObject*) ret;
+}
+
+static void
+Root_deallocate (NPObject *npobj)
+{
+    Root* root = (Root*) npobj;
+#if DEBUG_ALLOC
+    fprintf (stderr, "Root deallocate %p\n", npobj);
+#endif  /* DEBUG_ALLOC */
+
+    if (root->prev)
+        *root->prev = root->next;
+    if (root->next)
+        root->next->prev = root->prev;
+
+    NPObject* payload = root->payload;
+    if (payload)
+        NPN_ReleaseObject (payload);
+    census_died (Root_getTop (npobj), CENSUS_Root);
+    NPN_ReleaseObject ((NPObject*) Root_getTop (npobj));
+    NPN_MemFree (npobj);
+}
+
+/* Forward all methods other than memory management to the payload
+   object.  The payload is always one of ours, so the methods that
+   scripts call most, such as toString, go straight to its class
+   instead of back through the browser.  */
+
+static bool
+Root_hasMethod (NPObject *npobj, NPIdentifier name)
+{
+    NPObject* payload = ((Root*) npobj)->payload;
+    return payload->_class->hasMethod
+        && payload->_class->hasMethod (payload, name);
+}
+static bool
+Root_invoke (NPObject *npobj, NPIdentifier name,
+             const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    NPObject* payload = ((Root*) npobj)->payload;
+    return payload->_class->invoke
+        && payload->_class->invoke (payload, name, args, argCount, result);
+}
+static bool
+Root_invokeDefault (NPObject *npobj,
+                    const NPVariant *args, uint32_t argCount, NPVariant *result)
+{
+    NPObject* payload = ((Root*) npobj)->payload;
+    return payload->_class->invokeDefault
+        && payload->_class->invokeDefault (payload, args, argCount, result);
+}
+static bool
+Root_hasProperty (NPObject *npobj, NPIdentifier name)
+{
+    NPObject* payload = ((Root*) npobj)->payload;
+    return payload->_class->hasProperty
+        && payload->_class->hasProperty (payload, name);
+}
+static bool
+Root_getProperty (NPObject *npobj, NPIdentifier name, NPVariant *result)
+{
+    NPObject* payload = ((Root*) npobj)->payload;
+    return payload->_class->getProperty
+        && payload->_class->getProperty (payload, name, result);
+}
+static bool
+Root_setProperty (NPObject *npobj, NPIdentifier name, const NPVariant *value)
+{
+    Root* root = (Root*) npobj;
+    TopObject* top = Root_getTop (npobj);
+    return NPN_SetProperty (top->instance, root->payload, name, value);
 }
-
-/* Non-detachable Entry methods.  XXX Should implement call and apply.  */
-
 static bool
-Entry_hasMethod(NPObject *npobj, NPIdentifier name)
+Root_removeProperty (NPObject *npobj, NPIdentifier name)
 {
-    return name == ID_toString;
+    Root* root = (Root*) npobj;
+    TopObject* top = Root_getTop (npobj);
+    return NPN_RemoveProperty (top->instance, root->payload, name);
 }
-
 static bool
-Entry_invoke (NPObject *npobj, NPIdentifier name,
-              const NPVariant *args, uint32_t argCount, NPVariant *result)
+Root_enumerate (NPObject *npobj, NPIdentifier **value, uint32_t *count)
 {
-    if (name == ID_toString) {
-        const char* name = Entry_name ((Entry*) npobj);
-        const char format[] = "function %s() { [native code] }";
-        size_t len = sizeof format + strlen (name) - 2;
-        char* ret = (char*) NPN_MemAlloc (len);
-
-        if (!ret)
-            return oom (npobj, result, true);
-
-        sprintf (ret, format, name);
-        STRINGN_TO_NPVARIANT (ret, len, *result);
-        return true;
-    }
-    return false;
+    Root* root = (Root*) npobj;
+    TopObject* top = Root_getTop (npobj);
+    return NPN_Enumerate (top->instance, root->payload, value, count);
 }
-
-static NPUTF8*
-get_fullname (TopObject* top, Entry* entry, NPIdentifier key)
+static bool
+Root_construct (NPObject *npobj,
+                const NPVariant *args, uint32_t argCount, NPVariant *result)
 {
-    size_t len;
-    NPUTF8* name;
-    const NPUTF8* ename;
-    NPUTF8* fullname;
+    Root* root = (Root*) npobj;
+    TopObject* top = Root_getTop (npobj);
+    return NPN_Construct (top->instance, root->payload, args, argCount, result);
+}
 
-    name = NPN_UTF8FromIdentifier (key);
-    if (!name) {
-        raise_oom ((NPObject*) top);
-        return 0;
-    }
 
-    if (!entry)
-        return name;
+typedef struct _Thread {
+    Stack stack;
+    Frame frame;
+    Heap* heap;
+    Heap* bump;             /* heap that vector_alloc bumps */
+    NPVariant* free_small[SMALL_VECTOR_MAX + 1];
+    Hole* free_big;
+    size_t nfree_big;
+    size_t free_big_alloc;
+    size_t free_total;      /* positions on the free lists */
+    size_t alloc_since_gc;
+    size_t last_heap_size;  /* size in NPVariant structures */
+    Root* roots;            /* heap areas pointed to by JavaScript.  */
+    NPVariant* pc;
+    NPVariant* sp;
+    void* tls;              /* to be used with tsearch() */
+    Gc* gc;
+    Gc* major;              /* incremental collection in progress */
+    size_t gc_budget;       /* gcBudget, or 0 to collect at once */
+    uint32_t gc_pauses[GC_PAUSE_BUCKETS];  /* gcPauses */
+    bool gc_wanted;         /* vector_alloc asks for a collection */
+    bool compact_wanted;    /* next collection should not be incremental */
+    size_t slice_steps;     /* sliceSteps, or 0 for no limit */
+    size_t slice_time;      /* sliceTime in milliseconds, or 0 */
+    size_t steps;           /* instructions left in this slice */
+    double slice_end;       /* monotonic_us() when the slice is up */
+    bool suspended;         /* a run waits for the thread to be called */
+#if NPGMP_NURSERY
+    Heap* nursery;
+    NPVariant** remembered; /* old positions that may point at young */
+    size_t nremembered;
+    size_t remembered_alloc;
+    bool remembered_lost;   /* out of memory, so trace all old vectors */
+    bool minor_wanted;      /* vector_alloc asks for a minor collection */
+#endif
+} Thread;
 
-    ename = Entry_name (entry);
-    len = strlen (ename) + strlen (name) + 2;
-    fullname = (NPUTF8*) NPN_MemAlloc (len);
-    if (fullname)
-        sprintf (fullname, "%s.%s", ename, name);
-    NPN_MemFree (name);
-    if (fullname)
-        return fullname;
-    raise_oom ((NPObject*) top);
-    return 0;
-}
+static THREAD_LOCAL Thread* Current;
 
-static bool
-has_subproperty (TopObject* top, NPObject *npobj, NPIdentifier key)
+/* Make THREAD the one whose heap the allocator and collector use, and
+   return the previous one for thread_leave.  */
+static inline Thread*
+thread_enter (Thread* thread)
 {
-    Entry* entry = (Entry*) npobj;
-    NPUTF8* fullname;
-    bool ret;
-
-    if (entry && entry->number &&
-        (key == ID_length || key == NPN_GetStringIdentifier ("outLength")))
-        return true;
-
-    if (!NPN_IdentifierIsString (key))
-        return false;
+    Thread* previous = Current;
+    Current = thread;
+    return previous;
+}
 
-    fullname = get_fullname (top, entry, key);
-    if (!fullname)
-        return check_ex (top, npobj, 0, false);
+static inline void
+thread_leave (Thread* previous)
+{
+    Current = previous;
+}
 
-    ret = lookup (fullname) != 0 || has_properties (fullname);
+static NPIdentifier ID_op, ID_thread;
+static NPIdentifier ID_gcBudget, ID_gcPauses;
+static NPIdentifier ID_sliceSteps, ID_sliceTime, ID_suspended;
 
-    NPN_MemFree (fullname);
-    return ret;
-}
+typedef struct _Property {
+    NPUTF8* key;
+    NPVariant* value;
+} Property;
 
-static bool
-Entry_hasProperty(NPObject *npobj, NPIdentifier key)
+static int
+compare_properties (const void* a1, const void* a2)
 {
-    return has_subproperty (Entry_getTop (npobj), npobj, key);
+    const NPUTF8* s1 = ((Property*) a1)->key;
+    const NPUTF8* s2 = ((Property*) a2)->key;
+    return strcmp (s1, s2);
 }
 
-static bool
-get_entry (TopObject* top, const EntryInfo* info, NPVariant *result)
+/* Return the heap containing VAR, or null if VAR is not in a heap.  */
+static Heap*
+find_heap (const Gc* gcobj, const NPVariant* var)
 {
-    int number = EntryInfo_number (info);
-    Entry* entry;
-
-    if (number == 0)
-        return false;
+    size_t lo = 0, hi = gcobj->nheaps;
 
-    entry = (Entry*) NPN_CreateObject (top->instance, &top->Entry.npclass);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        Heap* heap = gcobj->heaps[mid];
 
-    if (entry) {
-        entry->info = info;
-        entry->number = number;
-        OBJECT_TO_NPVARIANT ((NPObject*) entry, *result);
+        if (var < heap->end - heap->size)
+            hi = mid;
+        else if (var >= heap->end)
+            lo = mid + 1;
+        else
+            return heap;
     }
-    else
-        raise_oom ((NPObject*) top);
+    return 0;
+}
 
-    return true;
+static inline bool
+marked_p (const Heap* heap, const NPVariant* var)
+{
+    size_t i = var - (heap->end - heap->size);
+    return heap->markbits[i / 8] & (1 << (i % 8));
 }
 
-static bool
-get_subproperty (TopObject* top, NPObject *npobj, NPIdentifier key,
-                 NPVariant *result)
+static void mark_object (Gc* gcobj, NPObject* object);
+
+#if NPGMP_COMPACT
+
+/* Append an element of SIZE bytes to the array at *ARRAYP and return
+   it.  If out of memory, stop recording and return null.  */
+static void*
+gc_push (Gc* gcobj, void* arrayp, size_t* count, size_t* alloc, size_t size)
 {
-    Entry* entry = (Entry*) npobj;
-    NPUTF8* fullname;
-    const EntryInfo* info;
+    char** array = (char**) arrayp;
 
-    if (!NPN_IdentifierIsString (key)) {
-        VOID_TO_NPVARIANT (*result);
-        return true;
-    }
+    if (!gcobj->compacting)
+        return 0;
+    if (*count == *alloc) {
+        size_t n = (*alloc ? 2 * *alloc : 64);
+        char* grown = (char*) NPN_MemAlloc (n * size);
 
-    if (entry && entry->number) {
-        if (key == ID_length) {
-            INT32_TO_NPVARIANT (Entry_length (npobj), *result);
-            return true;
+        if (!grown) {
+            gcobj->compacting = false;
+            return 0;
         }
-        if (key == NPN_GetStringIdentifier ("outLength")) {
-            INT32_TO_NPVARIANT (Entry_outLength (npobj), *result);
-            return true;
+        if (*array) {
+            memcpy (grown, *array, *count * size);
+            NPN_MemFree (*array);
         }
+        *array = grown;
+        *alloc = n;
     }
+    return *array + (*count)++ * size;
+}
 
-    fullname = get_fullname (top, entry, key);
-    if (!fullname)
-        return check_ex (top, npobj, result, true);
-
-    info = lookup (fullname);
-    if (!info) {
-        if (has_properties (fullname)) {
-            Entry* subentry = (Entry*) NPN_CreateObject
-                (top->instance, &top->Entry.npclass);
-            if (subentry) {
-                subentry->number = 0;
-                subentry->info = fullname;
-                OBJECT_TO_NPVARIANT ((NPObject*) subentry, *result);
-                return true;
-            }
-        }
-        else
-            VOID_TO_NPVARIANT (*result);
+static void
+add_fixup (Gc* gcobj, NPVariant** ptr, bool after)
+{
+    Fixup* fixup = (Fixup*) gc_push (gcobj, &gcobj->fixups, &gcobj->nfixups,
+                                     &gcobj->fixups_alloc, sizeof *fixup);
+    if (fixup) {
+        fixup->ptr = ptr;
+        fixup->old = *ptr;
+        fixup->after = after;
     }
-    else if (get_entry (top, info, result))
-        /* ok */ ;
-
-#define CONSTANT(value, string, type)           \
-    else if (!strcmp (string, fullname))        \
-        out_ ## type (top, value, result);
-#include "gmp-constants.h"
-
-    NPN_MemFree (fullname);
-    return check_ex (top, npobj, result, true);
 }
 
-static bool
-Entry_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
-{
-    return get_subproperty (Entry_getTop (npobj), npobj, key, result);
-}
+#else
+# define add_fixup(gcobj, ptr, after)
+#endif  /* NPGMP_COMPACT */
 
-static bool
-enumerate_sub (TopObject* top, NPObject *npobj, NPIdentifier **value,
-               uint32_t *count)
+/* Put START to END on the gray list of an incremental collection.  */
+static void
+gray_push (Gc* gcobj, NPVariant* start, NPVariant* end)
 {
-    Entry* entry = (Entry*) npobj;
-    uint32_t cnt = 0;
-    NPIdentifier *ptr = 0;
-    char* prefix;
-    size_t prefix_len;
-    const char* last;
-    size_t last_len;
-    size_t max_len = 0;
-    NPUTF8* buf = 0;
+    if (gcobj->ngray == gcobj->gray_alloc) {
+        size_t alloc = (gcobj->gray_alloc ? 2 * gcobj->gray_alloc : 64);
+        Gray* grown = (Gray*) NPN_MemAlloc (alloc * sizeof grown[0]);
 
-    if (entry) {
-        const char* name = Entry_name (entry);
-        prefix_len = strlen (name) + 1;
-        prefix = NPN_MemAlloc (prefix_len + 1);
-        if (!prefix) {
-            *count = 0;
-            *value = 0;
-            return oom (npobj ?: (NPObject*) top, 0, true);
+        if (!grown) {
+            gcobj->gray_lost = true;  /* gc_finish() starts over */
+            return;
         }
-        sprintf (prefix, "%s.", name);
-    }
-    else {
-        prefix = "";
-        prefix_len = 0;
-    }
-
-    /* For simplicity, assume every entry and its subentries are
-       contiguous, not like this:
-       gmp.mpz
-       gmp.mpq      <-- interrupts the gmp.mpz subtree
-       gmp.mpz.init
-
-       Such interruptions will result in duplicates returned by (a in b).
-     */
-    /* Scan once for count, then allocate, and scan to fill the array.  */
-    last = 0;
-    last_len = 0;
-    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
-        const char* iname = EntryInfo_name (i);
-        if (strncmp (prefix, iname, prefix_len) != 0)
-            continue;
-        const char* sub = iname + prefix_len;
-        size_t sub_len = strcspn (sub, ".");
-        if (last && last_len == sub_len && !strncmp (last, sub, sub_len))
-            continue;  /* seen already */
-        cnt++;
-        last = sub;
-        last_len = sub_len;
-        if (sub_len > max_len)
-            max_len = sub_len;
+        if (gcobj->gray) {
+            memcpy (grown, gcobj->gray, gcobj->ngray * sizeof grown[0]);
+            NPN_MemFree (gcobj->gray);
+        }
+        gcobj->gray = grown;
+        gcobj->gray_alloc = alloc;
     }
+    gcobj->gray[gcobj->ngray].start = start;
+    gcobj->gray[gcobj->ngray].end = end;
+    gcobj->ngray++;
+}
 
-    if (cnt)
-        ptr = (NPIdentifier*) NPN_MemAlloc (cnt * sizeof ptr[0]);
-    if (ptr)
-        buf = (NPUTF8*) NPN_MemAlloc (max_len + 1);
-
-    if (!buf) {
-        if (entry)
-            NPN_MemFree (prefix);
-        if (ptr)
-            NPN_MemFree (ptr);
-        *count = 0;
-        *value = 0;
-        if (cnt)
-            return oom (npobj ?: (NPObject*) top, 0, true);
-        return true;
+/* Mark the heap positions from START to END, which lie in one heap or
+   outside all heaps, and everything their values refer to.  */
+static void
+mark (Gc* gcobj, NPVariant* start, NPVariant* end)
+{
+    Heap* heap = (start < end ? find_heap (gcobj, start) : 0);
+    bool fresh = false;
+
+    if (!heap && gcobj->minor)
+        return;  /* old, see mark_young_refs */
+
+    for (NPVariant* var = start; var < end; var++) {
+        if (heap) {
+            size_t i = var - (heap->end - heap->size);
+            if (heap->markbits[i / 8] & (1 << (i % 8)))
+                continue;
+            heap->markbits[i / 8] |= 1 << (i % 8);
+            fresh = true;
+        }
+        if (NPVARIANT_IS_OBJECT (*var))
+            mark_object (gcobj, NPVARIANT_TO_OBJECT (*var));
     }
 
-    last = 0;
-    last_len = 0;
-    for (const EntryInfo* i = first_entry (); i; i = next_entry (i)) {
-        const char* iname = EntryInfo_name (i);
-        if (strncmp (prefix, iname, prefix_len) != 0)
-            continue;
-        const char* sub = iname + prefix_len;
-        size_t sub_len = strcspn (sub, ".");
-        if (last && last_len == sub_len && !strncmp (last, sub, sub_len))
-            continue;  /* seen already */
-        last = sub;
-        last_len = sub_len;
-        strncpy (buf, sub, sub_len);
-        buf[sub_len] = '\0';
-        *ptr++ = NPN_GetStringIdentifier (buf);
+#if NPGMP_COMPACT
+    if (fresh) {
+        Extent* extent = (Extent*) gc_push (gcobj, &gcobj->extents,
+                                            &gcobj->nextents,
+                                            &gcobj->extents_alloc,
+                                            sizeof *extent);
+        if (extent) {
+            extent->start = start;
+            extent->end = end;
+        }
     }
+#endif
+}
 
-    *count = cnt;
-    *value = ptr - cnt;
+/* Mark the vector of TUPLE, a Tuple or Stack segment.  */
+static void
+mark_tuple (Gc* gcobj, Tuple* tuple)
+{
+    if (tuple->start < tuple->end) {
+        add_fixup (gcobj, &tuple->start, false);
+        add_fixup (gcobj, &tuple->end, true);
+        if (gcobj->incremental)
+            gray_push (gcobj, tuple->start, tuple->end);
+        else
+            mark (gcobj, tuple->start, tuple->end);
+    }
+}
 
-    NPN_MemFree (buf);
-    if (entry)
-        NPN_MemFree (prefix);
-    return true;
+/* Mark what the positions from START to END refer to, whether or not
+   the positions are marked.  */
+static void
+mark_refs (Gc* gcobj, NPVariant* start, NPVariant* end)
+{
+    for (NPVariant* var = start; var < end; var++)
+        if (NPVARIANT_IS_OBJECT (*var))
+            mark_object (gcobj, NPVARIANT_TO_OBJECT (*var));
 }
 
-static bool
-Entry_enumerate (NPObject *npobj, NPIdentifier **value, uint32_t *count)
+/* In a minor collection, mark what the positions from START to END
+   refer to, if they are old.  The marking of old vectors stops at
+   mark(), but these may point into the nursery.  */
+static void
+mark_young_refs (Gc* gcobj, NPVariant* start, NPVariant* end)
 {
-    return enumerate_sub (Entry_getTop (npobj), npobj, value, count);
+    if (gcobj->minor && start < end && !find_heap (gcobj, start))
+        mark_refs (gcobj, start, end);
 }
 
-#if NPGMP_SCRIPT
+/* Mark a global variable.  twalk() passes no closure, hence
+   Current->gc.  */
+static void
+mark_root (const void *nodep, VISIT value, int level)
+{
+    if (value == postorder || value == leaf) {
+        Property* prop = *(Property* const*) nodep;
+        add_fixup (Current->gc, &prop->value, false);
+        mark (Current->gc, prop->value, prop->value + 1);
+    }
+}
 
-/*
- * Stack-based script support.
- */
+static void
+mark_stack (Gc* gcobj, const Stack* stack)
+{
+    if (stack) {
+        mark_tuple (gcobj, (Tuple*) &stack->tuple);
+        /* Stack operations move values without remember().  */
+        mark_young_refs (gcobj, Segment_start (stack), Segment_end (stack));
+        mark_stack (gcobj, Segment_prev (stack));
+    }
+}
 
-#include <search.h>
+/* Mark the heap storage of OBJECT, if any.  */
+static void
+mark_object (Gc* gcobj, NPObject* object)
+{
+    TopObject* top = gcobj->top;
 
-/* Optimize for optimizability only.  */
+    if (object->_class == &top->Tuple.npclass)
+        mark_tuple (gcobj, (Tuple*) object);
+    else if (object->_class == &top->Stack.npclass)
+        mark_stack (gcobj, (Stack*) object);
+    else if (object->_class == &top->Root.npclass)
+        mark_object (gcobj, ((Root*) object)->payload);
+}
 
-typedef struct _Heap {
-    struct _Heap* above;
-    struct _Heap* below;
-    size_t height;
-    size_t size;         /* size in NPVariant structures */
-    size_t largest; /* size of largest available block in and below this heap */
-    size_t avail;        /* total available in and below this heap */
-    NPVariant* end;      /* array end (start is end - size) */
-    NPVariant* pointer;  /* point of allocation */
-    unsigned char markbits[];
-} Heap;
+static int
+compare_holes (const void* a1, const void* a2)
+{
+    const Hole* h1 = (const Hole*) a1;
+    const Hole* h2 = (const Hole*) a2;
+    return (h1->size < h2->size ? -1 : h1->size > h2->size);
+}
 
-typedef struct _Gc {
-    Heap** heaps;  /* ordered by address */
-    size_t nheaps;
-} Gc;
+/* Return the index of the first big free run of at least SIZE.  */
+static size_t
+free_big_search (const Thread* thread, size_t size)
+{
+    size_t lo = 0, hi = thread->nfree_big;
 
-enum Opcode {
-#define OP(op) OP_ ## op = __LINE__,
-#include "gmp-ops.h"
-    OP_DATA
-};
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
 
-#define NUM_OPS OP_DATA
+        if (thread->free_big[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-static NPObject Ops[NUM_OPS];
+/* Put the SIZE positions at START on a free list of THREAD.  If SORTED
+   is false, the caller sorts the big runs afterward.  */
+static void
+free_push (Thread* thread, NPVariant* start, size_t size, bool sorted)
+{
+    size_t i;
 
-static enum Opcode
-op_to_opcode (const NPObject* npobj)
+    if (size == 0)
+        return;
+    if (size <= SMALL_VECTOR_MAX) {
+        VOID_TO_NPVARIANT (*start);
+        start->value.objectValue = (NPObject*) thread->free_small[size];
+        thread->free_small[size] = start;
+        thread->free_total += size;
+        return;
+    }
+
+    if (thread->nfree_big == thread->free_big_alloc) {
+        size_t alloc = (thread->free_big_alloc
+                        ? 2 * thread->free_big_alloc : 16);
+        Hole* grown = (Hole*) NPN_MemAlloc (alloc * sizeof grown[0]);
+
+        if (!grown)
+            return;  /* The space stays unused until the next sweep.  */
+        if (thread->free_big) {
+            memcpy (grown, thread->free_big,
+                    thread->nfree_big * sizeof grown[0]);
+            NPN_MemFree (thread->free_big);
+        }
+        thread->free_big = grown;
+        thread->free_big_alloc = alloc;
+    }
+    i = (sorted ? free_big_search (thread, size) : thread->nfree_big);
+    memmove (&thread->free_big[i + 1], &thread->free_big[i],
+             (thread->nfree_big - i) * sizeof thread->free_big[0]);
+    thread->free_big[i].start = start;
+    thread->free_big[i].size = size;
+    thread->nfree_big++;
+    thread->free_total += size;
+}
+
+/* Take THREAD's free run that best fits SIZE positions, or return
+   null.  */
+static NPVariant*
+free_take (Thread* thread, size_t size)
 {
-    int ret = npobj - &Ops[0];
-    if (ret >= 0 && ret < NUM_OPS)
+    NPVariant* ret;
+    Hole hole;
+    size_t i;
+
+    if (size <= SMALL_VECTOR_MAX && thread->free_small[size]) {
+        ret = thread->free_small[size];
+        thread->free_small[size] = (NPVariant*) ret->value.objectValue;
+        VOID_TO_NPVARIANT (*ret);
+        thread->free_total -= size;
         return ret;
-    return OP_DATA;
-}
+    }
 
-static NPClass Opcode_npclass;
+    i = free_big_search (thread, size);
+    if (i == thread->nfree_big)
+        return 0;
+    hole = thread->free_big[i];
+    thread->nfree_big--;
+    memmove (&thread->free_big[i], &thread->free_big[i + 1],
+             (thread->nfree_big - i) * sizeof thread->free_big[0]);
+    thread->free_total -= hole.size;
+    free_push (thread, hole.start + size, hole.size - size, true);
+    return hole.start;
+}
 
-static enum Opcode
-var_to_opcode (const NPVariant *value)
+/* Drop THREAD's free runs in the heaps of GCOBJ, or in all heaps if
+   GCOBJ is null.  */
+static void
+free_clear (Thread* thread, const Gc* gcobj)
 {
-    if (NPVARIANT_IS_OBJECT (*value)) {
-        NPObject* obj = NPVARIANT_TO_OBJECT (*value);
-        if (obj->_class == &Opcode_npclass)
-            return op_to_opcode (obj);
+    size_t n = 0;
+
+    for (size_t size = 1; size <= SMALL_VECTOR_MAX; size++) {
+        NPVariant** link = &thread->free_small[size];
+
+        while (*link) {
+            NPVariant* run = *link;
+
+            if (!gcobj || find_heap (gcobj, run)) {
+                *link = (NPVariant*) run->value.objectValue;
+                thread->free_total -= size;
+            }
+            else
+                link = (NPVariant**) &run->value.objectValue;
+        }
     }
-    return OP_DATA;
+    for (size_t i = 0; i < thread->nfree_big; i++) {
+        if (!gcobj || find_heap (gcobj, thread->free_big[i].start))
+            thread->free_total -= thread->free_big[i].size;
+        else
+            thread->free_big[n++] = thread->free_big[i];
+    }
+    thread->nfree_big = n;
 }
 
-static const char OpNames[] = "|"
-#define OP(op) # op "," STRINGIFY (__LINE__) "|"
-#include "gmp-ops.h"
-    ;
+/* Put the space above HEAP's allocation point on THREAD's free
+   lists.  */
+static void
+heap_retire (Thread* thread, Heap* heap)
+{
+    free_push (thread, heap->pointer, heap->end - heap->pointer, true);
+    heap->pointer = heap->end;
+}
 
-static int
-id_to_opnum (NPObject *npobj, NPIdentifier key)
+/* Release the values in unmarked positions and give the positions back
+   to vector_alloc, on the free lists or by lowering the allocation
+   pointer.  */
+static void
+sweep (Gc* gcobj)
 {
-    char buf[16];
-    NPUTF8* name;
-    size_t len;
-    const char* p = 0;
-    int ret;
+    Thread* thread = gcobj->top->thread;
 
-    if (!NPN_IdentifierIsString (key))
-        return -1;
+    free_clear (thread, gcobj);  /* to be found again */
 
-    name = NPN_UTF8FromIdentifier (key);
-    if (!name) {
-        raise_oom (npobj);
-        return -2;
-    }
+    for (size_t h = 0; h < gcobj->nheaps; h++) {
+        Heap* heap = gcobj->heaps[h];
+        NPVariant* var = heap->end - heap->size;
+        NPVariant* live_end = var;
 
-    len = strlen (name);
-    if (len + 3 <= sizeof buf) {
-        buf[0] = '|';
-        strncpy (&buf[1], name, len);
-        buf[len+1] = ',';
-        buf[len+2] = '\0';
-        p = strstr (OpNames, buf);
+        while (var < heap->pointer) {
+            NPVariant* run = var;
+
+            if (marked_p (heap, var)) {
+                live_end = ++var;
+                continue;
+            }
+            for (; var < heap->pointer && !marked_p (heap, var); var++) {
+                NPN_ReleaseVariantValue (var);
+                VOID_TO_NPVARIANT (*var);
+            }
+            if (var < heap->pointer || heap != thread->bump)
+                free_push (thread, run, var - run, false);
+        }
+        if (heap == thread->bump)
+            heap->pointer = live_end;
     }
+    if (thread->nfree_big > 1)
+        qsort (thread->free_big, thread->nfree_big,
+               sizeof thread->free_big[0], compare_holes);
+}
 
-    if (p)
-        ret = atoi (strchr (p, ',') + 1);
-    else
-        ret = -1;
+#if NPGMP_COMPACT
 
-    NPN_MemFree (name);
-    return ret;
+static int
+compare_extents (const void* a1, const void* a2)
+{
+    const Extent* e1 = (const Extent*) a1;
+    const Extent* e2 = (const Extent*) a2;
+    return (e1->start < e2->start ? -1 : e1->start > e2->start);
 }
 
-static const char*
-opcode_to_string (enum Opcode opcode, size_t* len)
+/* Return where OLD, a pointer into a live extent, points after
+   compaction.  */
+static NPVariant*
+relocate (const Gc* gcobj, NPVariant* old, bool after)
 {
-    char buf[16];
-    const char* p;
-    size_t l;
+    size_t lo = 0, hi = gcobj->nextents;
 
-    if (opcode < 0 || opcode >= NUM_OPS)
-        return 0;
-    sprintf (buf, ",%d|", (int) opcode);
-    p = strstr (OpNames, buf);
-    if (!p)
-        return 0;  /* should not happen */
-    for (l = 0; p[-1] != '|'; p--, l++)
-        continue;
-    *len = l;
-    return p;
+    /* Find the last extent starting before OLD, or at OLD unless
+       AFTER.  */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        NPVariant* start = gcobj->extents[mid].start;
+
+        if (start < old || (!after && start == old))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0) {
+        const Extent* e = &gcobj->extents[lo - 1];
+        if (old < e->end || (after && old == e->end))
+            return e->to + (old - e->start);
+    }
+    return old;
 }
 
-/* Give ops a toString method.  */
-static bool
-Opcode_invoke (NPObject *npobj, NPIdentifier name,
-               const NPVariant *args, uint32_t argCount, NPVariant *result)
+/* Sort the extents and merge overlapping ones, which arise when a
+   global variable points into a vector.  */
+static void
+merge_extents (Gc* gcobj)
 {
-    const char* s;
-    char* ret;
-    size_t len;
+    size_t n = 0;
 
-    if (name != ID_toString)
-        return false;
-    s = opcode_to_string (op_to_opcode (npobj), &len);
-    if (!s)
-        return false;  /* should not happen */
-    ret = (char*) NPN_MemAlloc (len);
-    memcpy (ret, s, len);
-    STRINGN_TO_NPVARIANT (ret, len, *result);
-    return true;
+    if (gcobj->nextents == 0)
+        return;
+    qsort (gcobj->extents, gcobj->nextents, sizeof gcobj->extents[0],
+           compare_extents);
+    for (size_t i = 1; i < gcobj->nextents; i++) {
+        Extent* e = &gcobj->extents[n];
+        if (gcobj->extents[i].start < e->end) {
+            if (e->end < gcobj->extents[i].end)
+                e->end = gcobj->extents[i].end;
+        }
+        else
+            gcobj->extents[++n] = gcobj->extents[i];
+    }
+    gcobj->nextents = n + 1;
 }
 
-static NPClass Opcode_npclass = {
-    structVersion   : NP_CLASS_STRUCT_VERSION,
-    deallocate      : obj_noop,
-    invalidate      : obj_invalidate,
-    hasMethod       : hasMethod_only_toString,
-    invoke          : Opcode_invoke,
-    hasProperty     : obj_id_false,
-    getProperty     : obj_id_var_void,
-    setProperty     : setProperty_ro,
-    removeProperty  : removeProperty_ro,
-    enumerate       : enumerate_empty
-};
+/* Slide the live extents toward the lowest heap, update the pointers
+   recorded by marking, and free the heaps left empty.  */
+static void
+compact (Gc* gcobj)
+{
+    Heap** heaps = gcobj->heaps;
+    NPVariant* old_pointer[gcobj->nheaps];
+    size_t d = 0, kept = 0;
+    NPVariant* cursor;
 
-/* XXX Should frames be reference-counted or garbage-collected?  */
-typedef struct _Frame {
-    struct _Frame* next;
-    Tuple* code;
-    NPVariant* pc;
-    /*void* locals;*/
-} Frame;
+    if (gcobj->nextents == 0)
+        return;
+    merge_extents (gcobj);
+
+    /* Assign new addresses in order, so that no extent moves up.  */
+    for (size_t h = 0; h < gcobj->nheaps; h++)
+        old_pointer[h] = heaps[h]->pointer;
+    cursor = heaps[0]->end - heaps[0]->size;
+    for (size_t i = 0; i < gcobj->nextents; i++) {
+        Extent* e = &gcobj->extents[i];
+        while (cursor + (e->end - e->start) > heaps[d]->end) {
+            heaps[d++]->pointer = cursor;
+            cursor = heaps[d]->end - heaps[d]->size;
+        }
+        e->to = cursor;
+        cursor += e->end - e->start;
+    }
+    heaps[d]->pointer = cursor;
+    while (++d < gcobj->nheaps)
+        heaps[d]->pointer = heaps[d]->end - heaps[d]->size;
 
-typedef struct _Stack {
-    Tuple tuple;
-    size_t length;  /* includes substacks.
-                       XXX probably should include *only* substacks
-                       and be called something like segment_height. */
-    ulong segment;  /* number of segments below this one */
-    struct _Stack** table;
-} Stack;
+    for (size_t i = 0; i < gcobj->nfixups; i++) {
+        Fixup* f = &gcobj->fixups[i];
+        *f->ptr = relocate (gcobj, f->old, f->after);
+    }
 
-/* XXX Consider moving to C++.  */
+    for (size_t i = 0; i < gcobj->nextents; i++) {
+        Extent* e = &gcobj->extents[i];
+        if (e->to != e->start)
+            memmove (e->to, e->start, (e->end - e->start) * sizeof e->to[0]);
+    }
 
-#define SEGMENT_THRESHOLD 32
+    /* Clear what moved away, and free empty heaps.  */
+    Current->heap = 0;
+    for (size_t h = 0; h < gcobj->nheaps; h++) {
+        Heap* heap = heaps[h];
+        NPVariant* base = heap->end - heap->size;
+
+        if (heap->pointer < old_pointer[h])
+            memset (heap->pointer, '\0',
+                    (old_pointer[h] - heap->pointer) * sizeof base[0]);
+        if (heap->pointer == base) {
+            NPN_MemFree (base);
+            NPN_MemFree (heap);
+            continue;
+        }
+        heap->below = Current->heap;
+        heap->above = 0;
+        heap->height = kept;
+        if (heap->below)
+            heap->below->above = heap;
+        heaps[kept++] = heap;
+        Current->heap = heap;
+    }
+    gcobj->nheaps = kept;
 
-static inline size_t
-Stack_length (const Stack* stack)
-{
-    return stack->length;
+    /* Only the highest heap keeps an allocation point.  */
+    free_clear (Current, 0);
+    Current->bump = Current->heap;
+    for (size_t h = 0; h + 1 < kept; h++)
+        heap_retire (Current, heaps[h]);
 }
 
-static inline void
-Stack_set_length (Stack* stack, size_t length)
+/* Compact when the heaps are less than half full of live data, and
+   there is more than one heap to empty.  */
+static bool
+compact_p (const Gc* gcobj)
 {
-    stack->length = length;
+    size_t live = 0, size = 0;
+
+    if (!gcobj->compacting || gcobj->nheaps < 2)
+        return false;
+    for (size_t i = 0; i < gcobj->nextents; i++)
+        live += gcobj->extents[i].end - gcobj->extents[i].start;
+    for (size_t h = 0; h < gcobj->nheaps; h++)
+        size += gcobj->heaps[h]->size;
+    return live * 2 < size;
 }
 
-static inline NPVariant*
-Segment_start (const Stack* stack) { return stack->tuple.start; }
-static inline NPVariant*
-Segment_end (const Stack* stack) { return stack->tuple.end; }
+#endif  /* NPGMP_COMPACT */
 
-static inline void
-Segment_set_start (Stack* stack, NPVariant* start)
+static void
+gc (void)
 {
-    stack->tuple.start = start;
-}
+    Heap* heap;
+    size_t nheaps = Current->heap->height + 1;
+    Heap* heaps[nheaps];
+    Gc gcobj = { heaps: heaps, nheaps: nheaps,
+                 top: Thread_getTop ((NPObject*) Current) };
 
-static inline void
-Segment_set_end (Stack* stack, NPVariant* end)
-{
-    stack->tuple.end = end;
-}
+    for (heap = Current->heap; heap; heap = heap->below) {
+        memset (heap->markbits, '\0', ((heap->size + 7) / 8));
+        heaps[heap->height] = heap;
+    }
 
-static inline bool
-Segment_shared_p (const Stack* seg)
-{
-    return seg->tuple.npobj.referenceCount > 1;
-}
+#if NPGMP_COMPACT
+    /* Record extents and fixups from the first root on.  */
+    gcobj.compacting = (nheaps > 1);
+#endif
 
-static inline size_t
-Segment_length (const Stack* stack)
-{
-    return Segment_end (stack) - Segment_start (stack);
-}
+    for (Root* root = Current->roots; root; root = root->next)
+        mark_object (&gcobj, root->payload);
 
-static inline bool
-Segment_contains (const Stack* stack, size_t index)
-{
-    /* Careful!  This relies on unsigned modular arithmetic.  */
-    return (size_t) (stack->length - 1 - index) < Segment_length (stack);
-}
+    Current->gc = &gcobj;  /* twalk() deficiency */
 
-static inline size_t
-Segment_height (const Stack* stack)
-{
-    return stack->length - Segment_length (stack);
-}
+    for (Frame* frame = &Current->frame; frame; frame = frame->next)
+        if (frame->code) {
+            mark_object (&gcobj, &frame->code->npobj);
+            if (frame->body)
+                mark_object (&gcobj, &frame->body->npobj);
+            if (frame->cond)
+                mark_object (&gcobj, &frame->cond->npobj);
+        }
 
-static inline void
-Segment_set_height (Stack* stack, size_t height)
-{
-    stack->length = height + Segment_length (stack);
-}
+    /* XXX should avoid marking the *contents* of positions between
+       thread->sp and the current segment's end. */
+    add_fixup (&gcobj, &Current->sp,
+               Current->sp > Segment_start (&Current->stack));
+    mark_stack (&gcobj, &Current->stack);
 
-static inline Stack**
-Segment_table (Stack* stack)
-{
-    return stack->table;
+    twalk (Current->tls, mark_root);
+
+    sweep (&gcobj);
+#if NPGMP_COMPACT
+    /* The fixups must see their values as they were when marked.  */
+    if (compact_p (&gcobj))
+        compact (&gcobj);
+    if (gcobj.extents)
+        NPN_MemFree (gcobj.extents);
+    if (gcobj.fixups)
+        NPN_MemFree (gcobj.fixups);
+#endif
+#if NPGMP_NURSERY
+    /* Remembered positions may have moved or died.  */
+    if (Current->nremembered) {
+        Current->nremembered = 0;
+        Current->remembered_lost = true;
+    }
+#endif
+    Current->gc = 0;
+    Current->alloc_since_gc = 0;
+    Current->gc_wanted = false;
+    Current->compact_wanted = false;
 }
 
-static inline void
-Segment_set_table (Stack* stack, Stack** table)
+/* Mark the roots of an incremental collection.  At the end, the stack
+   contents are marked again, because stack operations move values
+   without the write barrier in remember().  */
+static void
+mark_roots (Gc* gcobj, bool again)
 {
-    stack->table = table;
-}
+    for (Root* root = Current->roots; root; root = root->next)
+        mark_object (gcobj, root->payload);
+
+    for (Frame* frame = &Current->frame; frame; frame = frame->next)
+        if (frame->code) {
+            mark_object (gcobj, &frame->code->npobj);
+            if (frame->body)
+                mark_object (gcobj, &frame->body->npobj);
+            if (frame->cond)
+                mark_object (gcobj, &frame->cond->npobj);
+        }
 
-static Stack**
-Segment_copy_table (Stack* stack)
-{
-    Stack** table;
-    size_t n = popcount (stack->segment);
+    mark_stack (gcobj, &Current->stack);
+    if (again)
+        for (Stack* stack = &Current->stack; stack;
+             stack = Segment_prev (stack))
+            mark_refs (gcobj, Segment_start (stack), Segment_end (stack));
 
-    table = NPN_MemAlloc (n * sizeof table[0]);
-    if (table)
-        memcpy (table, Segment_get_table (stack), n * sizeof table[0]);
-    return table;
+    Current->gc = gcobj;  /* twalk() deficiency */
+    twalk (Current->tls, mark_root);
+    Current->gc = 0;
 }
 
-#if __GNUC__
-#define popcount(x) __builtin_popcount (x)
-#else
-
-static int
-popcount (unsigned int x)
+static void
+gc_free (Gc* gcobj)
 {
-    int ret;
-    for (ret = 0; x; x >>= 1)
-        ret += (x & 1);
-    return ret;
+    if (gcobj->gray)
+        NPN_MemFree (gcobj->gray);
+    NPN_MemFree (gcobj->heaps);
+    NPN_MemFree (gcobj);
 }
 
-#endif  /* __GNUC__ */
+/* Begin an incremental collection of the heaps that exist now.
+   Vectors allocated meanwhile start unmarked and survive if the roots
+   reach them at the end.  Return false if out of memory.  */
+static bool
+gc_start (void)
+{
+    size_t nheaps = Current->heap->height + 1;
+    Gc* gcobj = (Gc*) NPN_MemAlloc (sizeof *gcobj);
+    Heap** heaps = (Heap**) NPN_MemAlloc (nheaps * sizeof heaps[0]);
+
+    if (!gcobj || !heaps) {
+        if (gcobj)
+            NPN_MemFree (gcobj);
+        if (heaps)
+            NPN_MemFree (heaps);
+        return false;
+    }
+    memset (gcobj, '\0', sizeof *gcobj);
+    gcobj->heaps = heaps;
+    gcobj->nheaps = nheaps;
+    gcobj->top = Thread_getTop ((NPObject*) Current);
+    gcobj->incremental = true;
 
-/* The following four functions share knowledge of stack->table.  The
-   table supports lookup by index or segment number in a segmented
-   array in O(log(N)) time and O(N*log(N)) space, where N is the
-   number of segments.
+    for (Heap* heap = Current->heap; heap; heap = heap->below) {
+        memset (heap->markbits, '\0', ((heap->size + 7) / 8));
+        heaps[heap->height] = heap;
+    }
+    mark_roots (gcobj, false);
 
-   XXX The order of pointers in the table should probably be reversed,
-   shifting the popcount() burden from sequential to random access.
-   Alternatively, one could add the table length to the Stack
-   structure.  */
+    Current->major = gcobj;
+    Current->alloc_since_gc = 0;
+    Current->gc_wanted = false;
+    return true;
+}
 
-/* Place this segment atop an arbitrary stack.  Return false if memory
-   allocation fails.  Assumes STACK->table is *not* live on entry.  */
+/* Mark gray vectors until BUDGET positions have been marked or none
+   remain, and return true if none remain.  */
 static bool
-Segment_set_prev (Stack* stack, const Stack* prev)
+gc_drain (Gc* gcobj, size_t budget)
 {
-    assert (!stack->table);
+    size_t work = 0;
 
-    if (prev) {
-        size_t n;
-        Stack** table;
-        unsigned int mask;
+    while (gcobj->ngray) {
+        Gray gray;
 
-        stack->segment = prev->segment + 1;
-        n = popcount (stack->segment);
-        table = (Stack**) NPN_MemAlloc (n * sizeof table[0]);
-        if (!table)
+        if (budget && work >= budget)
             return false;
-
-        Segment_set_table (stack, table);
-        NPN_RetainObject ((NPObject*) prev);
-        mask = stack->segment;
-        for (unsigned int bit = 1; bit < stack->segment; bit <<= 1) {
-            if (stack->segment & bit)
-                table[--n] = Stack_segment (prev, mask &~ bit);
-            mask |= bit;
-        }
-        assert (n == 0);
-        Stack_set_length (stack, Segment_length (stack) + Stack_length (prev));
-    }
-    else {
-        stack->segment = 0;
-        Segment_set_table (stack, 0);
-        Stack_set_length (stack, Segment_length (stack));
+        gray = gcobj->gray[--gcobj->ngray];
+        mark (gcobj, gray.start, gray.end);
+        work += gray.end - gray.start + 1;
     }
     return true;
 }
 
-/* Return the segment containing INDEX.  */
-static Stack*
-Stack_segment_containing (const Stack* stack, size_t index)
+/* Finish an incremental collection: mark the roots again, and sweep.
+   Compaction waits for a collection that is not incremental.  */
+static void
+gc_finish (void)
 {
-    assert (index < Stack_get_length (stack));
-    while (!Segment_contains (stack, index)) {
-        Stack** table = Segment_table (stack);
-        size_t i;
-        for (i = 0; index >= Stack_get_length (table[i]); i++)
-            continue;
-        stack = table[i];
+    Gc* gcobj = Current->major;
+    size_t live = 0, size = 0;
+
+    Current->major = 0;
+    mark_roots (gcobj, true);
+    (void) gc_drain (gcobj, 0);
+
+    if (gcobj->gray_lost) {
+        /* Some vector may be unmarked.  Start over, all at once.  */
+        gc_free (gcobj);
+        gc ();
+        return;
     }
-    return stack;
-}
 
-/* Return segment number SEGMENT.  */
-static Stack*
-Stack_get_segment (const Stack* stack, unsigned int segment)
-{
-    assert (segment <= stack->segment);
-    while (segment != stack->segment) {
-        Stack** table = Segment_table (stack);
-        size_t i;
-        for (i = 0; segment >= table[i]->segment; i++)
-            continue;
-        stack = table[i];
+    sweep (gcobj);
+
+    for (Heap* heap = Current->heap; heap; heap = heap->below) {
+        size += heap->size;
+        live += heap->pointer - (heap->end - heap->size);
     }
-    return stack;
+    live -= Current->free_total;
+    Current->compact_wanted = (Current->heap->height > 0 && live * 2 < size);
+    gc_free (gcobj);
 }
 
-/* Return a pointer to the table element holding a pointer to the
-   previous segment.  The stack is valid so long as the previous
-   segment's number is one less than STACK->segment, every segment's
-   length field is correct, and there are no empty segments.  */
-static inline Stack**
-Segment_prev_ref (const Stack* stack)
+/* Do the next part of an incremental collection.  */
+static void
+gc_step (void)
 {
-    return Segment_table (stack) + (popcount (stack->segment) - 1);
+    Gc* gcobj = Current->major;
+    size_t budget = Current->gc_budget;
+
+    if (gc_drain (gcobj, budget))
+        gc_finish ();
 }
 
-/* End of functions intimate with stack->table.  */
+/* Return the time in microseconds since some fixed point.  Unlike
+   clock(), which adds up the processor time of all the process's
+   threads, this measures the time that the page waits.  */
+static double
+monotonic_us (void)
+{
+    struct timespec now;
 
-#if EXAMPLE_FOR_DOCUMENTATION
-static bool
-Stack_valid_p (const Stack* stack)
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1000000 + (double) now.tv_nsec / 1000;
+}
+
+/* Count a pause of US microseconds in gcPauses.  */
+static void
+record_pause (double us)
 {
-    size_t segment_length = Segment_length (stack);
-    const Stack* prev = *(Stack_wprev_ref (stack));
-    size_t prev_length = (prev ? prev->length : 0);
-    size_t prev_number = (prev ? prev->segment : 0);
+    size_t i = 0;
 
-    /* This assumes all STACK->table elements point to segments of STACK.  */
-    return segment_length > 0 &&
-        stack->length == prev_length + segment_length &&
-        stack->segment == prev_segment + 1 &&
-        (prev == 0 || Stack_valid_p (prev));
+    while (i < GC_PAUSE_BUCKETS - 1 && (double) (1UL << i) <= us)
+        i++;
+    Current->gc_pauses[i]++;
 }
-#endif  /* EXAMPLE_FOR_DOCUMENTATION */
 
+/* Allocate SIZE positions in the heap list: from the free run that
+   fits best, else at the allocation point, else in a new heap.  */
 static NPVariant*
-Stack_ref (const Stack* stack, size_t index)
+heap_alloc (uint32_t size)
 {
-    size_t offset;
-    stack = Stack_segment_containing (stack, index);
-    return Segment_start (stack) + (index - Segment_height (stack));
+    Heap* heap = Current->bump;
+    Heap** abovep;
+    NPVariant* ret;
+    size_t alloc, min, max;
+
+    ret = (size ? free_take (Current, size) : 0);
+    if (!ret && heap && heap->end - heap->pointer >= size) {
+        ret = heap->pointer;
+        heap->pointer += size;
+    }
+    if (ret) {
+        Current->alloc_since_gc += size;
+        return ret;
+    }
+
+    /* Collecting here could free vectors that native code has just
+       allocated, so ask for a collection at the next safe point and
+       grow the heap meanwhile.  */
+    if (Current->heap &&
+        Current->alloc_since_gc * 2 > Current->last_heap_size)
+        Current->gc_wanted = true;
+
+    min = 1024;
+    max = 1024*1024;
+    alloc = min;
+    if (alloc < Current->last_heap_size * 4)
+        alloc = Current->last_heap_size * 4;
+    if (alloc > max)
+        alloc = max;
+    if (alloc < size)  /* XXX should this affect thread->last_heap_size? */
+        alloc = size;
+
+    heap = (Heap*) NPN_MemAlloc (sizeof *heap + ((alloc + 7) / 8));
+    if (!heap)
+        return 0;
+
+    ret = (NPVariant*) NPN_MemAlloc (alloc * sizeof ret[0]);
+
+    if (!ret) {
+        NPN_MemFree (heap);
+        return 0;
+    }
+    memset (ret, '\0', alloc * sizeof ret[0]);
+
+    Current->last_heap_size = alloc;
+
+    heap->size    = alloc;
+    heap->end     = ret + alloc;
+    heap->pointer = ret + size;
+    heap->above   = 0;
+
+    if (Current->bump)
+        heap_retire (Current, Current->bump);
+    Current->bump = heap;
+
+    /* Move heap to its place in the list ordered by address.  */
+    abovep = &Current->heap;
+    while (*abovep && (*abovep)->end > heap->end) {
+        heap->above = *abovep;
+        (*abovep)->height++;
+        abovep = &(*abovep)->below;
+    }
+    heap->below = *abovep;
+    *abovep = heap;
+
+    if (heap->below) {
+        heap->below->above = heap;
+        heap->height = heap->below->height + 1;
+    }
+    else
+        heap->height = 0;
+
+    Current->alloc_since_gc += size;
+
+    return ret;
 }
 
-static Stack*
-Segment_prev (const Stack* stack)
+#if NPGMP_NURSERY
+
+static inline bool
+in_nursery (const Heap* nursery, const NPVariant* var)
 {
-    return (stack->segment ? *Segment_prev_ref (stack) : 0);
+    return var >= nursery->end - nursery->size && var < nursery->end;
 }
 
-static inline void
-Segment_init (Stack* stack, NPVariant* start, NPVariant* end,
-              size_t height, unsigned int segment, Stack** table)
+static Heap*
+nursery_create (void)
 {
-    Segment_set_start  (stack, start);
-    Segment_set_end    (stack, end);
-    Segment_set_height (stack, height);
-    stack->segment = segment;
-    Segment_set_table  (stack, table);
-}
+    Heap* heap = (Heap*) NPN_MemAlloc (sizeof *heap + NURSERY_SIZE / 8);
+    NPVariant* start;
 
-static const Stack*
-Stack_create (TopObject* top, NPVariant* start, NPVariant* end,
-              size_t height, unsigned int segment, Stack** table)
+    if (!heap)
+        return 0;
+    start = (NPVariant*) NPN_MemAlloc (NURSERY_SIZE * sizeof start[0]);
+    if (!start) {
+        NPN_MemFree (heap);
+        return 0;
+    }
+    memset (start, '\0', NURSERY_SIZE * sizeof start[0]);
+    memset (heap, '\0', sizeof *heap);
+    heap->size    = NURSERY_SIZE;
+    heap->end     = start + NURSERY_SIZE;
+    heap->pointer = start;
+    return heap;
+}
+
+/* Move the live vectors out of the nursery and empty it.  The roots
+   are those of gc() plus the remembered positions, and marking does
+   not enter old vectors, unless the remembered set is incomplete, in
+   which case the old heaps are marked too.  */
+static void
+minor_gc (void)
 {
-    Stack* stack;
+    Heap* nursery = Current->nursery;
+    NPVariant* base = nursery->end - nursery->size;
+    bool all = Current->remembered_lost && Current->heap;
+    size_t nheaps = 1 + (all ? Current->heap->height + 1 : 0);
+    Heap* heaps[nheaps];
+    Gc gcobj = { heaps: heaps, nheaps: nheaps,
+                 top: Thread_getTop ((NPObject*) Current),
+                 minor: !all, compacting: true };
+    bool ok;
+    size_t h = nheaps;
 
-    stack = (Stack*) NPN_CreateObject (top->instance, &top->Stack.npclass);
+    if (all && Current->major) {
+        /* Marking the old heaps would spoil the incremental collection,
+           so let the nursery wait for its end.  */
+        Current->minor_wanted = false;
+        return;
+    }
 
-    if (stack)
-        Segment_init (stack, start, end, height, segment, table);
-    return stack;
-}
+    /* Order the heaps by address, for find_heap().  */
+    if (all)
+        for (Heap* heap = Current->heap; heap; heap = heap->below) {
+            if (nursery && heap->end < nursery->end) {
+                heaps[--h] = nursery;
+                nursery = 0;
+            }
+            heaps[--h] = heap;
+        }
+    if (nursery)
+        heaps[--h] = nursery;
+    nursery = Current->nursery;
+    for (h = 0; h < nheaps; h++)
+        memset (heaps[h]->markbits, '\0', ((heaps[h]->size + 7) / 8));
 
-/* Return a pass-thru copy of the part of STACK from 0 to INDEX, or
-   null if allocation fails.  Requires INDEX > 0.  */
+    for (Root* root = Current->roots; root; root = root->next)
+        mark_object (&gcobj, root->payload);
 
-static Stack*
-Stack_substack (TopObject* top, const Stack* stack, size_t index)
-{
-    Stack* copy;
-    Stack** table;
-    assert (index <= Stack_length (stack));
-    assert (index > 0);
+    Current->gc = &gcobj;  /* twalk() deficiency */
 
-    copy = Stack_segment_containing (stack, index - 1);
+    for (Frame* frame = &Current->frame; frame; frame = frame->next)
+        if (frame->code) {
+            mark_object (&gcobj, &frame->code->npobj);
+            if (frame->body)
+                mark_object (&gcobj, &frame->body->npobj);
+            if (frame->cond)
+                mark_object (&gcobj, &frame->cond->npobj);
+        }
 
-    if (index == Stack_length (copy)) {
-        NPN_RetainObject ((NPObject*) copy);
-        return copy;
+    add_fixup (&gcobj, &Current->sp,
+               Current->sp > Segment_start (&Current->stack));
+    mark_stack (&gcobj, &Current->stack);
+
+    twalk (Current->tls, mark_root);
+
+    for (size_t i = 0; i < Current->nremembered; i++)
+        mark_young_refs (&gcobj, Current->remembered[i],
+                         Current->remembered[i] + 1);
+
+    /* Give each surviving young extent a place among the old.  */
+    ok = gcobj.compacting;
+    if (ok) {
+        merge_extents (&gcobj);
+        for (size_t i = 0; i < gcobj.nextents; i++) {
+            Extent* e = &gcobj.extents[i];
+
+            if (!in_nursery (nursery, e->start))
+                e->to = e->start;
+            else if (!(e->to = heap_alloc (e->end - e->start))) {
+                /* The space taken so far waits for the next gc().  */
+                ok = false;
+                break;
+            }
+        }
     }
-    assert (Segment_length (copy) > 1);
 
-    table = Segment_copy_table (copy);
-    if (!table)
-        return 0;
+    if (ok) {
+        for (NPVariant* var = base; var < nursery->pointer; var++)
+            if (!marked_p (nursery, var))
+                NPN_ReleaseVariantValue (var);
+        for (size_t i = 0; i < gcobj.nfixups; i++) {
+            Fixup* f = &gcobj.fixups[i];
+            *f->ptr = relocate (&gcobj, f->old, f->after);
+        }
+        for (size_t i = 0; i < gcobj.nextents; i++) {
+            Extent* e = &gcobj.extents[i];
+            if (e->to != e->start) {
+                memcpy (e->to, e->start,
+                        (e->end - e->start) * sizeof e->to[0]);
+                /* A marked vector may refer to it, unseen.  */
+                if (Current->major)
+                    gray_push (Current->major, e->to,
+                               e->to + (e->end - e->start));
+            }
+        }
+        memset (base, '\0', (nursery->pointer - base) * sizeof base[0]);
+        nursery->pointer = base;
+        Current->nremembered = 0;
+        Current->remembered_lost = false;
+    }
+    /* Otherwise, vector_alloc uses the heap list until memory frees.  */
 
-    copy = Stack_create (top, Segment_start (copy),
-                         Segment_start (copy) + (index - Segment_height (copy)),
-                         Segment_height (copy), copy->segment, table);
-    if (!copy)
-        NPN_MemFree (table);
-    return copy;
+    if (gcobj.extents)
+        NPN_MemFree (gcobj.extents);
+    if (gcobj.fixups)
+        NPN_MemFree (gcobj.fixups);
+    Current->gc = 0;
+    Current->minor_wanted = false;
 }
 
+#endif  /* NPGMP_NURSERY */
+
+/* Note that DEST, a heap position, has just been given an object.  For
+   an incremental collection, shade the object, since DEST may already
+   be marked.  Remember DEST if it may now point from an old vector
+   into the nursery.  */
 static void
-Segment_clear (Stack* stack)
+remember (TopObject* top, NPVariant* dest)
 {
-    Stack* prev = Segment_prev (stack);
-    if (prev) {
-        NPN_ReleaseObject ((NPObject*) prev);
-        NPN_MemFree (stack->table);
-#ifndef NDEBUG
-        stack->table = 0;
-#endif
+    Thread* thread = top->thread;
+    NPObject* obj = NPVARIANT_TO_OBJECT (*dest);
+
+    if (!thread || (obj->_class != &top->Tuple.npclass
+                    && obj->_class != &top->Stack.npclass))
+        return;
+
+    if (thread->major)
+        mark_object (thread->major, obj);
+
+#if NPGMP_NURSERY
+    if (!thread->nursery || thread->remembered_lost
+        || in_nursery (thread->nursery, dest))
+        return;
+
+    if (thread->nremembered == thread->remembered_alloc) {
+        size_t alloc = (thread->remembered_alloc
+                        ? 2 * thread->remembered_alloc : 64);
+        NPVariant** grown = (NPVariant**)
+            NPN_MemAlloc (alloc * sizeof grown[0]);
+
+        if (!grown) {
+            thread->remembered_lost = true;
+            thread->minor_wanted = true;
+            return;
+        }
+        if (thread->remembered) {
+            memcpy (grown, thread->remembered,
+                    thread->nremembered * sizeof grown[0]);
+            NPN_MemFree (thread->remembered);
+        }
+        thread->remembered = grown;
+        thread->remembered_alloc = alloc;
     }
+    thread->remembered[thread->nremembered++] = dest;
+
+    /* Keep the set small even if the nursery fills slowly.  */
+    if (thread->nremembered >= NURSERY_SIZE)
+        thread->minor_wanted = true;
+#endif
 }
 
-static NPObject*
-Stack_allocate (NPP npp, NPClass *aClass)
+static NPVariant*
+vector_alloc (uint32_t size)
 {
-    Stack* ret = (Stack*) NPN_MemAlloc (sizeof (Stack));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Stack allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret) {
-        memset (ret, '\0', sizeof *ret);
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Stack, aClass));
+#if NPGMP_NURSERY
+    Heap* nursery = Current->nursery;
+
+    if (size <= NURSERY_MAX_VECTOR) {
+        if (!nursery)
+            nursery = Current->nursery = nursery_create ();
+        if (nursery) {
+            if (nursery->end - nursery->pointer >= size) {
+                NPVariant* ret = nursery->pointer;
+                nursery->pointer += size;
+                return ret;
+            }
+            Current->minor_wanted = true;
+        }
     }
-    return (NPObject*) ret;
+#endif
+    return heap_alloc (size);
 }
 
+/* Collect garbage if vector_alloc asked for it.  Call only where every
+   live heap vector is reachable from the roots, frames, stack or
+   globals, never while native code holds a new tuple in a local.  */
 static void
-Stack_deallocate (NPObject *npobj)
+gc_safe_point (TopObject* top)
 {
-    Stack* stack = (Stack*) npobj;
-#if DEBUG_ALLOC
-    fprintf (stderr, "Stack deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
-    if (stack->table)
-        Segment_clear (stack);
-    NPN_ReleaseObject ((NPObject*) Stack_getTop (npobj));
-    NPN_MemFree (npobj);
-}
+    Thread* thread = top->thread;
+    Thread* previous;
+    bool full, atomic;
+    double start;
 
-static bool
-Stack_hasProperty (NPObject *npobj, NPIdentifier key)
-{
-    return Tuple_hasProperty (npobj, key) ||
-        key == NPN_GetStringIdentifier ("segment") ||
-        key == NPN_GetStringIdentifier ("previousSegment");
+    if (!thread)
+        return;
+    full = (!thread->major && thread->heap && thread->gc_wanted);
+    if (LIKELY (!full && !thread->major
+#if NPGMP_NURSERY
+                && !thread->minor_wanted
+#endif
+                ))
+        return;
+
+    previous = thread_enter (thread);
+    start = monotonic_us ();
+    atomic = (full && (!thread->gc_budget || thread->compact_wanted));
+#if NPGMP_NURSERY
+    /* Empty the nursery before a collection that is not incremental.  */
+    if ((thread->minor_wanted || atomic) && thread->nursery
+        && thread->nursery->pointer > thread->nursery->end - NURSERY_SIZE)
+        minor_gc ();
+    thread->minor_wanted = false;
+#endif
+    if (thread->major)
+        gc_step ();
+    else if (atomic || (full && !gc_start ()))
+        gc ();
+    record_pause (monotonic_us () - start);
+    thread_leave (previous);
 }
 
-static bool
-stack_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
+static NPVariant*
+tuple_alloc (TopObject* top, uint32_t size)
 {
-    const Stack* stack = (Stack*) npobj;
+    Thread* previous = thread_enter (top->thread);
+    NPVariant* ret = vector_alloc (size);
 
-    if (tuple_getProperty (npobj, key, result))
-        return true;
-    if (key == NPN_GetStringIdentifier ("segment"))
-        DOUBLE_TO_NPVARIANT ((double) stack->segment, *result);
-    else if (key == NPN_GetStringIdentifier ("previousSegment")) {
-        stack = Segment_prev (stack);
-        if (stack)
-            OBJECT_TO_NPVARIANT (NPN_RetainObject ((NPObject*) stack), *result);
-        else
-            VOID_TO_NPVARIANT (*result);
-    }
-    else
-        VOID_TO_NPVARIANT (*result);
-    return true;
+    thread_leave (previous);
+    return ret;
 }
 
-static bool
-Stack_getProperty (NPObject *npobj, NPIdentifier key, NPVariant *result)
+static void
+tuple_free (Tuple* tuple)
 {
-    if (!stack_getProperty (npobj, key, result))
-        VOID_TO_NPVARIANT (*result);
-    return true;
+    /* The data is in a garbage-collected heap.  */
+    if (tuple->code)
+        NPN_MemFree (tuple->code);
 }
 
-typedef struct _Root {
-    NPObject npobj;
-    NPObject* payload;
-    struct _Root** prev;
-    struct _Root* next;
-} Root;
+/* Return the object to give JavaScript in place of NPOBJ, taking over
+   the caller's reference.  An object with storage in the heap goes in
+   a Root, which keeps the storage from being collected until the
+   browser releases the Root.  Return null, having released NPOBJ, if
+   out of memory.  */
+static NPObject*
+retain_for_js (TopObject* top, NPObject* npobj)
+{
+    Root* root;
+
+    if (npobj->_class != &top->Tuple.npclass
+        && npobj->_class != &top->Stack.npclass)
+        return npobj;
+    root = (Root*) NPN_CreateObject (top->instance, &top->Root.npclass);
+    if (!root) {
+        NPN_ReleaseObject (npobj);
+        return 0;
+    }
+    root->payload = npobj;
+    root->next = top->thread->roots;
+    if (root->next)
+        root->next->prev = &root->next;
+    root->prev = &top->thread->roots;
+    top->thread->roots = root;
+    return &root->npobj;
+}
 
 static NPObject*
-Root_allocate (NPP npp, NPClass *aClass)
+Thread_allocate (NPP npp, NPClass *aClass)
 {
-    Root* ret = (Root*) NPN_MemAlloc (sizeof (Root));
+    Thread* ret = (Thread*) NPN_MemAlloc (sizeof (Thread));
 #if DEBUG_ALLOC
-    fprintf (stderr, "Root allocate %p\n", ret);
+    fprintf (stderr, "Thread allocate %p\n", ret);
 #endif  /* DEBUG_ALLOC */
     if (ret) {
         memset (ret, '\0', sizeof *ret);
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Root, aClass));
-        ret->payload = 0;
+        ret->gc_budget = GC_DEFAULT_BUDGET;
+        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Thread, aClass));
     }
     return (NPObject*) ret;
 }
 
 static void
-Root_deallocate (NPObject *npobj)
+Thread_deallocate (NPObject *npobj)
 {
-    Root* root = (Root*) npobj;
+    Thread* thr = (Thread*) npobj;
 #if DEBUG_ALLOC
-    fprintf (stderr, "Root deallocate %p\n", npobj);
+    fprintf (stderr, "Thread deallocate %p\n", npobj);
 #endif  /* DEBUG_ALLOC */
 
-    if (root->prev)
-        *root->prev = root->next;
-    if (root->next)
-        root->next->prev = root->prev;
+    if (thr->major)
+        gc_free (thr->major);
 
-    NPObject* payload = root->payload;
-    if (payload)
-        NPN_ReleaseObject (payload);
-    NPN_ReleaseObject ((NPObject*) &Root_getTop (npobj));
-    NPN_MemFree (npobj);
-}
+    /* Roots may outlive the heap, if the browser holds them.  Their
+       tuples become empty.  */
+    for (Root* root = thr->roots; root;) {
+        Root* next = root->next;
+        Tuple* payload = (Tuple*) root->payload;
 
-/* Forward all methods other than memory management to the payload object.  */
+        payload->start = payload->end = 0;
+        root->prev = 0;
+        root->next = 0;
+        root = next;
+    }
 
-static bool
-Root_hasMethod (NPObject *npobj, NPIdentifier name)
-{
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_HasMethod (top->instance, root->payload, name);
-}
-static bool
-Root_invoke (NPObject *npobj, NPIdentifier name,
-             const NPVariant *args, uint32_t argCount, NPVariant *result)
-{
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_Invoke (top->instance, root->payload, name, args, argCount,
-                       result);
+    for (Heap* heap = thr->heap; heap;) {
+        Heap* below = heap->below;
+
+        for (NPVariant* v = heap->end - heap->size; v < heap->pointer; v++)
+            NPN_ReleaseVariantValue (v);
+        NPN_MemFree (heap->end - heap->size);
+        NPN_MemFree (heap);
+        heap = below;
+    }
+    if (thr->free_big)
+        NPN_MemFree (thr->free_big);
+
+#if NPGMP_NURSERY
+    if (thr->nursery) {
+        Heap* heap = thr->nursery;
+        for (NPVariant* v = heap->end - heap->size; v < heap->pointer; v++)
+            NPN_ReleaseVariantValue (v);
+        NPN_MemFree (heap->end - heap->size);
+        NPN_MemFree (heap);
+    }
+    if (thr->remembered)
+        NPN_MemFree (thr->remembered);
+#endif
+
+    while (frame_leave (&thr->frame))
+        continue;
+
+    TopObject* top = Thread_getTop (npobj);
+    NPN_ReleaseObject ((NPObject*) top);
+    NPN_MemFree (npobj);
 }
+
 static bool
-Root_invokeDefault (NPObject *npobj,
-                    const NPVariant *args, uint32_t argCount, NPVariant *result)
+Thread_hasProperty(NPObject *npobj, NPIdentifier key)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_InvokeDefault (top->instance, root->payload, args, argCount,
-                              result);
+    NPUTF8* name;
+    bool found;
+
+    if (key == ID_gcBudget || key == ID_gcPauses || key == ID_sliceSteps
+        || key == ID_sliceTime || key == ID_suspended)
+        return true;
+    if (!NPN_IdentifierIsString (key))
+        return false;
+    name = NPN_UTF8FromIdentifier (key);
+    if (!name)
+        return false;
+    found = !!tfind (&name, &((Thread*) npobj)->tls, compare_properties);
+    NPN_MemFree (name);
+    return found;
 }
+
+/* thread.gcPauses[i] counts the collection pauses of under 2**i
+   microseconds, and the last element counts longer ones too.  */
 static bool
-Root_hasProperty (NPObject *npobj, NPIdentifier name)
+get_gc_pauses (Thread* thread, NPVariant* result)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_HasProperty (top->instance, root->payload, name);
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    Tuple* tuple = make_tuple (top, GC_PAUSE_BUCKETS);
+    NPObject* ret;
+
+    if (!tuple)
+        return false;
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++)
+        (void) out_size_t (top, thread->gc_pauses[i], &tuple->start[i]);
+    ret = retain_for_js (top, &tuple->npobj);
+    if (!ret)
+        return false;
+    OBJECT_TO_NPVARIANT (ret, *result);
+    return true;
 }
+
 static bool
-Root_getProperty (NPObject *npobj, NPIdentifier name, NPVariant *result)
+Thread_getProperty(NPObject *npobj, NPIdentifier key, NPVariant* result)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_GetProperty (top->instance, root->payload, name, result);
+    Thread* thread = (Thread*) npobj;
+
+    if (key == ID_gcBudget)
+        return out_size_t (Thread_getTop (npobj), thread->gc_budget, result);
+    if (key == ID_gcPauses)
+        return get_gc_pauses (thread, result);
+    if (key == ID_sliceSteps)
+        return out_size_t (Thread_getTop (npobj), thread->slice_steps, result);
+    if (key == ID_sliceTime)
+        return out_size_t (Thread_getTop (npobj), thread->slice_time, result);
+    if (key == ID_suspended)
+        return out_Bool (Thread_getTop (npobj), thread->suspended, result);
+    if (NPN_IdentifierIsString (key)) {
+        NPUTF8* name = NPN_UTF8FromIdentifier (key);
+        Property** found = 0;
+
+        if (name) {
+            found = (Property**) tfind (&name, &((Thread*) npobj)->tls,
+                                        compare_properties);
+            NPN_MemFree (name);
+        }
+        if (found)
+            return copy_npvariant (npobj, result, (*found)->value);
+    }
+    VOID_TO_NPVARIANT (*result);
+    return true;
 }
+
+/* Reject containers to avoid reference loops.  */
 static bool
-Root_setProperty (NPObject *npobj, NPIdentifier name, const NPVariant *value)
+allowed_in_heap (TopObject* top, const NPVariant* var)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_SetProperty (top->instance, root->payload, name, value);
+    NPObject* o;
+
+    if (!NPVARIANT_IS_OBJECT (*var))
+        return true;
+
+    o = NPVARIANT_TO_OBJECT (*var);
+    return (o->_class == &Opcode_npclass || IS_INSTANCE_OBJECT (top, o));
 }
+
 static bool
-Root_removeProperty (NPObject *npobj, NPIdentifier name)
+Thread_setProperty(NPObject *npobj, NPIdentifier key, const NPVariant* value)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_RemoveProperty (top->instance, root->payload, name);
+    /* thread.gcBudget = 0 makes each collection finish at once.  */
+    if (key == ID_gcBudget)
+        return in_size_t (Thread_getTop (npobj), value,
+                          &((Thread*) npobj)->gc_budget);
+    /* A run returns the thread after sliceSteps instructions or
+       sliceTime milliseconds, whichever comes first.  */
+    if (key == ID_sliceSteps)
+        return in_size_t (Thread_getTop (npobj), value,
+                          &((Thread*) npobj)->slice_steps);
+    if (key == ID_sliceTime)
+        return in_size_t (Thread_getTop (npobj), value,
+                          &((Thread*) npobj)->slice_time);
+    return false;  // XXX use tsearch
 }
+
 static bool
-Root_enumerate (NPObject *npobj, NPIdentifier **value, uint32_t *count)
+Thread_removeProperty(NPObject *npobj, NPIdentifier key)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_Enumerate (top->instance, root->payload, value, count);
+    return false;  // XXX use tdelete
 }
+
 static bool
-Root_construct (NPObject *npobj,
-                const NPVariant *args, uint32_t argCount, NPVariant *result)
+Thread_enumerate(NPObject *npobj, NPIdentifier **value, uint32_t *count)
 {
-    Root* root = (Root*) npobj;
-    TopObject* top = Root_getTop (npobj);
-    return NPN_Construct (top->instance, root->payload, args, argCount, result);
+    *count = 0;  // XXX use twalk
+    return true;
 }
 
+/*
+ * Class of the "op" object.
+ */
 
-typedef struct _Thread {
-    Stack stack;
-    Frame frame;
-    Heap* heap;
-    size_t alloc_since_gc;
-    size_t last_heap_size;  /* size in NPVariant structures */
-    Root* roots;            /* heap areas pointed to by JavaScript.  */
-    NPVariant* pc;
-    NPVariant* sp;
-    void* tls;              /* to be used with tsearch() */
-    Gc* gc;
-} Thread;
-
-static THREAD_LOCAL Thread* Current;
-
-typedef struct _Property {
-    NPUTF8* key;
-    NPVariant* value;
-} Property;
-
-static int
-compare_properties (const void* a1, const void* a2)
+static NPObject*
+Op_allocate (NPP npp, NPClass* aClass)
 {
-    const NPUTF8* s1 = ((Property*) a1)->key;
-    const NPUTF8* s2 = ((Property*) a2)->key;
-    return strcmp (s1, s2);
+    NPObject* ret = (NPObject*) NPN_MemAlloc (sizeof (NPObject));
+    if (ret)
+        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Op, aClass));
+        //NPN_RetainObject ((NPObject*) npp->pdata);
+    return ret;
 }
 
 static void
-mark (Gc* gcobj, NPVariant* start, NPVariant* end)
+Op_deallocate (NPObject *npobj)
 {
-    /* XXX do something */
+    TopObject* top = Op_getTop (npobj);
+#if DEBUG_ALLOC
+    fprintf (stderr, "Op deallocate %p; %u\n", npobj, (unsigned int) top->npobj.referenceCount);
+#endif  /* DEBUG_ALLOC */
+    top->npobjOp = 0;
+    NPN_MemFree (npobj);
+    /* Decrement the top object's reference count.  See comments in
+       Mpz_deallocate.  */
+    NPN_ReleaseObject ((NPObject*) top);
 }
 
-static void
-mark_root (const void *nodep, VISIT value, int level)
+static bool
+Op_hasMethod(NPObject *npobj, NPIdentifier name)
 {
-    if (value == leaf) {
-        NPVariant* var = ((const Property*) nodep)->value;
-        mark (Current->gc, var, var + 1);
-    }
+    return id_to_opnum (npobj, name) >= 0;
 }
 
-static void
-mark_stack (Gc* gcobj, const Stack* stack)
+static bool
+Op_enumerate(NPObject *npobj, NPIdentifier **value, uint32_t *count)
 {
-    if (stack) {
-        mark (gcobj, Segment_start (stack), Segment_end (stack));
-        mark_stack (gcobj, Segment_prev (stack));
-    }
+    *count = 0;
+    return true;  // XXX
+    //*count = NUM_OPS;
 }
 
-static void
-mark_object (Gc* gcobj, NPObject* object)
+static bool
+Op_invoke (NPObject *npobj, NPIdentifier name,
+            const NPVariant *args, uint32_t argCount, NPVariant *result)
 {
-    /* XXX do something */
+    int number;
+
+    number = id_to_opnum (npobj, name);
+    if (number < 0)
+        return number < -1;
+    /* if (argCount > 0) ...  should forbid arguments? */
+    OBJECT_TO_NPVARIANT (&Ops[number], *result);
+    return true;
 }
 
-static void
-gc (void)
+/* Return a script represented as function arguments.  */
+
+static bool
+Op_invokeDefault (NPObject* npobj,
+                  const NPVariant *args, uint32_t argCount, NPVariant *result)
 {
-    Heap* heap;
-    size_t nheaps = Current->heap->height + 1;
-    Heap* heaps[nheaps];
-    Gc gcobj = { heaps: heaps, nheaps: nheaps };
+    TopObject* top = Op_getTop (npobj);
+    Tuple* tuple;
+    NPObject* code;
 
-    for (heap = Current->heap; heap; heap = heap->below) {
-        memset (heap->markbits, '\0', ((heap->size + 7) / 8));
-        heaps[heap->height] = heap;
+    gc_safe_point (top);
+    for (uint32_t i = 0; i < argCount; i++) {
+        if (!allowed_in_heap (top, &args[i]))
+            return set_exception (npobj, "code includes a container", result,
+                                  true);
     }
 
-    for (Root* root = Current->roots; root; root = root->next)
-        mark_object (&gcobj, root->payload);
-
-    Current->gc = &gcobj;  /* twalk() deficiency */
-
-    mark (&gcobj, Current->pc, Current->frame.code->end);
-    for (Frame* frame = Current->frame.next; frame; frame = frame->next)
-        mark (&gcobj, frame->code->start, frame->code->end);
-
-    /* XXX should avoid marking the *contents* of positions between
-       thread->sp and the current segment's end. */
-    mark_stack (&gcobj, &Current->stack);
+    tuple = make_tuple (top, argCount);
+    if (!tuple)
+        return oom (npobj, result, true);
+    for (uint32_t i = 0; i < argCount; i++) {
+        if (!share_npvariant (npobj, &tuple->start[i], &args[i])) {
+            VOID_TO_NPVARIANT (*result);
+            NPN_ReleaseObject (&tuple->npobj);
+            return true;
+        }
+    }
 
-    twalk (Current->roots, mark_root);
+    code = retain_for_js (top, &tuple->npobj);
+    if (!code)
+        return oom (npobj, result, true);
+    OBJECT_TO_NPVARIANT (code, *result);
+    return true;
+}
 
-    /* XXX sweep/compact */
+/* Returns the number of valid stack elements, not beyond thread->sp.  */
+static size_t
+Thread_length (const Thread* thread)
+{
+    return Segment_height (&thread->stack) +
+        (thread->sp - Segment_start (&thread->stack));
 }
 
-static NPVariant*
-vector_alloc (uint32_t size)
+/* Push COUNT void elements on THREAD's stack.  The stack of a thread
+   is one segment, which moves to a bigger vector when full.  */
+static bool
+extend (Thread* thread, size_t count)
 {
-    Heap* heap;
-    Heap** abovep;
-    NPVariant* ret;
-    size_t avail, largest, alloc, min, max;
-
-    heap = Current->heap;
-    while (1) {
-
-        if (!heap || heap->largest < size) {
-            heap = Current->heap;
-            if (heap &&
-                Current->alloc_since_gc * 2 >  Current->last_heap_size && 
-                heap->avail                 >= size                    &&
-                Current->last_heap_size     >= size)
-            {
-                gc ();
-                Current->alloc_since_gc = 0;
-                continue;
-            }
-            break;
-        }
+    Stack* stack = &thread->stack;
+    NPVariant* start = Segment_start (stack);
+    size_t used = thread->sp - start;
+    size_t alloc;
+    NPVariant* grown;
 
-        avail = heap->end - heap->pointer;
+    if (LIKELY (count <= (size_t) (Segment_end (stack) - thread->sp))) {
+        thread->sp += count;
+        return true;
+    }
 
-        if (avail >= size) {
+    alloc = (used + count + SEGMENT_THRESHOLD + 15) &~ 15;
+    if (alloc < 2 * Segment_length (stack))
+        alloc = 2 * Segment_length (stack);
+    if (alloc < used || alloc != (uint32_t) alloc)
+        return false;
+    grown = vector_alloc (alloc);
+    if (!grown)
+        return false;
 
-            /* Success.  */
-            ret = heap->pointer;
-            heap->pointer += size;
+    /* The old vector is garbage, and must not release the values.  */
+    if (used) {
+        memcpy (grown, start, used * sizeof grown[0]);
+        memset (start, '\0', used * sizeof start[0]);
+    }
+    memset (grown + used, '\0', (alloc - used) * sizeof grown[0]);
+    Segment_init (stack, grown, grown + alloc, 0, 0, 0);
+    thread->sp = grown + used + count;
+    return true;
+}
 
-            largest = heap->largest;
-            if (largest < avail - size) {
-                largest = avail - size;
-                if (heap->below && heap->below->largest > largest)
-                    largest = heap->below->largest;
-            }
+/* Check that THREAD's stack holds at least COUNT elements.  */
+static inline bool
+need_args (Thread* thread, size_t count)
+{
+    if (LIKELY (count <= (size_t) (thread->sp - Segment_start (&thread->stack))))
+        return true;
+    raisef ((NPObject*) thread, "stack underflow");
+    return false;
+}
 
-            for (; heap; heap = heap->above) {
-                if (heap->largest <= largest) {
-                    if (heap->end - heap->pointer > largest)
-                        largest = heap->end - heap->pointer;
-                    heap->largest = largest;
-                }
-                heap->avail -= size;
-            }
+/* Splice out the top element of the (shared) previous segment. */
+static bool
+stack_drop_prev_elt (TopObject* top, Stack* stack)
+{
+    size_t pos = Segment_height (stack);
+    Stack* prev = Stack_substack (top, stack, pos - 1);
+    bool ret;
 
-            Current->alloc_since_gc += size;
-            return ret;
-        }
+    if (!prev)
+        return false;
 
-        heap = heap->below;
+    if (LIKELY (prev->segment == stack->segment - 1)) {
+        Stack** pprev = Segment_prev_ref (stack);
+        NPN_ReleaseObject ((NPObject*) *pprev);
+        *pprev = prev;
+        Segment_set_height (stack, Segment_height (stack) - 1);
+        return true;
     }
 
-    min = 1024;
-    max = 1024*1024;
-    alloc = min;
-    if (alloc < Current->last_heap_size * 4)
-        alloc = Current->last_heap_size * 4;
-    if (alloc > max)
-        alloc = max;
-    if (alloc < size)  /* XXX should this affect thread->last_heap_size? */
-        alloc = size;
-
-    heap = (Heap*) NPN_MemAlloc (sizeof *heap + ((alloc + 7) / 8));
-    if (!heap)
-        return 0;
+    Segment_clear (stack);
+    ret = Segment_set_prev (stack, prev);
+    NPN_ReleaseObject ((NPObject*) prev);
+    return ret;
+}
 
-    ret = (NPVariant*) NPN_MemAlloc (alloc * sizeof ret[0]);
+static NPVariant*
+peek_arg (Thread* thread, bool* shared)
+{
+    Stack* stack = &thread->stack;
+    const Stack* prev;
 
-    if (!ret) {
-        NPN_MemFree (heap);
+    if (thread->sp != Segment_start (stack)) {
+        *shared = false;
+        return thread->sp - 1;
+    }
+    if (stack->segment == 0) {
+        raisef ((NPObject*) thread, "stack underflow");
         return 0;
     }
-    memset (ret, '\0', alloc * sizeof ret[0]);
+    prev = Segment_prev (stack);
+    *shared = Segment_shared_p (prev);
+    return Segment_end (prev) - 1;
+}
 
-    Current->last_heap_size = alloc;
-    avail = alloc - size;
+/* Drop the top stack element when SP points to base of segment.  */
+static bool
+drop1 (Thread* thread)
+{
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    Stack* stack = &thread->stack;
+    Stack* prev;
 
-    heap->size    = alloc;
-    heap->end     = ret + alloc;
-    heap->pointer = ret + size;
-    heap->above   = 0;
+    assert (thread->sp == Segment_start (stack));
 
-    /* Move heap to its place in the list ordered by address.  */
-    abovep = &Current->heap;
-    while (*abovep && (*abovep)->end > heap->end) {
-        heap->above = *abovep;
-        (*abovep)->height++;
-        (*abovep)->avail += avail;
-        if ((*abovep)->largest < avail)
-            (*abovep)->largest = avail;
-        abovep = &(*abovep)->below;
+    if (stack->segment == 0) {
+        raisef ((NPObject*) thread, "stack underflow");
+        return false;
     }
-    heap->below = *abovep;
-    *abovep = heap;
+    prev = Segment_prev (stack);
+    assert (Segment_length (prev) > 0);
 
-    heap->largest = avail;
-    if (heap->below) {
-        heap->below->above = heap;
-        heap->height = heap->below->height + 1;
-        if (heap->below->largest > avail)
-            heap->largest = heap->below->largest;
-        heap->avail = avail + heap->below->avail;
+    if (Segment_shared_p (prev)) {
+        if (!stack_drop_prev_elt (top, stack)) {
+            raise_oom ((NPObject*) thread);
+            return false;
+        }
     }
     else {
-        heap->height = 0;
-        heap->avail = avail;
+        Segment_init (stack, Segment_start (prev), Segment_end (prev),
+                      Segment_height (prev), prev->segment,
+                      Segment_table (prev));
+        Segment_set_table (prev, 0);
+        NPN_ReleaseObject ((NPObject*) prev);
+        thread->sp = Segment_end (stack) - 1;
+        NPN_ReleaseVariantValue (thread->sp);
+        VOID_TO_NPVARIANT (*thread->sp);
     }
+    return true;
+}
 
-    Current->alloc_since_gc += size;
-
-    return ret;
+/* Drop the top stack element without releasing its variant value.  */
+static bool
+drop_uninit (Thread* thread)
+{
+    Stack* stack = &thread->stack;
+    if (thread->sp == Segment_start (stack))
+        return drop1 (thread);
+    thread->sp--;
+    VOID_TO_NPVARIANT (*thread->sp);
+    return true;
 }
 
-static NPVariant*
-tuple_alloc (uint32_t size)
+/* Move the element INDEX places below the index to the top.  */
+static bool
+op_roll (Thread* thread)
 {
-    return vector_alloc (size);
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    size_t index;
+    NPVariant* var;
+    NPVariant temp;
+
+    if (!need_args (thread, 1))
+        return false;
+    if (!in_size_t (top, thread->sp - 1, &index)) {
+        raisef ((NPObject*) thread, "expected stack index");
+        return false;
+    }
+    if (index + 2 > Thread_length (thread)) {
+        raisef ((NPObject*) thread, "stack bounds exceeded");
+        return false;
+    }
+    if (!need_args (thread, index + 2))
+        return false;
+
+    /* XXX Should move data only if size is below a threshold.  */
+    NPN_ReleaseVariantValue (--thread->sp);
+    VOID_TO_NPVARIANT (*thread->sp);
+    var = thread->sp - (index + 1);
+    temp = *var;
+    memmove (var, var + 1, index * sizeof var[0]);
+    thread->sp[-1] = temp;
+    return true;
 }
 
-static void
-tuple_free (Tuple* tuple)
+/*
+ * Arithmetic opcodes.  Each does the work of the mpz, mpq or mpf
+ * function of the same name, taking its operands from the top of the
+ * stack and replacing them with a new number from the instance's
+ * pools.  Operands of add, sub, mul and cmp must be of one type;
+ * addmul and divexact take integers; mul_2exp takes a number and a bit
+ * count.  The results of cmp and sgn are plain numbers.
+ */
+
+enum NumKind { NUM_NONE, NUM_MPZ, NUM_MPQ, NUM_MPF };
+
+typedef union _NumPtr {
+    mpz_ptr z;
+#if NPGMP_MPQ
+    mpq_ptr q;
+#endif
+#if NPGMP_MPF
+    mpf_ptr f;
+#endif
+} NumPtr;
+
+static enum NumKind
+in_num (TopObject* top, const NPVariant* var, NumPtr* arg)
 {
-    /* Nothing to do, data is in a garbage-collected heap.  */
+    if (in_mpz_ptr (top, var, &arg->z))
+        return NUM_MPZ;
+#if NPGMP_MPQ
+    if (in_mpq_ptr (top, var, &arg->q))
+        return NUM_MPQ;
+#endif
+#if NPGMP_MPF
+    if (in_mpf_ptr (top, var, &arg->f))
+        return NUM_MPF;
+#endif
+    return NUM_NONE;
 }
 
+/* Return a new number of type KIND in *RESULT and its value in *RET.
+   HINT is the expected size of an integer result, in limbs.  */
 static bool
-retain_for_js (TopObject* top, NPObject* npobj)
+new_num (TopObject* top, enum NumKind kind, size_t hint,
+         NPVariant* result, NumPtr* ret)
 {
-    Root* root = (Root*) NPN_CreateObject (top->instance, &top->Root.npclass);
-    if (!root)
+    NPObject* npobj;
+
+    switch (kind) {
+    case NUM_MPZ:
+        npobj = x_x_mpz (top, hint);
+        if (npobj)
+            ret->z = ((Integer*) npobj)->mp;
+        break;
+#if NPGMP_MPQ
+    case NUM_MPQ:
+        npobj = x_x_mpq (top);
+        if (npobj)
+            ret->q = rational_touch ((Rational*) npobj);
+        break;
+#endif
+#if NPGMP_MPF
+    case NUM_MPF:
+        npobj = x_x_mpf (top);
+        if (npobj)
+            ret->f = float_touch ((Float*) npobj);
+        break;
+#endif
+    default:
+        npobj = 0;
+    }
+    if (!npobj)
         return false;
-    root->payload = NPN_RetainObject (npobj);
-    root->next = Current->roots;
-    if (root->next)
-        root->next->prev = &root->next;
-    root->prev = &Current->roots;
-    Current->roots = root;
+    OBJECT_TO_NPVARIANT (npobj, *result);
     return true;
 }
 
-static NPObject*
-Thread_allocate (NPP npp, NPClass *aClass)
+static bool
+op_arith (Thread* thread, int opcode)
 {
-    Thread* ret = (Thread*) NPN_MemAlloc (sizeof (Thread));
-#if DEBUG_ALLOC
-    fprintf (stderr, "Thread allocate %p\n", ret);
-#endif  /* DEBUG_ALLOC */
-    if (ret) {
-        memset (ret, '\0', sizeof *ret);
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Thread, aClass));
-    }
-    return (NPObject*) ret;
-}
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    size_t nargs, hint;
+    NPVariant* args;
+    NPVariant out;
+    NumPtr a[3], r;
+    mp_bitcnt_t bits;
+    enum NumKind kind;
+    TopObject* owner;
+    bool ok;
 
-static void
-Thread_deallocate (NPObject *npobj)
-{
-    Thread* thr = (Thread*) npobj;
-#if DEBUG_ALLOC
-    fprintf (stderr, "Thread deallocate %p\n", npobj);
-#endif  /* DEBUG_ALLOC */
+    nargs = (opcode == OP_sgn ? 1 : opcode == OP_addmul ? 3 : 2);
+    if (UNLIKELY (!need_args (thread, nargs)))
+        return false;
+    args = thread->sp - nargs;
 
-    for (Heap* heap = thr->heap; heap;) {
-        for (NPVariant* v = heap->end - heap->size; v < heap->pointer; v++)
-            NPN_ReleaseVariantValue (v);
+    kind = in_num (top, &args[0], &a[0]);
+    ok = (kind != NUM_NONE);
+    if (opcode == OP_mul_2exp)
+        ok = ok && in_mp_bitcnt_t (top, &args[1], &bits);
+    else
+        for (size_t i = 1; ok && i < nargs; i++)
+            ok = (in_num (top, &args[i], &a[i]) == kind);
+    if (ok && kind != NUM_MPZ &&
+        (opcode == OP_addmul || opcode == OP_divexact))
+        ok = false;
+    if (!ok) {
+        raisef ((NPObject*) thread, "wrong argument type");
+        return false;
+    }
 
-        if (!heap->below) {
-            NPN_MemFree (heap);
+    if (opcode == OP_divexact && mpz_sgn (a[1].z) == 0) {
+        raisef ((NPObject*) thread, "division by zero");
+        return false;
+    }
+
+    if (opcode == OP_cmp || opcode == OP_sgn) {
+        int sign;
+        switch (kind) {
+        case NUM_MPZ:
+            sign = (opcode == OP_sgn ? mpz_sgn (a[0].z)
+                    : mpz_cmp (a[0].z, a[1].z));
+            break;
+#if NPGMP_MPQ
+        case NUM_MPQ:
+            sign = (opcode == OP_sgn ? mpq_sgn (a[0].q)
+                    : mpq_cmp (a[0].q, a[1].q));
+            break;
+#endif
+#if NPGMP_MPF
+        case NUM_MPF:
+            sign = (opcode == OP_sgn ? mpf_sgn (a[0].f)
+                    : mpf_cmp (a[0].f, a[1].f));
             break;
+#endif
+        default:
+            abort ();
         }
-        heap = heap->below;
-        NPN_MemFree (heap->above);
+        out_int (top, sign, &out);
     }
 
-    for (Frame* frame = thr->frame.next; frame; ) {
-        Frame* next = frame->next;
-        NPN_MemFree (frame);
-        if (!next)
+    else {
+        /* Size the result so that a recycled body rarely grows.  */
+        hint = 0;
+        if (kind == NUM_MPZ && opcode != OP_mul_2exp) {
+            hint = mpz_size (a[0].z) + mpz_size (a[1].z);
+            if (opcode == OP_addmul)
+                hint = mpz_size (a[0].z) + mpz_size (a[2].z) + 1;
+            else if (opcode == OP_add || opcode == OP_sub)
+                hint = ((mpz_size (a[0].z) > mpz_size (a[1].z)
+                         ? mpz_size (a[0].z) : mpz_size (a[1].z)) + 1);
+            else if (opcode == OP_divexact)
+                hint = (mpz_size (a[0].z) > mpz_size (a[1].z)
+                        ? mpz_size (a[0].z) - mpz_size (a[1].z) + 1 : 1);
+        }
+        if (!new_num (top, kind, hint, &out, &r))
+            return false;
+
+        owner = gmp_owner_enter (top);
+        switch (kind) {
+        case NUM_MPZ:
+            switch (opcode) {
+            case OP_add: mpz_add (r.z, a[0].z, a[1].z); break;
+            case OP_sub: mpz_sub (r.z, a[0].z, a[1].z); break;
+            case OP_mul: mpz_mul (r.z, a[0].z, a[1].z); break;
+            case OP_divexact: mpz_divexact (r.z, a[0].z, a[1].z); break;
+            case OP_mul_2exp: x_x_mpz_mul_2exp (top, r.z, a[0].z, bits); break;
+            case OP_addmul:
+                mpz_set (r.z, a[0].z);
+                mpz_addmul (r.z, a[1].z, a[2].z);
+                break;
+            }
             break;
-        frame = next;
+#if NPGMP_MPQ
+        case NUM_MPQ:
+            switch (opcode) {
+            case OP_add: mpq_add (r.q, a[0].q, a[1].q); break;
+            case OP_sub: mpq_sub (r.q, a[0].q, a[1].q); break;
+            case OP_mul: mpq_mul (r.q, a[0].q, a[1].q); break;
+            case OP_mul_2exp: mpq_mul_2exp (r.q, a[0].q, bits); break;
+            }
+            break;
+#endif
+#if NPGMP_MPF
+        case NUM_MPF:
+            switch (opcode) {
+            case OP_add: mpf_add (r.f, a[0].f, a[1].f); break;
+            case OP_sub: mpf_sub (r.f, a[0].f, a[1].f); break;
+            case OP_mul: mpf_mul (r.f, a[0].f, a[1].f); break;
+            case OP_mul_2exp: mpf_mul_2exp (r.f, a[0].f, bits); break;
+            }
+            break;
+#endif
+        default:
+            abort ();
+        }
+        gmp_owner_leave (owner);
+        quota_report (top, true, &out);
+        if (top->errmsg) {
+            NPN_ReleaseVariantValue (&out);
+            return false;
+        }
     }
 
-    TopObject* top = Thread_getTop (npobj);
-    NPN_ReleaseObject ((NPObject*) top);
-    NPN_MemFree (npobj);
+    /* Replace the operands with the result.  */
+    while (thread->sp != args)
+        NPN_ReleaseVariantValue (--thread->sp);
+    *thread->sp++ = out;
+    return true;
 }
 
-static bool
-Thread_hasProperty(NPObject *npobj, NPIdentifier key)
+/* Return TUPLE compiled for the interpreter, compiling it the first
+   time.  The instructions refer to the objects in TUPLE, and TUPLE can
+   not change, so the result lasts as long as TUPLE.  Return null if
+   out of memory or TUPLE ends in a quote.  */
+static Code*
+tuple_code (TopObject* top, Tuple* tuple)
 {
-    NPUTF8* name;
+    Code* code;
+    Insn* insn;
+    NPVariant temp;
 
-    if (!NPN_IdentifierIsString (key))
-        return false;
-    name = NPN_UTF8FromIdentifier (key);
-    return !!tfind (&name, &((Thread*) npobj)->tls, compare_properties);
-}
+    if (LIKELY (tuple->code != 0))
+        return tuple->code;
 
-static bool
-Thread_getProperty(NPObject *npobj, NPIdentifier key, NPVariant* result)
-{
-    if (NPN_IdentifierIsString (key)) {
-        NPUTF8* name = NPN_UTF8FromIdentifier (key);
-        Property* found = (Property*) tfind (&name, &((Thread*) npobj)->tls,
-                                             compare_properties);
-        if (found)
-            return copy_npvariant (npobj, result, found->value);
+    code = (Code*) NPN_MemAlloc (sizeof *code +
+                                 Tuple_length (tuple) * sizeof code->insn[0]);
+    if (!code) {
+        raise_oom ((NPObject*) top);
+        return 0;
     }
-    VOID_TO_NPVARIANT (*result);
-    return true;
-}
-
-/* Reject containers to avoid reference loops.  */
-static bool
-allowed_in_heap (TopObject* top, const NPVariant* var)
-{
-    NPObject* o;
-
-    if (!NPVARIANT_IS_OBJECT (*var))
-        return true;
 
-    o = NPVARIANT_TO_OBJECT (*var);
-    return (o->_class == &Opcode_npclass || IS_INSTANCE_OBJECT (top, o));
-}
+    insn = code->insn;
+    for (NPVariant* pc = tuple->start; pc < tuple->end; pc++, insn++) {
+        NPObject* fun;
 
-static bool
-Thread_setProperty(NPObject *npobj, NPIdentifier key, const NPVariant* value)
-{
-    return false;  // XXX use tsearch
-}
+        insn->kind = var_to_opcode (pc);
+        insn->nargs = insn->nret = 0;
 
-static bool
-Thread_removeProperty(NPObject *npobj, NPIdentifier key)
-{
-    return false;  // XXX use tdelete
-}
+        if (insn->kind == OP_quote) {
+            if (++pc == tuple->end) {
+                NPN_MemFree (code);
+                raisef ((NPObject*) top, "incomplete quotation");
+                return 0;
+            }
+            insn->kind = INSN_PUSH;
+            insn->u.literal = *pc;
+            continue;
+        }
+        if (insn->kind != OP_DATA)
+            continue;
 
-static bool
-Thread_enumerate(NPObject *npobj, NPIdentifier **value, uint32_t *count)
-{
-    *count = 0;  // XXX use twalk
-    return true;
-}
+        insn->kind = INSN_PUSH;
+        insn->u.literal = *pc;
+        if (!NPVARIANT_IS_OBJECT (*pc))
+            continue;
 
-/*
- * Class of the "op" object.
- */
+        fun = NPVARIANT_TO_OBJECT (*pc);
+        if (fun->_class == &top->Tuple.npclass) {
+            insn->kind = INSN_CALL_TUPLE;
+            insn->u.tuple = (Tuple*) fun;
+        }
+        else if (fun->_class == &top->Entry.npclass) {
+            insn->kind = INSN_CALL_ENTRY;
+            insn->u.fun = fun;
+            insn->nargs = Entry_length (fun);
+            insn->nret = Entry_outLength (fun);
+        }
+        else if (!IS_INSTANCE_OBJECT (top, fun)) {
+            size_t nargs;
+            bool ok = false;
 
-static NPObject*
-Op_allocate (NPP npp, NPClass* aClass)
-{
-    NPObject* ret = (NPObject*) NPN_MemAlloc (sizeof (NPObject));
-    if (ret)
-        NPN_RetainObject ((NPObject*) CONTAINING (TopObject, Op, aClass));
-        //NPN_RetainObject ((NPObject*) npp->pdata);
-    return ret;
-}
+            if (NPN_GetProperty (top->instance, fun, ID_length, &temp)) {
+                ok = in_size_t (top, &temp, &nargs) && nargs == (uint32_t) nargs;
+                NPN_ReleaseVariantValue (&temp);
+            }
+            if (!ok) {
+                NPN_MemFree (code);
+                raisef ((NPObject*) top, "can not find function arity");
+                return 0;
+            }
+            insn->kind = INSN_CALL;
+            insn->u.fun = fun;
+            insn->nargs = nargs;
+            insn->nret = 1;
+        }
+    }
 
-static void
-Op_deallocate (NPObject *npobj)
-{
-    TopObject* top = Op_getTop (npobj);
-#if DEBUG_ALLOC
-    fprintf (stderr, "Op deallocate %p; %u\n", npobj, (unsigned int) top->npobj.referenceCount);
-#endif  /* DEBUG_ALLOC */
-    top->npobjOp = 0;
-    NPN_MemFree (npobj);
-    /* Decrement the top object's reference count.  See comments in
-       Mpz_deallocate.  */
-    NPN_ReleaseObject ((NPObject*) top);
+    code->length = insn - code->insn;
+    tuple->code = code;
+    return code;
 }
 
-static bool
-Op_hasMethod(NPObject *npobj, NPIdentifier name)
+static inline const Insn*
+code_end (const Tuple* tuple)
 {
-    return id_to_opnum (npobj, name) >= 0;
+    return tuple->code->insn + tuple->code->length;
 }
 
+/* Make FRAME run CODE, saving the caller's state in a new frame unless
+   the call is in tail position.  KIND, BODY and COND are for the new
+   frame, which takes over the caller's references to BODY and COND.  */
 static bool
-Op_enumerate(NPObject *npobj, NPIdentifier **value, uint32_t *count)
+frame_enter (TopObject* top, Frame* frame, Tuple* code, int kind,
+             Tuple* body, Tuple* cond)
 {
-    *count = 0;
-    return true;  // XXX
-    //*count = NUM_OPS;
-}
+    Tuple* old = 0;
+    Frame* next;
 
-static bool
-Op_invoke (NPObject *npobj, NPIdentifier name,
-            const NPVariant *args, uint32_t argCount, NPVariant *result)
-{
-    int number;
+    if (UNLIKELY (!tuple_code (top, code)))
+        return false;
 
-    number = id_to_opnum (npobj, name);
-    if (number < 0)
-        return number < -1;
-    /* if (argCount > 0) ...  should forbid arguments? */
-    OBJECT_TO_NPVARIANT (&Ops[number], *result);
+    if (frame->ip == code_end (frame->code) && frame->kind == FRAME_CALL) {
+        /* Eliminate the tail call.  CODE may belong to the code that
+           the frame holds, so hold CODE before letting that go.  */
+        old = frame->body;
+        if (old && !body)
+            body = (Tuple*) NPN_RetainObject (&code->npobj);
+    }
+    else {
+        next = (Frame*) NPN_MemAlloc (sizeof (Frame));
+        if (!next) {
+            raise_oom ((NPObject*) top);
+            return false;
+        }
+        *next = *frame;
+        frame->next = next;
+    }
+    frame->code = code;
+    frame->ip   = code->code->insn;
+    frame->kind = kind;
+    frame->body = body;
+    frame->cond = cond;
+    if (old)
+        NPN_ReleaseObject (&old->npobj);
     return true;
 }
 
+/* Restart FRAME with CODE, already compiled.  */
+static inline void
+frame_jump (Frame* frame, Tuple* code, int kind)
+{
+    frame->code = code;
+    frame->ip   = code->code->insn;
+    frame->kind = kind;
+}
+
+/* Remove the top stack element.  */
 static bool
-ensure_stack (Thread* thread, size_t count)
+pop (Thread* thread)
 {
-    Stack* stack = &thread->stack;
-    size_t avail = Segment_end (stack) - thread->sp;
-
-    if (count > avail) {
-        
+    if (LIKELY (thread->sp != Segment_start (&thread->stack))) {
+        NPN_ReleaseVariantValue (--thread->sp);
+        VOID_TO_NPVARIANT (*thread->sp);  /* XXX Being careful. */
+        return true;
     }
-    NPVariant* newStack;
-    size_t want = init + count;
+    return drop1 (thread);
+}
+
+/* Pop the condition of a branch or loop into *YES.  Booleans, numbers,
+   and integers of any type are true unless false or zero.  */
+static bool
+pop_test (Thread* thread, bool* yes)
+{
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    NPVariant* var;
+    NumPtr num;
+    bool shared;
 
-    if (want < init)
+    var = peek_arg (thread, &shared);
+    if (!var)
         return false;
 
-    if (want > *palloc) {
-        while (init >= *palloc) {
-            if (*palloc * 2 < *palloc)
-                return false;
-            *palloc *= 2;
-        }
-        newStack = (NPVariant*) NPN_MemAlloc (*palloc * sizeof newStack[0]);
-        if (!newStack)
-            return false;
-        memcpy (newStack, *pstack, init * sizeof newStack[0]);
-        NPN_MemFree (*pstack);
-        *pstack = newStack;
+    if (NPVARIANT_IS_BOOLEAN (*var))
+        *yes = NPVARIANT_TO_BOOLEAN (*var);
+    else if (NPVARIANT_IS_INT32 (*var))
+        *yes = (NPVARIANT_TO_INT32 (*var) != 0);
+    else if (NPVARIANT_IS_DOUBLE (*var))
+        *yes = (NPVARIANT_TO_DOUBLE (*var) != 0);
+    else switch (in_num (top, var, &num)) {
+    case NUM_MPZ:
+        *yes = (mpz_sgn (num.z) != 0);
+        break;
+#if NPGMP_MPQ
+    case NUM_MPQ:
+        *yes = (mpq_sgn (num.q) != 0);
+        break;
+#endif
+#if NPGMP_MPF
+    case NUM_MPF:
+        *yes = (mpf_sgn (num.f) != 0);
+        break;
+#endif
+    default:
+        raisef ((NPObject*) thread, "expected a condition");
+        return false;
     }
-    return true;
+    return pop (thread);
 }
 
-/* Return a script represented as function arguments.  */
+/* Pop a quoted script and return it, retained.  */
+static Tuple*
+pop_tuple (Thread* thread)
+{
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    NPVariant* var;
+    NPObject* ret;
+    bool shared;
+
+    var = peek_arg (thread, &shared);
+    if (!var)
+        return 0;
+
+    if (!NPVARIANT_IS_OBJECT (*var) ||
+        NPVARIANT_TO_OBJECT (*var)->_class != &top->Tuple.npclass) {
+        raisef ((NPObject*) thread, "expected a quoted script");
+        return 0;
+    }
+    ret = NPN_RetainObject (NPVARIANT_TO_OBJECT (*var));
+    if (!pop (thread)) {
+        NPN_ReleaseObject (ret);
+        return 0;
+    }
+    return (Tuple*) ret;
+}
+
+/* Run the control-flow opcode OPCODE in FRAME.
 
+   cond [then] if            run then if cond is true
+   cond [then] [else] ifelse run then if cond is true, else else
+   [body] loop               run body, then repeat while it leaves true
+   [cond] [body] while       run cond, and while it leaves true, body
+
+   Each run of a loop begins at a safe point, so the collector sees
+   the whole loop through.  */
 static bool
-Op_invokeDefault (NPObject* npobj,
-                  const NPVariant *args, uint32_t argCount, NPVariant *result)
+op_control (Thread* thread, Frame* frame, int opcode)
 {
-    TopObject* top = Op_getTop (npobj);
-    Tuple* tuple;
+    TopObject* top = Thread_getTop ((NPObject*) thread);
+    Tuple* a = 0;
+    Tuple* b = 0;
+    bool yes;
 
-    for (uint32_t i = 0; i < argCount; i++) {
-        if (!allowed_in_heap (top, &args[i]))
-            return set_exception (npobj, "code includes a container", result,
-                                  true);
-    }
+    switch (opcode) {
 
-    tuple = make_tuple (top, argCount);
-    for (uint32_t i = 0; i < argCount; i++) {
-        if (!copy_npvariant (npobj, &tuple->start[i], &args[i])) {
-            VOID_TO_NPVARIANT (*result);
-            NPN_ReleaseObject (&tuple->npobj);
+    case OP_if:
+        a = pop_tuple (thread);
+        if (!a || !pop_test (thread, &yes))
+            break;
+        if (!yes) {
+            NPN_ReleaseObject (&a->npobj);
             return true;
         }
+        if (!frame_enter (top, frame, a, FRAME_CALL, a, 0))
+            break;
+        return true;
+
+    case OP_ifelse:
+        b = pop_tuple (thread);
+        if (b)
+            a = pop_tuple (thread);
+        if (!a || !pop_test (thread, &yes))
+            break;
+        if (!yes) {
+            Tuple* t = a;
+            a = b;
+            b = t;
+        }
+        NPN_ReleaseObject (&b->npobj);
+        b = 0;
+        if (!frame_enter (top, frame, a, FRAME_CALL, a, 0))
+            break;
+        return true;
+
+    case OP_loop:
+        a = pop_tuple (thread);
+        if (!a || !frame_enter (top, frame, a, FRAME_LOOP, a, 0))
+            break;
+        return true;
+
+    case OP_while:
+        b = pop_tuple (thread);
+        if (b)
+            a = pop_tuple (thread);
+        if (!a || !tuple_code (top, b)
+            || !frame_enter (top, frame, a, FRAME_TEST, b, a))
+            break;
+        return true;
+
+    default:
+        abort ();
     }
 
-    OBJECT_TO_NPVARIANT (&tuple->npobj, *result);
-    return true;
+    if (a)
+        NPN_ReleaseObject (&a->npobj);
+    if (b)
+        NPN_ReleaseObject (&b->npobj);
+    return false;
 }
 
-/* Returns the number of valid stack elements, not beyond thread->sp.  */
+/*
+ * Time slices.  A run stops after the thread's sliceSteps instructions
+ * or sliceTime milliseconds, or at a yield, and returns the thread in
+ * place of its results.  The frames and stack stay in the thread, and
+ * calling the thread, say from setTimeout, runs the next slice.
+ */
+
+/* Return how many instructions THREAD may run before slice_over.  */
 static size_t
-Thread_length (const Thread* thread)
+slice_next (const Thread* thread)
 {
-    return Segment_height (&thread->stack) +
-        (thread->sp - Segment_start (&thread->stack));
+    size_t ret = (thread->slice_steps ? thread->steps : (size_t) -1);
+
+    if (thread->slice_time && ret > SLICE_CLOCK_STEPS)
+        ret = SLICE_CLOCK_STEPS;
+    return ret;
 }
 
-static NPVariant*
-stack_get (const Stack* stack, size_t index, bool* shared)
-{
-    size_t length = stack->length;
-    assert (index < length);
-    while (!Segment_shared_p (stack)) {
-        length -= Segment_length (stack);
-        if (length <= index) {
-            *shared = false;
-            return Segment_start (stack) + (index - length);
-        }
-        stack = Segment_prev (stack);
-    }
-    *shared = true;
-    return Stack_ref (stack, index);
+static size_t
+slice_start (Thread* thread)
+{
+    thread->steps = thread->slice_steps;
+    if (thread->slice_time)
+        thread->slice_end = monotonic_us () + thread->slice_time * 1000.0;
+    return slice_next (thread);
 }
 
-/* Splice out the top element of the (shared) previous segment. */
+/* Charge THREAD's slice for RAN instructions.  Return true if the
+   slice is over, else set *NEXT as for slice_next.  */
 static bool
-stack_drop_prev_elt (TopObject* top, Stack* stack)
+slice_over (Thread* thread, size_t ran, size_t* next)
 {
-    size_t pos = Segment_height (stack);
-    const Stack* prev = Stack_substack (top, stack, pos - 1);
-    bool ret;
-
-    if (!prev)
-        return false;
-
-    if (LIKELY (prev->segment == stack->segment - 1)) {
-        const Stack** pprev = Segment_prev_ref (stack);
-        NPN_ReleaseObject ((NPObject*) *pprev);
-        *pprev = prev;
-        Segment_set_height (stack, Segment_height (stack) - 1);
-        return true;
+    if (thread->slice_steps) {
+        thread->steps -= ran;
+        if (thread->steps == 0)
+            return true;
     }
-
-    Segment_clear (stack);
-    ret = Segment_set_prev (stack, prev);
-    NPN_ReleaseObject ((NPObject*) prev);
-    return ret;
+    if (thread->slice_time && monotonic_us () >= thread->slice_end)
+        return true;
+    *next = slice_next (thread);
+    return false;
 }
 
+/* Stop THREAD's run until the thread is called, and return the
+   thread.  */
 static bool
-undef (NPVariant* result)
+thread_suspend (Thread* thread, NPVariant* result)
 {
-    VOID_TO_NPVARIANT (*result);
+    thread->suspended = true;
+    NPN_RetainObject ((NPObject*) thread);
+    OBJECT_TO_NPVARIANT ((NPObject*) thread, *result);
     return true;
 }
 
-static NPVariant*
-peek_arg (Thread* thread, bool* shared)
+/* Abandon THREAD's run after an error: leave every frame and empty the
+   stack.  */
+static void
+thread_unwind (Thread* thread)
 {
-    Stack* stack = &thread->stack;
-    const Stack* prev;
+    NPVariant* start = Segment_start (&thread->stack);
 
-    if (thread->sp != Segment_start (stack)) {
-        *shared = false;
-        return thread->sp - 1;
-    }
-    if (stack->segment == 0) {
-        raisef ((NPObject*) thread, "stack underflow");
-        return 0;
+    while (frame_leave (&thread->frame))
+        continue;
+    thread->frame.code = 0;
+    while (thread->sp > start) {
+        NPN_ReleaseVariantValue (--thread->sp);
+        VOID_TO_NPVARIANT (*thread->sp);
     }
-    prev = Segment_prev (stack);
-    *shared = Segment_shared_p (prev);
-    return Segment_end (prev) - 1;
 }
 
-/* Drop the top stack element when SP points to base of segment.  */
+static bool thread_run (TopObject* top, Thread* thread, NPObject* npobj,
+                        NPVariant* result);
+
+/* Run a script.  The arguments go on the stack, and the result is a
+   tuple of what the script leaves there.  */
+
 static bool
-drop1 (Thread* thread)
+Tuple_invokeDefault (NPObject* npobj,
+                     const NPVariant *args, uint32_t argCount,
+                     NPVariant *result)
 {
-    TopObject* top = Thread_getTop ((NPObject*) thread);
-    Stack* stack = &thread->stack;
-    bool shared;
-    NPVariant* var;
+    TopObject* top = Tuple_getTop (npobj);
+    Thread* thread = top->thread;
+    Frame* frame;
+    Thread* previous;
+    bool ret;
 
-    assert (thread->sp == Segment_start (stack));
+    if (!thread)
+        return throwf (npobj, result, true, "instance is destroyed");
+    if (thread->suspended)
+        return throwf (npobj, result, true,
+                       "thread is suspended; call it to resume");
+    if (thread->frame.code)
+        return throwf (npobj, result, true, "thread is running a script");
 
-    if (stack->segment == 0) {
-        raisef ((NPObject*) thread, "stack underflow");
-        return false;
+    for (uint32_t i = 0; i < argCount; i++) {
+        if (!allowed_in_heap (top, &args[i]))
+            return throwf (npobj, result, true, "argument is a container");
     }
-    prev = Segment_prev (stack);
-    assert (Segment_length (prev) > 0);
 
-    if (Segment_shared_p (prev)) {
-        if (!stack_drop_prev_elt (top, stack)) {
-            raise_oom ((NPObject*) thread);
-            return false;
-        }
+    gc_safe_point (top);
+    if (!tuple_code (top, (Tuple*) npobj))
+        return check_ex (top, npobj, result, true);
+
+    previous = thread_enter (thread);
+    if (!extend (thread, argCount)) {
+        thread_leave (previous);
+        return oom (npobj, result, true);
     }
-    else {
-        *stack = *prev;
-        Segment_set_table (prev, 0);
-        NPN_ReleaseObject ((NPObject*) prev);
-        thread->sp = Segment_end (stack) - 1;
-        NPN_ReleaseVariantValue (thread->sp);
-        VOID_TO_NPVARIANT (*thread->sp);
+
+    /* Copy args to stack.  */
+    for (uint32_t i = 0; i < argCount; i++) {
+        if (!share_npvariant (npobj, thread->sp - argCount + i, &args[i])) {
+            thread_unwind (thread);
+            thread_leave (previous);
+            return check_ex (top, npobj, result, true);
+        }
     }
-    return true;
+
+    /* The outermost frame holds its code, which JavaScript may drop
+       while the thread is suspended.  */
+    frame = &thread->frame;
+    frame->code = (Tuple*) npobj;
+    frame->ip = frame->code->code->insn;
+    frame->kind = FRAME_CALL;
+    frame->body = (Tuple*) NPN_RetainObject (npobj);
+    frame->cond = 0;
+    frame->next = 0;
+
+    ret = thread_run (top, thread, npobj, result);
+    thread_leave (previous);
+    return ret;
 }
 
-/* Drop the top stack element without releasing its variant value.  */
+/* Run the next slice of a suspended thread.  */
 static bool
-drop_uninit (Thread* thread)
+Thread_invokeDefault (NPObject* npobj,
+                      const NPVariant *args, uint32_t argCount,
+                      NPVariant *result)
 {
-    Stack* stack = &thread->stack;
-    if (thread->sp == Segment_start (stack))
-        return drop1 (thread);
-    thread->sp--;
-    VOID_TO_NPVARIANT (*thread->sp);
-    return true;
+    Thread* thread = (Thread*) npobj;
+    TopObject* top = Thread_getTop (npobj);
+    Thread* previous;
+    bool ret;
+
+    if (top->thread != thread)
+        return throwf (npobj, result, true, "instance is destroyed");
+    if (!thread->suspended)
+        return throwf (npobj, result, true, "thread is not suspended");
+
+    thread->suspended = false;
+    previous = thread_enter (thread);
+    ret = thread_run (top, thread, npobj, result);
+    thread_leave (previous);
+    return ret;
 }
 
+/* Call the gmp or JavaScript function of INSN with arguments from
+   THREAD's stack, and replace them with its results.  */
 static bool
-op_roll (Thread* thread)
+call_function (TopObject* top, Thread* thread, const Insn* insn)
 {
-    TopObject* top = Thread_getTop ((NPObject*) thread);
-    Stack* stack = &thread->stack;
-    Stack* seg;
-    size_t index, pos, ipos, len;
-    bool shared;
-    NPVariant* var;
-    NPVariant temp;
+    NPObject* npobj = (NPObject*) thread;
+    uint32_t nargs = insn->nargs;
+    uint32_t nret = insn->nret;
+    NPVariant out[nret + 1];
+    bool ok;
 
-    var = peek_arg (thread, &shared);
-    if (!var)
+    if (UNLIKELY (!need_args (thread, nargs)))
         return false;
 
-    if (!in_size_t (top, var, &index)) {
-        raisef ((NPObject*) thread, "expected stack index");
-        return false;
-    }
+    if (insn->kind == INSN_CALL_ENTRY) {
+        Entry* entry = (Entry*) insn->u.fun;
 
-    pos = Thread_length (thread);
-    if (index + 2 > pos) {
-        raisef ((NPObject*) thread, "stack bounds exceeded");
-        return false;
+        ok = enter (top, entry->number, thread->sp - nargs, out);
+        if (!ok)
+            raisef (npobj, "%s: %s", Entry_name (entry),
+                    top->errmsg ?: "wrong argument type");
+        else if (top->errmsg) {
+            /* The call raised an error after all.  */
+            for (uint32_t i = 0; i < nret; i++)
+                NPN_ReleaseVariantValue (&out[i]);
+            ok = false;
+        }
     }
+    else {
+        NPVariant args[nargs + 1];
+        uint32_t i;
 
-    ipos = pos - index - 2;  /* position of item to move to the top */
-    len = stack->length - Segment_length (stack);  /* top segment base pos */
-
-    if (ipos >= len) {
-        /* XXX Should move data only if size is below a threshold.  */
-        NPN_ReleaseVariantValue (--thread->sp);
-        var = thread->sp - (index + 2);
-        temp = *var;
-        memmove (var, var + 1, index * sizeof var[0]);
-        thread->sp[-1] = temp;
-        return true;
+        /* The browser gets strings and Roots, not our heap values.  */
+        for (i = 0; i < nargs; i++)
+            if (!copy_npvariant (npobj, &args[i], thread->sp - nargs + i))
+                break;
+        ok = (i == nargs);
+        /* XXX NPAPI does not report exceptions thrown.  */
+        if (ok && !NPN_InvokeDefault (top->instance, insn->u.fun,
+                                      args, nargs, &out[0])) {
+            raisef (npobj, "call failed");
+            ok = false;
+        }
+        while (i--)
+            NPN_ReleaseVariantValue (&args[i]);
+        if (ok && !allowed_in_heap (top, &out[0])) {
+            NPN_ReleaseVariantValue (&out[0]);
+            raisef (npobj, "function returned a container");
+            ok = false;
+        }
     }
+    if (!ok)
+        return false;
 
-    /* Slow path.  */
-    var = Stack_ref (pos - 2);
-    seg = Stack_prev (stack);
-
-    /* Pop the operand.  */
-    if (thread->sp != Segment_start (stack)) {
+    /* The function may have collected garbage, moving the stack, so
+       use thread->sp only now.  */
+    for (uint32_t i = 0; i < nargs; i++) {
         NPN_ReleaseVariantValue (--thread->sp);
+        VOID_TO_NPVARIANT (*thread->sp);
+    }
+    if (!extend (thread, nret)) {
+        for (uint32_t i = 0; i < nret; i++)
+            NPN_ReleaseVariantValue (&out[i]);
+        raise_oom (npobj);
+        return false;
     }
+    for (uint32_t i = 0; i < nret; i++) {
+        if (ok)
+            ok = share_npvariant (npobj, thread->sp - nret + i, &out[i]);
+        NPN_ReleaseVariantValue (&out[i]);
+    }
+    return ok;
+}
 
-    else if (!Segment_shared_p (seg)) {
-        NPVariant end = Segment_get_end (seg) - 1;
-        NPN_ReleaseVariantValue (end);
-        stack->length--;
+/* Move THREAD's stack, at the end of a run, into a tuple for
+   RESULT.  */
+static bool
+return_stack (TopObject* top, Thread* thread, NPObject* npobj,
+              NPVariant* result)
+{
+    NPVariant* start = Segment_start (&thread->stack);
+    size_t n = thread->sp - start;
+    Tuple* tuple = make_tuple (top, n);
+    NPObject* ret;
 
-        if (end == Segment_get_start (seg)) {
-            /* Discard empty segment.  */
-            NPN_MemFree (stack->table);
-            stack->table = seg->table;
-            stack->segment--;
-            seg->table = 0;
-            NPN_ReleaseObject ((NPObject*) seg);
-            seg = Stack_prev (stack);
-        }
-        else
-            Segment_set_end (seg, end);
+    if (!tuple) {
+        thread_unwind (thread);
+        return oom (npobj, result, true);
     }
-    XXX;
-    for (; !Segment_shared_p (seg); seg = Stack_wprev (seg)) {
-            size_t height = Segment_prev_len (seg);
-            size_t offset = (height < ipos ? ipos - height : 0);
-
+    if (n) {
+        memcpy (tuple->start, start, n * sizeof start[0]);
+        memset (start, '\0', n * sizeof start[0]);
     }
+    thread->sp = start;
+    for (size_t i = 0; i < n; i++)
+        if (NPVARIANT_IS_OBJECT (tuple->start[i]))
+            remember (top, &tuple->start[i]);
 
+    ret = retain_for_js (top, &tuple->npobj);
+    if (!ret)
+        return oom (npobj, result, true);
+    OBJECT_TO_NPVARIANT (ret, *result);
+    return true;
 }
 
-/* Run a script.  */
-
+/* Run THREAD's frames for a slice, reporting errors on NPOBJ.  */
 static bool
-Tuple_invokeDefault (NPObject* npobj,
-                     const NPVariant *args, uint32_t argCount,
-                     NPVariant *result)
+run_slice (TopObject* top, Thread* thread, NPObject* npobj,
+           NPVariant* result)
 {
-    TopObject* top = Tuple_getTop (npobj);
-    Thread* thread = Current;
     Stack* stack = &thread->stack;
     Frame* frame = &thread->frame;
-    enum Opcode opcode;
+    const Insn* insn;
     size_t pos;
-    const Stack* prev;
-    NPObject* fun;
-    bool isEntry;
-    size_t nargs, nret, needed;
     NPVariant* temp_ptr;
-    NPVariant temp;
     size_t index;
     bool shared;
-    Tuple* temp_tuple;
-    bool ok;
-
-    if (Segment_length (stack) < argCount + 1) {
-        size_t alloc = (SEGMENT_THRESHOLD + argCount + 15) &~ 15;
-        NPVariant* sp = vector_alloc (alloc);
+    size_t check, ran;
 
-        if (!sp)
-            /* XXX Could try allocating in segments for large argCount. */
-            return oom (npobj, result, true);
-
-        Segment_init (stack, sp, thread->sp + alloc, 0, 0, 0);
-        thread->sp = sp;
-    }
+    check = ran = slice_start (thread);
 
-    for (uint32_t i = 0; i < argCount; i++) {
-        if (!allowed_in_heap (top, &args[i]))
-            return throwf (npobj, result, true, "argument is a container");
-    }
+    for (;;) {
 
-    /* Copy args to stack.  */
-    for (uint32_t i = 0; i < argCount; i++) {
-        if (copy_npvariant (npobj, thread->sp, &args[i])) {
-            thread->sp++;
-            continue;
-        }
-        /* Error. */
-        while (i--) {
-            NPN_ReleaseVariantValue (--thread->sp);
-            VOID_TO_NPVARIANT (*thread->sp);
-        }
-        return check_ex (top, npobj, result, true);
-    }
+        /* Between instructions, every live vector is reachable.  */
+        gc_safe_point (top);
 
-    frame->code = (Tuple*) npobj;
-    frame->next = 0;
+        if (UNLIKELY (check == 0)) {
+            if (slice_over (thread, ran, &check))
+                return thread_suspend (thread, result);
+            ran = check;
+        }
+        check--;
 
-    for (frame->pc = frame->code->start; ; frame->pc++) {
+        if (frame->ip == code_end (frame->code)) {
+            bool yes;
 
-        if (frame->pc == frame->code->end) {
-            Frame next = frame->next;
-            if (!frame)
+            switch (frame->kind) {
+            case FRAME_BODY:
+                frame_jump (frame, frame->cond, FRAME_TEST);
+                continue;
+            case FRAME_LOOP:
+            case FRAME_TEST:
+                if (UNLIKELY (!pop_test (thread, &yes)))
+                    return check_ex (top, npobj, result, true);
+                if (yes) {
+                    frame_jump (frame, frame->body,
+                                frame->kind == FRAME_TEST ? FRAME_BODY
+                                : FRAME_LOOP);
+                    continue;
+                }
+                break;
+            }
+            if (!frame_leave (frame))
                 break;
-            *frame = *next;
-            NPN_MemFree (next);
             continue;
         }
 
-        opcode = var_to_opcode (frame->pc);
-        switch (opcode) {
+        insn = frame->ip++;
+        switch (insn->kind) {
 
         case OP_pick:
 
@@ -3801,8 +8636,8 @@ Tuple_invokeDefault (NPObject* npobj,
                 NPN_ReleaseVariantValue (temp_ptr);
                 VOID_TO_NPVARIANT (*temp_ptr);  /* XXX Being careful. */
             }
-            if (UNLIKELY (!copy_npvariant (npobj, temp_ptr,
-                                           Stack_ref (stack, pos - index - 2))))
+            if (UNLIKELY (!share_npvariant (npobj, temp_ptr,
+                                            Stack_ref (stack, pos - index - 2))))
                 return check_ex (top, npobj, result, true);
             continue;
 
@@ -3811,166 +8646,93 @@ Tuple_invokeDefault (NPObject* npobj,
                 return check_ex (top, npobj, result, true);
             continue;
 
+        case OP_add:
+        case OP_sub:
+        case OP_mul:
+        case OP_addmul:
+        case OP_cmp:
+        case OP_sgn:
+        case OP_divexact:
+        case OP_mul_2exp:
+            if (UNLIKELY (!op_arith (thread, insn->kind)))
+                return check_ex (top, npobj, result, true);
+            continue;
+
         case OP_drop:
-            if (LIKELY (thread->sp != Segment_start (stack))) {
-                NPN_ReleaseVariantValue (--thread->sp);
-                VOID_TO_NPVARIANT (*thread->sp);  /* XXX Being careful. */
-                continue;
-            }
-            if (UNLIKELY (!drop1 (thread)))
+            if (UNLIKELY (!pop (thread)))
                 return check_ex (top, npobj, result, true);
             continue;
 
-        case OP_quote:
-            if (UNLIKELY (!advance_pc (frame)))
-                return throwf (npobj, result, true, "incomplete quotation");
+        case OP_if:
+        case OP_ifelse:
+        case OP_loop:
+        case OP_while:
+            if (UNLIKELY (!op_control (thread, frame, insn->kind)))
+                return check_ex (top, npobj, result, true);
+            continue;
 
-            /* FALL THROUGH */
-        case OP_DATA:
+        case OP_yield:
+            return thread_suspend (thread, result);
 
-            /* Push data.  */
+        case INSN_PUSH:
             if (UNLIKELY (!extend (thread, 1)))
                 return oom (npobj, result, true);
 
-            if (UNLIKELY (!copy_npvariant (npobj, thread->sp - 1, frame->pc))) {
+            if (UNLIKELY (!share_npvariant (npobj, thread->sp - 1,
+                                            &insn->u.literal))) {
                 drop_uninit (thread);
                 return check_ex (top, npobj, result, true);
             }
-
             continue;
 
-        default:
-            break;
-        }
-
-        if (UNLIKELY (!NPVARIANT_IS_OBJECT (frame->pc)))
-            return throwf (npobj, result, true, "not a function");
-
-        fun = NPVARIANT_TO_OBJECT (frame->pc);
-
-        if (fun->_class == &top->Tuple.npclass) {
-            Tuple* tuple = (Tuple*) fun;
-            Frame* next;
-
-            frame->pc++;
-            if (frame->pc == frame->code->end) {
-                /* Eliminate the tail call.  */
-                frame->code = tuple;
-                continue;
-            }
-
-            next = (Frame*) NPN_MemAlloc (sizeof (Frame));
-            if (!next) {
-                frame->pc--;
-                return oom (npobj, result, true);
+        case INSN_CALL_TUPLE:
+            if (UNLIKELY (!frame_enter (top, frame, insn->u.tuple,
+                                        FRAME_CALL, 0, 0))) {
+                frame->ip--;
+                return check_ex (top, npobj, result, true);
             }
-            *next = *frame;
-            frame->next = next;
-            frame->code = tuple;
-            frame->pc   = frame->code->start;
             continue;
-        }
-
-        isEntry = (fun->_class == &top->Entry.npclass);
-        ok = false;
-
-        if (isEntry) {
-            nargs = Entry_length (fun);
-            nret = Entry_outLength (fun);
-            ok = true;
-        }
-        else if (NPN_GetProperty (top->instance, fun, ID_length, &temp)) {
-            ok = in_size_t (top, &temp, &nargs);
-            NPN_ReleaseVariantValue (&temp);
-            nret = 1;
-        }
 
-        if (!ok)
-            return throwf (npobj, result, true, "can not find function arity");
-
-        if (nret > nargs) {
-            needed = nret;
-            if (UNLIKELY (!extend (thread, nret - nargs)))
-                return oom (npobj, result, true);
-        }
-        else {
-            needed = nargs;
-        }
-
-        if (UNLIKELY (needed > thread->sp - Segment_start (stack)) &&
-            UNLIKELY (!Stack_join (stack, needed)))
-            return check_ex (top, npobj, result, true);
-
-        if (nret > nargs)
-            memset (thread->sp - (nret - nargs), '\0',
-                    (nret - nargs) * sizeof thread->sp[0]);
-
-        if (isEntry) {
-            if (UNLIKELY (!enter (top, ((Entry*) fun)->number,
-                                  thread->sp - nargs, nargs,
-                                  thread->sp - nargs))) {
-                /* XXX Where should sp point? */
+        case INSN_CALL_ENTRY:
+        case INSN_CALL:
+            if (UNLIKELY (!call_function (top, thread, insn)))
                 return check_ex (top, npobj, result, true);
-            }
-            if (nret > nargs)
-                XXX;  /* XXX can't use overlapping args+result buffers. */
-        }
-        else {
-            /* XXX NPAPI does not report exceptions thrown.  */
-            if (!NPN_InvokeDefault (top->instance, fun, thread->sp - needed,
-                                    nargs, &temp)) {
-                /* XXX Where should sp point? */
-            raisef (npobj, "call failed");
-            break;
-        }
-
-        /* XXX How can I know whether setexception was used?  Modify
-           it in sBrowserFuncs?  */
-
-        while (nargs--)
-            NPN_ReleaseVariantValue (&stack[--init]);
-
-        if (isEntry)
-            nargs = Entry_outLength (fun);
-        else
-            nargs = 1;
-
-        if (nargs == 0)
             continue;
 
-        if (!extend (&stack, &alloc, init, nargs)) {
-            raise_oom (npobj);
-            return check_ex (top, npobj, result, true);
-        }
-        if (nargs == 1)
-            stack[init++] = temp;
-        else {
-            temp_tuple = (Tuple*) NPVARIANT_TO_OBJECT (temp);
-            memcpy (&stack[init], temp_tuple->array, nargs * sizeof stack[0]);
-            init += nargs;
-            memset (temp_tuple->array, '\0', nargs * sizeof stack[0]);
-            NPN_ReleaseObject (&temp_tuple->npobj);
+        default:
+            abort ();
         }
     }
 
-    tuple = (Tuple*) NPN_CreateObject (top->instance, &top->Tuple.npclass);
+    frame->code = 0;
+    return return_stack (top, thread, npobj, result);
+}
 
-    if (tuple) {
-        tuple->array = thread->stack;
-        tuple->nelts = thread->sp - thread->stack;
-        retain_for_js (top, (NPObject*) tuple);
-        OPBJECT_TO_NPVARIANT (&tuple->npobj, *result);
-    }
-    else {
-        raisef (npobj, "tuple return unsupported");
-        return check_ex (top, npobj, result, true);
-    }
-    return true;
+/* Run THREAD for a slice, and abandon the run if it fails.  */
+static bool
+thread_run (TopObject* top, Thread* thread, NPObject* npobj,
+            NPVariant* result)
+{
+    bool ret = run_slice (top, thread, npobj, result);
+
+    if (!thread->suspended && thread->frame.code)
+        thread_unwind (thread);
+    return ret;
 }
 
 static void
 init_script ()
 {
+    ID_op = NPN_GetStringIdentifier ("op");
+    ID_thread = NPN_GetStringIdentifier ("thread");
+    ID_segment = NPN_GetStringIdentifier ("segment");
+    ID_previousSegment = NPN_GetStringIdentifier ("previousSegment");
+    ID_gcBudget = NPN_GetStringIdentifier ("gcBudget");
+    ID_gcPauses = NPN_GetStringIdentifier ("gcPauses");
+    ID_sliceSteps = NPN_GetStringIdentifier ("sliceSteps");
+    ID_sliceTime = NPN_GetStringIdentifier ("sliceTime");
+    ID_suspended = NPN_GetStringIdentifier ("suspended");
+
     for (size_t i = 0; i < NUM_OPS; i++) {
         Ops[i]._class = &Opcode_npclass;
         Ops[i].referenceCount = 0x7fffffff;
@@ -4021,21 +8783,48 @@ TopObject_allocate (NPP instance, NPClass *aClass)
         ret->Stack.npclass.hasMethod         = obj_id_false;
         ret->Stack.npclass.hasProperty       = Stack_hasProperty;
         ret->Stack.npclass.getProperty       = Stack_getProperty;
-        ret->Stack.npclass.setProperty       = Stack_setProperty;
-        ret->Stack.npclass.removeProperty    = Stack_removeProperty;
-        ret->Stack.npclass.enumerate         = Stack_enumerate;
- 
+        ret->Stack.npclass.setProperty       = setProperty_ro;
+        ret->Stack.npclass.removeProperty    = removeProperty_ro;
+        ret->Stack.npclass.enumerate         = enumerate_empty;
+
         ret->Thread.top                      = ret;
         ret->Thread.npclass.structVersion    = NP_CLASS_STRUCT_VERSION;
         ret->Thread.npclass.allocate         = Thread_allocate;
         ret->Thread.npclass.deallocate       = Thread_deallocate;
         ret->Thread.npclass.invalidate       = obj_invalidate;
         ret->Thread.npclass.hasMethod        = obj_id_false;
+        ret->Thread.npclass.invokeDefault    = Thread_invokeDefault;
         ret->Thread.npclass.hasProperty      = Thread_hasProperty;
         ret->Thread.npclass.getProperty      = Thread_getProperty;
         ret->Thread.npclass.setProperty      = Thread_setProperty;
         ret->Thread.npclass.removeProperty   = Thread_removeProperty;
         ret->Thread.npclass.enumerate        = Thread_enumerate;
+
+        ret->Op.top                          = ret;
+        ret->Op.npclass.structVersion        = NP_CLASS_STRUCT_VERSION;
+        ret->Op.npclass.allocate             = Op_allocate;
+        ret->Op.npclass.deallocate           = Op_deallocate;
+        ret->Op.npclass.invalidate           = obj_invalidate;
+        ret->Op.npclass.hasMethod            = Op_hasMethod;
+        ret->Op.npclass.invoke               = Op_invoke;
+        ret->Op.npclass.invokeDefault        = Op_invokeDefault;
+        ret->Op.npclass.hasProperty          = obj_id_false;
+        ret->Op.npclass.getProperty          = obj_id_var_void;
+        ret->Op.npclass.setProperty          = setProperty_ro;
+        ret->Op.npclass.removeProperty       = removeProperty_ro;
+        ret->Op.npclass.enumerate            = Op_enumerate;
+
+        ret->SharedString.top                     = ret;
+        ret->SharedString.npclass.structVersion   = NP_CLASS_STRUCT_VERSION;
+        ret->SharedString.npclass.allocate        = SharedString_allocate;
+        ret->SharedString.npclass.deallocate      = SharedString_deallocate;
+        ret->SharedString.npclass.invalidate      = obj_invalidate;
+        ret->SharedString.npclass.hasMethod       = obj_id_false;
+        ret->SharedString.npclass.hasProperty     = obj_id_false;
+        ret->SharedString.npclass.getProperty     = obj_id_var_void;
+        ret->SharedString.npclass.setProperty     = setProperty_ro;
+        ret->SharedString.npclass.removeProperty  = removeProperty_ro;
+        ret->SharedString.npclass.enumerate       = enumerate_empty;
 #endif
 
         ret->Entry.top                       = ret;
@@ -4080,6 +8869,32 @@ TopObject_allocate (NPP instance, NPClass *aClass)
         ret->Integer.npclass.setProperty     = setProperty_ro;
         ret->Integer.npclass.removeProperty  = removeProperty_ro;
         ret->Integer.npclass.enumerate       = enumerate_empty;
+
+        ret->Digits.top                      = ret;
+        ret->Digits.npclass.structVersion    = NP_CLASS_STRUCT_VERSION;
+        ret->Digits.npclass.allocate         = Digits_allocate;
+        ret->Digits.npclass.deallocate       = Digits_deallocate;
+        ret->Digits.npclass.invalidate       = obj_invalidate;
+        ret->Digits.npclass.hasMethod        = Digits_hasMethod;
+        ret->Digits.npclass.invoke           = Digits_invoke;
+        ret->Digits.npclass.hasProperty      = Digits_hasProperty;
+        ret->Digits.npclass.getProperty      = Digits_getProperty;
+        ret->Digits.npclass.setProperty      = setProperty_ro;
+        ret->Digits.npclass.removeProperty   = removeProperty_ro;
+        ret->Digits.npclass.enumerate        = enumerate_empty;
+
+        ret->Parser.top                      = ret;
+        ret->Parser.npclass.structVersion    = NP_CLASS_STRUCT_VERSION;
+        ret->Parser.npclass.allocate         = Parser_allocate;
+        ret->Parser.npclass.deallocate       = Parser_deallocate;
+        ret->Parser.npclass.invalidate       = obj_invalidate;
+        ret->Parser.npclass.hasMethod        = Parser_hasMethod;
+        ret->Parser.npclass.invoke           = Parser_invoke;
+        ret->Parser.npclass.hasProperty      = obj_id_false;
+        ret->Parser.npclass.getProperty      = obj_id_var_void;
+        ret->Parser.npclass.setProperty      = setProperty_ro;
+        ret->Parser.npclass.removeProperty   = removeProperty_ro;
+        ret->Parser.npclass.enumerate        = enumerate_empty;
 #endif  /* NPGMP_MPZ */
 
 #if NPGMP_MPQ
@@ -4161,6 +8976,16 @@ TopObject_deallocate (NPObject *npobj)
     }
 #endif
 
+#if NPGMP_MPZ
+    free_radix_powers (top);
+#endif
+    free_recycled (top);
+    free_pools (top);
+#if NPGMP_MEMORY && DEBUG_ALLOC
+    if (top->gmp_bytes)
+        fprintf (stderr, "TopObject deallocate %p: %lu GMP bytes leaked\n",
+                 npobj, (unsigned long) top->gmp_bytes);
+#endif
     free_errmsg (top->errmsg);
     NPN_MemFree (npobj);
 }
@@ -4168,12 +8993,36 @@ TopObject_deallocate (NPObject *npobj)
 static bool
 TopObject_hasProperty(NPObject *npobj, NPIdentifier key)
 {
+#if NPGMP_SCRIPT
+    if (key == ID_op || key == ID_thread)
+        return true;
+#endif
     return has_subproperty ((TopObject*) npobj, 0, key);
 }
 
 static bool
 TopObject_getProperty(NPObject *npobj, NPIdentifier key, NPVariant *result)
 {
+#if NPGMP_SCRIPT
+    TopObject* top = (TopObject*) npobj;
+
+    /* The "op" object lives while JavaScript holds it.  */
+    if (key == ID_op) {
+        if (top->npobjOp)
+            NPN_RetainObject (top->npobjOp);
+        else
+            top->npobjOp = NPN_CreateObject (top->instance, &top->Op.npclass);
+        if (!top->npobjOp)
+            return oom (npobj, result, true);
+        OBJECT_TO_NPVARIANT (top->npobjOp, *result);
+        return true;
+    }
+    if (key == ID_thread) {
+        OBJECT_TO_NPVARIANT (NPN_RetainObject ((NPObject*) top->thread),
+                             *result);
+        return true;
+    }
+#endif
     return get_subproperty ((TopObject*) npobj, 0, key, result);
 }
 
@@ -4205,6 +9054,854 @@ get_top (NPObject* npobj)
 }
 
 
+#if NPGMP_SELFTEST
+
+/*
+ * Self-checks.  A plug-in built with NPGMP_SELFTEST runs them when it
+ * creates an instance, and aborts if one fails.  They do not depend
+ * on assert(), so NDEBUG does not turn them off.
+ */
+
+#define SELFCHECK(cond) \
+    ((cond) ? (void) 0 : selfcheck_failed (__LINE__, # cond))
+
+static void
+selfcheck_failed (int line, const char* cond)
+{
+    fprintf (stderr, "npgmp.c:%d: self-check failed: %s\n", line, cond);
+    abort ();
+}
+
+#if NPGMP_SCRIPT
+
+/* Collect all of TOP's script heap at once, nursery first.  */
+static void
+check_collect (TopObject* top)
+{
+    Thread* previous = thread_enter (top->thread);
+
+    if (Current->major) {
+        gc_free (Current->major);
+        Current->major = 0;
+    }
+#if NPGMP_NURSERY
+    if (Current->nursery)
+        minor_gc ();
+#endif
+    if (Current->heap)
+        gc ();
+    thread_leave (previous);
+}
+
+/* Return a new tuple of SIZE elements whose first is ELT.  */
+static Tuple*
+check_tuple (TopObject* top, uint32_t size, NPObject* elt)
+{
+    Tuple* ret = make_tuple (top, size);
+
+    SELFCHECK (ret != 0);
+    OBJECT_TO_NPVARIANT (NPN_RetainObject (elt), ret->start[0]);
+    return ret;
+}
+
+/* The collector releases what an unreachable tuple holds, and keeps
+   what a Root holds, in small (young) and big vectors.  */
+static void
+check_gc (TopObject* top)
+{
+    static const uint32_t sizes[] = { 1, 1000 };
+    NPObject* lost_elt = x_x_mpz (top, 0);
+    NPObject* kept_elt = x_x_mpz (top, 0);
+
+    SELFCHECK (lost_elt && kept_elt);
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+        Tuple* lost = check_tuple (top, sizes[i], lost_elt);
+        Tuple* kept = check_tuple (top, sizes[i], kept_elt);
+        NPObject* root = retain_for_js (top, &kept->npobj);
+
+        SELFCHECK (root != 0);
+        NPN_ReleaseObject (&lost->npobj);
+        SELFCHECK (lost_elt->referenceCount == 2);
+
+        check_collect (top);
+        SELFCHECK (lost_elt->referenceCount == 1);
+        SELFCHECK (kept_elt->referenceCount == 2);
+        SELFCHECK (Tuple_length (kept) == sizes[i]);
+        SELFCHECK (NPVARIANT_IS_OBJECT (kept->start[0]) &&
+                   NPVARIANT_TO_OBJECT (kept->start[0]) == kept_elt);
+
+        NPN_ReleaseObject (root);
+        check_collect (top);
+        SELFCHECK (kept_elt->referenceCount == 1);
+    }
+    NPN_ReleaseObject (lost_elt);
+    NPN_ReleaseObject (kept_elt);
+}
+
+/* free_push and free_take keep runs of up to SMALL_VECTOR_MAX on
+   exact-size lists and give the best fitting longer run, splitting it,
+   and the sweep frees a dead vector below the allocation point for
+   reuse.  The check uses a new thread, whose lists start empty.  */
+static void
+check_free_lists (TopObject* top)
+{
+    Thread* saved = top->thread;
+    Thread* thread;
+    NPVariant buf[256];
+    NPObject* elt = x_x_mpz (top, 0);
+    Tuple* a;
+    Tuple* b;
+    NPObject* root;
+    NPVariant* hole;
+
+    SELFCHECK (elt != 0);
+    thread = (Thread*) NPN_CreateObject (top->instance, &top->Thread.npclass);
+    SELFCHECK (thread != 0);
+    memset (buf, '\0', sizeof buf);
+
+    free_push (thread, &buf[0], 5, true);
+    free_push (thread, &buf[10], 5, true);
+    SELFCHECK (thread->free_total == 10);
+    SELFCHECK (free_take (thread, 5) == &buf[10]);
+    SELFCHECK (free_take (thread, 5) == &buf[0]);
+    SELFCHECK (free_take (thread, 5) == 0);
+
+    free_push (thread, &buf[20], 100, true);
+    free_push (thread, &buf[150], 80, true);
+    SELFCHECK (thread->nfree_big == 2 && thread->free_total == 180);
+    SELFCHECK (free_take (thread, 70) == &buf[150]);
+    SELFCHECK (thread->nfree_big == 1 && thread->free_total == 110);
+    SELFCHECK (thread->free_small[10] == &buf[220]);
+    SELFCHECK (free_take (thread, 10) == &buf[220]);
+    SELFCHECK (free_take (thread, 101) == 0);
+    SELFCHECK (free_take (thread, 100) == &buf[20]);
+    SELFCHECK (thread->nfree_big == 0 && thread->free_total == 0);
+
+    /* Tuples use the new thread's heap until it is put back.  */
+    top->thread = thread;
+    a = check_tuple (top, 300, elt);
+    b = check_tuple (top, 300, elt);
+    root = retain_for_js (top, &b->npobj);
+    SELFCHECK (root != 0);
+    hole = a->start;
+    NPN_ReleaseObject (&a->npobj);
+    check_collect (top);
+    SELFCHECK (thread->nfree_big == 1 && thread->free_total == 300);
+    a = check_tuple (top, 300, elt);
+    SELFCHECK (a->start == hole && thread->free_total == 0);
+    SELFCHECK (NPVARIANT_TO_OBJECT (b->start[0]) == elt);
+    NPN_ReleaseObject (&a->npobj);
+    NPN_ReleaseObject (root);
+    top->thread = saved;
+
+    NPN_ReleaseObject ((NPObject*) thread);
+    SELFCHECK (elt->referenceCount == 1);
+    NPN_ReleaseObject (elt);
+}
+
+#if NPGMP_COMPACT
+
+/* Number the elements of TUPLE after the first from BASE.  */
+static void
+check_fill (Tuple* tuple, int32_t base)
+{
+    for (NPVariant* var = tuple->start + 1; var < tuple->end; var++)
+        INT32_TO_NPVARIANT (base + (int32_t) (var - tuple->start), *var);
+}
+
+static bool
+check_filled (const Tuple* tuple, int32_t base)
+{
+    for (const NPVariant* var = tuple->start + 1; var < tuple->end; var++)
+        if (!NPVARIANT_IS_INT32 (*var) ||
+            NPVARIANT_TO_INT32 (*var) != base + (int32_t) (var - tuple->start))
+            return false;
+    return true;
+}
+
+static size_t
+check_nheaps (TopObject* top)
+{
+    return (top->thread->heap ? top->thread->heap->height + 1 : 0);
+}
+
+/* Compaction empties and frees mostly unused heaps, and afterward the
+   moved vectors read as before, through a Root and through a tuple,
+   and new vectors do not overlap them.  */
+static void
+check_compact (TopObject* top)
+{
+    NPObject* elt = x_x_mpz (top, 0);
+    Tuple* outer;
+    Tuple* inner;
+    Tuple* fresh;
+    NPObject* root;
+    size_t nheaps;
+
+    SELFCHECK (elt != 0);
+    outer = check_tuple (top, 300, elt);
+    check_fill (outer, 1000);
+    root = retain_for_js (top, &outer->npobj);
+    SELFCHECK (root != 0);
+
+    /* Leave garbage in new heaps, with INNER among it.  */
+    while (check_nheaps (top) < 3)
+        NPN_ReleaseObject (&check_tuple (top, 3000, elt)->npobj);
+    inner = check_tuple (top, 300, elt);
+    check_fill (inner, 2000);
+    NPN_ReleaseVariantValue (&outer->start[0]);
+    OBJECT_TO_NPVARIANT (&inner->npobj, outer->start[0]);
+    remember (top, &outer->start[0]);
+    while (check_nheaps (top) < 5)
+        NPN_ReleaseObject (&check_tuple (top, 3000, elt)->npobj);
+
+    nheaps = check_nheaps (top);
+    check_collect (top);
+    SELFCHECK (check_nheaps (top) < nheaps);
+    SELFCHECK (Tuple_length (outer) == 300 && check_filled (outer, 1000));
+    SELFCHECK (NPVARIANT_IS_OBJECT (outer->start[0]) &&
+               NPVARIANT_TO_OBJECT (outer->start[0]) == &inner->npobj);
+    SELFCHECK (Tuple_length (inner) == 300 && check_filled (inner, 2000));
+    SELFCHECK (NPVARIANT_TO_OBJECT (inner->start[0]) == elt);
+    SELFCHECK (elt->referenceCount == 2);
+
+    fresh = check_tuple (top, 3000, elt);
+    check_fill (fresh, 3000);
+    SELFCHECK (check_filled (outer, 1000) && check_filled (inner, 2000));
+    NPN_ReleaseObject (&fresh->npobj);
+
+    NPN_ReleaseObject (root);
+    check_collect (top);
+    SELFCHECK (elt->referenceCount == 1);
+    NPN_ReleaseObject (elt);
+}
+
+#endif  /* NPGMP_COMPACT */
+
+#if NPGMP_NURSERY
+
+/* A young tuple stored only in an old one, with remember(), survives a
+   minor collection and moves out of the nursery.  */
+static void
+check_nursery (TopObject* top)
+{
+    NPObject* elt = x_x_mpz (top, 0);
+    Tuple* old;
+    Tuple* young;
+    NPObject* root;
+    Heap* nursery;
+    Thread* previous;
+
+    SELFCHECK (elt != 0);
+    old = check_tuple (top, NURSERY_MAX_VECTOR + 1, elt);
+    root = retain_for_js (top, &old->npobj);
+    SELFCHECK (root != 0);
+    young = check_tuple (top, 2, elt);
+    nursery = top->thread->nursery;
+    SELFCHECK (nursery && in_nursery (nursery, young->start));
+    SELFCHECK (!in_nursery (nursery, old->start));
+    INT32_TO_NPVARIANT (44, young->start[1]);
+
+    /* The old tuple takes over our reference.  */
+    OBJECT_TO_NPVARIANT (&young->npobj, old->start[1]);
+    remember (top, &old->start[1]);
+
+    previous = thread_enter (top->thread);
+    minor_gc ();
+    thread_leave (previous);
+    SELFCHECK (nursery->pointer == nursery->end - nursery->size);
+    SELFCHECK (NPVARIANT_TO_OBJECT (old->start[1]) == &young->npobj);
+    SELFCHECK (!in_nursery (nursery, young->start));
+    SELFCHECK (Tuple_length (young) == 2);
+    SELFCHECK (NPVARIANT_TO_OBJECT (young->start[0]) == elt);
+    SELFCHECK (NPVARIANT_IS_INT32 (young->start[1]) &&
+               NPVARIANT_TO_INT32 (young->start[1]) == 44);
+    SELFCHECK (elt->referenceCount == 3);
+
+    NPN_ReleaseObject (root);
+    check_collect (top);
+    SELFCHECK (elt->referenceCount == 1);
+    NPN_ReleaseObject (elt);
+}
+
+#endif  /* NPGMP_NURSERY */
+
+static NPVariant
+check_var (NPObject* npobj)
+{
+    NPVariant ret;
+    OBJECT_TO_NPVARIANT (npobj, ret);
+    return ret;
+}
+
+static NPVariant
+check_int (int32_t i)
+{
+    NPVariant ret;
+    INT32_TO_NPVARIANT (i, ret);
+    return ret;
+}
+
+#define CHECK_OP(op) check_var (&Ops[OP_ ## op])
+
+/* Return a new integer with value I.  */
+static NPVariant
+check_z (TopObject* top, long i)
+{
+    NPObject* npobj = x_x_mpz (top, 0);
+
+    SELFCHECK (npobj != 0);
+    mpz_set_si (((Integer*) npobj)->mp, i);
+    return check_var (npobj);
+}
+
+/* Return a new script of the N values in ELTS, taking over their
+   references.  */
+static Tuple*
+check_script (TopObject* top, uint32_t n, const NPVariant* elts)
+{
+    Tuple* ret = make_tuple (top, n);
+
+    SELFCHECK (ret != 0);
+    for (uint32_t i = 0; i < n; i++) {
+        ret->start[i] = elts[i];
+        if (NPVARIANT_IS_OBJECT (elts[i]))
+            remember (top, &ret->start[i]);
+    }
+    return ret;
+}
+
+/* Run SCRIPT without arguments, check that it leaves one value, and
+   return the value, which *RESULT holds.  */
+static NPVariant*
+check_result (TopObject* top, Tuple* script, NPVariant* result)
+{
+    Tuple* out;
+
+    SELFCHECK (Tuple_invokeDefault (&script->npobj, 0, 0, result));
+    SELFCHECK (NPVARIANT_IS_OBJECT (*result));
+    out = (Tuple*) ((Root*) NPVARIANT_TO_OBJECT (*result))->payload;
+    SELFCHECK (Tuple_length (out) == 1);
+    return &out->start[0];
+}
+
+/* Check that VAR is an integer, an mpz or a plain number, and return
+   it.  */
+static long
+check_integer (TopObject* top, const NPVariant* var)
+{
+    mpz_ptr z;
+
+    if (NPVARIANT_IS_INT32 (*var))
+        return NPVARIANT_TO_INT32 (*var);
+    SELFCHECK (in_mpz_ptr (top, var, &z));
+    return mpz_get_si (z);
+}
+
+/* Run SCRIPT without arguments, check that it leaves one integer, and
+   return the integer.  */
+static long
+check_run (TopObject* top, Tuple* script)
+{
+    NPVariant result;
+    long ret = check_integer (top, check_result (top, script, &result));
+
+    NPN_ReleaseVariantValue (&result);
+    return ret;
+}
+
+/* Return the script "7 [0 pick mul] 5 add", which leaves 54.  */
+static Tuple*
+check_square_script (TopObject* top)
+{
+    NPVariant square[] = { check_int (0), CHECK_OP (pick), CHECK_OP (mul) };
+    NPVariant script[] = {
+        check_z (top, 7), check_var (&check_script (top, 3, square)->npobj),
+        check_z (top, 5), CHECK_OP (add)
+    };
+    return check_script (top, 4, script);
+}
+
+/* tuple_code resolves literals, calls and quotations, and a script
+   gives the same result when it runs from its cached code as when it
+   is compiled for the run.  */
+static void
+check_code (TopObject* top)
+{
+    Tuple* script = check_square_script (top);
+    Tuple* fresh = check_square_script (top);
+    NPVariant quoted[] = { CHECK_OP (quote), CHECK_OP (add) };
+    Tuple* quote = check_script (top, 2, quoted);
+    Code* code;
+
+    SELFCHECK (!script->code);
+    code = tuple_code (top, script);
+    SELFCHECK (code && code->length == 4);
+    SELFCHECK (code->insn[0].kind == INSN_PUSH &&
+               NPVARIANT_TO_OBJECT (code->insn[0].u.literal) ==
+               NPVARIANT_TO_OBJECT (script->start[0]));
+    SELFCHECK (code->insn[1].kind == INSN_CALL_TUPLE &&
+               &code->insn[1].u.tuple->npobj ==
+               NPVARIANT_TO_OBJECT (script->start[1]));
+    SELFCHECK (code->insn[3].kind == OP_add);
+
+    SELFCHECK (check_run (top, script) == 54);
+    SELFCHECK (script->code == code);
+    SELFCHECK (check_run (top, script) == 54);
+    SELFCHECK (!fresh->code);
+    SELFCHECK (check_run (top, fresh) == 54);
+
+    code = tuple_code (top, quote);
+    SELFCHECK (code && code->length == 1);
+    SELFCHECK (code->insn[0].kind == INSN_PUSH &&
+               NPVARIANT_TO_OBJECT (code->insn[0].u.literal) == &Ops[OP_add]);
+
+    NPN_ReleaseObject (&script->npobj);
+    NPN_ReleaseObject (&fresh->npobj);
+    NPN_ReleaseObject (&quote->npobj);
+    check_collect (top);
+}
+
+/* The arithmetic opcodes leave the right results, and op_arith sizes
+   an integer result: of two recycled bodies, a product takes the one
+   big enough for it, not the most recently recycled.  */
+static void
+check_arith (TopObject* top)
+{
+    static const struct {
+        enum Opcode op;
+        long a, b, c, want;
+    } cases[] = {
+        { OP_add, 7, 5, 0, 12 },
+        { OP_sub, 7, 5, 0, 2 },
+        { OP_mul, -7, 5, 0, -35 },
+        { OP_addmul, 1, 2, 3, 7 },
+        { OP_cmp, 5, 7, 0, -1 },
+        { OP_sgn, -3, 0, 0, -1 },
+        { OP_divexact, 35, -5, 0, -7 },
+        { OP_mul_2exp, 3, 4, 0, 48 },
+    };
+    NPVariant elts[4], result, product, small;
+    NPVariant* var;
+    NPObject* fit;
+    Tuple* script;
+    mpz_ptr a, b;
+    mpz_t want;
+
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        uint32_t n = 0;
+        long got;
+
+        elts[n++] = check_z (top, cases[i].a);
+        if (cases[i].op == OP_mul_2exp)
+            elts[n++] = check_int (cases[i].b);
+        else if (cases[i].op != OP_sgn)
+            elts[n++] = check_z (top, cases[i].b);
+        if (cases[i].op == OP_addmul)
+            elts[n++] = check_z (top, cases[i].c);
+        elts[n++] = check_var (&Ops[cases[i].op]);
+        script = check_script (top, n, elts);
+        got = check_run (top, script);
+        if (cases[i].op == OP_cmp)
+            got = (got > 0) - (got < 0);
+        SELFCHECK (got == cases[i].want);
+        NPN_ReleaseObject (&script->npobj);
+    }
+
+    /* Multiply two 10-limb numbers.  */
+    elts[0] = check_z (top, 0);
+    elts[1] = check_z (top, 0);
+    elts[2] = CHECK_OP (mul);
+    SELFCHECK (in_mpz_ptr (top, &elts[0], &a) &&
+               in_mpz_ptr (top, &elts[1], &b));
+    mpz_setbit (a, 10 * GMP_NUMB_BITS - 1);
+    mpz_setbit (b, 10 * GMP_NUMB_BITS - 3);
+    mpz_init (want);
+    mpz_mul (want, a, b);
+    script = check_script (top, 3, elts);
+
+    /* Recycle a body that fits, then a small one.  */
+    free_recycled (top);
+    product = check_z (top, 0);
+    small = check_z (top, 0);
+    fit = NPVARIANT_TO_OBJECT (product);
+    mpz_setbit (((Integer*) fit)->mp, 30 * GMP_NUMB_BITS);
+    NPN_ReleaseVariantValue (&product);
+    NPN_ReleaseVariantValue (&small);
+
+    var = check_result (top, script, &result);
+    SELFCHECK (NPVARIANT_IS_OBJECT (*var) &&
+               NPVARIANT_TO_OBJECT (*var) == fit);
+    SELFCHECK (mpz_cmp (((Integer*) fit)->mp, want) == 0);
+    SELFCHECK (top->mpz_hint == 0);
+    NPN_ReleaseVariantValue (&result);
+    NPN_ReleaseObject (&script->npobj);
+    mpz_clear (want);
+    check_collect (top);
+}
+
+/* Equal strings that scripts keep share one SharedString, which goes
+   back to the browser as a string, and leaves the interning table
+   when released.  */
+static void
+check_strings (TopObject* top)
+{
+    NPObject* npobj = (NPObject*) top->thread;
+    NPVariant pi, pie, a, b, c, back;
+
+    STRINGN_TO_NPVARIANT ("pi", 2, pi);
+    STRINGN_TO_NPVARIANT ("pie", 3, pie);
+    SELFCHECK (share_npvariant (npobj, &a, &pi));
+    SELFCHECK (share_npvariant (npobj, &b, &pi));
+    SELFCHECK (share_npvariant (npobj, &c, &pie));
+    SELFCHECK (NPVARIANT_IS_OBJECT (a) && NPVARIANT_IS_OBJECT (c));
+    SELFCHECK (NPVARIANT_TO_OBJECT (a) == NPVARIANT_TO_OBJECT (b));
+    SELFCHECK (NPVARIANT_TO_OBJECT (a) != NPVARIANT_TO_OBJECT (c));
+
+    SELFCHECK (copy_npvariant (npobj, &back, &c));
+    SELFCHECK (NPVARIANT_IS_STRING (back) &&
+               NPVARIANT_TO_STRING (back).UTF8Length == 3 &&
+               !memcmp (NPVARIANT_TO_STRING (back).UTF8Characters, "pie", 3));
+    NPN_ReleaseVariantValue (&back);
+
+    NPN_ReleaseVariantValue (&a);
+    NPN_ReleaseVariantValue (&b);
+    NPN_ReleaseVariantValue (&c);
+    SELFCHECK (top->strings == 0);
+}
+
+/* Return a clone of VAR, which must share its limbs.  */
+static NPVariant
+check_clone (TopObject* top, const NPVariant* var)
+{
+    Variant arg = { top, var };
+    NPVariant ret = check_var (x_mpz_clone (arg));
+
+    SELFCHECK (((Integer*) NPVARIANT_TO_OBJECT (ret))->twin != 0);
+    return ret;
+}
+
+#define CHECK_MP(var) (((Integer*) NPVARIANT_TO_OBJECT (var))->mp)
+#define CHECK_TWIN(var) (((Integer*) NPVARIANT_TO_OBJECT (var))->twin)
+
+/* A clone keeps its value when another member of its ring is a
+   destination, and the last member to go recycles the body.  Swapping
+   clones moves them between rings and copies no limbs.  */
+static void
+check_clones (TopObject* top)
+{
+    NPVariant z = check_z (top, 0), c, d, e, w;
+    Variant va, vb;
+    mpz_ptr p;
+    mpz_t want;
+    NPObject* last;
+    size_t count;
+
+    mpz_init (want);
+    mpz_ui_pow_ui (want, 5, 1000);
+    mpz_set (CHECK_MP (z), want);
+    c = check_clone (top, &z);
+    SELFCHECK (CHECK_MP (c)->_mp_d == CHECK_MP (z)->_mp_d);
+    SELFCHECK (in_dest_mpz (top, &z, &p));
+    mpz_add_ui (p, p, 1);
+    SELFCHECK (CHECK_TWIN (z) == 0 && CHECK_TWIN (c) == 0);
+    SELFCHECK (mpz_cmp (CHECK_MP (c), want) == 0);
+    SELFCHECK (mpz_cmp (CHECK_MP (z), want) > 0);
+
+    /* Only the last of C, D and E recycles the body.  */
+    free_recycled (top);
+    d = check_clone (top, &c);
+    e = check_clone (top, &d);
+    last = NPVARIANT_TO_OBJECT (e);
+    NPN_ReleaseVariantValue (&c);
+    NPN_ReleaseVariantValue (&d);
+    SELFCHECK (top->recycled_mpz.count == 0);
+    SELFCHECK (CHECK_TWIN (e) == 0);
+    SELFCHECK (mpz_cmp (CHECK_MP (e), want) == 0);
+    NPN_ReleaseVariantValue (&e);
+    count = top->recycled_mpz.count;
+    SELFCHECK (count == 1 && top->recycled_mpz.body[count - 1] == last);
+
+    /* Swap A (with clone C) and Z (with clone D).  */
+    {
+        NPVariant a = check_z (top, 0);
+        mp_limb_t* limbs;
+
+        mpz_set (CHECK_MP (a), want);
+        c = check_clone (top, &a);
+        d = check_clone (top, &z);
+        limbs = CHECK_MP (z)->_mp_d;
+        va.top = vb.top = top;
+        va.arg = &a;
+        vb.arg = &z;
+        x_mpz_swap (va, vb);
+        SELFCHECK (!top->errmsg);
+        SELFCHECK (CHECK_MP (a)->_mp_d == limbs);
+        SELFCHECK (CHECK_TWIN (a) == (Integer*) NPVARIANT_TO_OBJECT (d));
+        SELFCHECK (CHECK_TWIN (d) == (Integer*) NPVARIANT_TO_OBJECT (a));
+        SELFCHECK (CHECK_TWIN (z) == (Integer*) NPVARIANT_TO_OBJECT (c));
+        SELFCHECK (mpz_cmp (CHECK_MP (z), want) == 0);
+        SELFCHECK (mpz_cmp (CHECK_MP (a), want) > 0);
+
+        /* Clones swap as a no-op, and a small number takes a place.  */
+        vb.arg = &d;
+        x_mpz_swap (va, vb);
+        SELFCHECK (!top->errmsg && CHECK_MP (a)->_mp_d == limbs);
+        w = check_z (top, 3);
+        vb.arg = &w;
+        x_mpz_swap (va, vb);
+        SELFCHECK (!top->errmsg);
+        SELFCHECK (CHECK_MP (w)->_mp_d == limbs && CHECK_TWIN (a) == 0);
+        SELFCHECK (CHECK_TWIN (d) == (Integer*) NPVARIANT_TO_OBJECT (w));
+        SELFCHECK (mpz_cmp_ui (CHECK_MP (a), 3) == 0);
+        NPN_ReleaseVariantValue (&a);
+        NPN_ReleaseVariantValue (&w);
+    }
+    SELFCHECK (CHECK_TWIN (d) == 0);
+    NPN_ReleaseVariantValue (&c);
+    NPN_ReleaseVariantValue (&d);
+    NPN_ReleaseVariantValue (&z);
+
+#if NPGMP_MPQ
+    /* Writing through a shared numerator leaves the clone alone, and
+       swapping Rationals moves ring places too.  */
+    {
+        NPVariant q = check_var (x_x_mpq (top)), qc, r, ref;
+        mpq_ptr qp;
+
+        SELFCHECK (in_dest_mpq (top, &q, &qp));
+        mpq_set_z (qp, want);
+        va.top = top;
+        va.arg = &q;
+        qc = check_var (x_mpq_clone (va));
+        ref = check_var (x_x_mpq_ref (top, mpq_numref (qp), qp));
+        SELFCHECK (in_dest_mpz (top, &ref, &p));
+        mpz_set_ui (p, 7);
+        SELFCHECK (mpz_cmp_ui (mpq_numref (qp), 7) == 0);
+        SELFCHECK (mpz_cmp (mpq_numref (((Rational*)
+                                         NPVARIANT_TO_OBJECT (qc))->mp),
+                            want) == 0);
+        NPN_ReleaseVariantValue (&ref);
+
+        va.arg = &qc;
+        NPN_ReleaseVariantValue (&q);
+        q = check_var (x_mpq_clone (va));
+        r = check_var (x_x_mpq (top));
+        vb.top = top;
+        vb.arg = &r;
+        va.arg = &q;
+        x_mpq_swap (va, vb);
+        SELFCHECK (!top->errmsg);
+        SELFCHECK (((Rational*) NPVARIANT_TO_OBJECT (q))->twin == 0);
+        SELFCHECK (((Rational*) NPVARIANT_TO_OBJECT (r))->twin
+                   == (Rational*) NPVARIANT_TO_OBJECT (qc));
+        SELFCHECK (mpz_cmp (mpq_numref (((Rational*)
+                                         NPVARIANT_TO_OBJECT (r))->mp),
+                            want) == 0);
+        NPN_ReleaseVariantValue (&q);
+        NPN_ReleaseVariantValue (&qc);
+        NPN_ReleaseVariantValue (&r);
+    }
+#endif
+    mpz_clear (want);
+}
+
+/* Return a quoted script of the N values in ELTS.  */
+static NPVariant
+check_quote (TopObject* top, uint32_t n, const NPVariant* elts)
+{
+    return check_var (&check_script (top, n, elts)->npobj);
+}
+
+/* Return the result of running the N values in ELTS as a script.  */
+static long
+check_eval (TopObject* top, uint32_t n, const NPVariant* elts)
+{
+    Tuple* script = check_script (top, n, elts);
+    long ret = check_run (top, script);
+
+    NPN_ReleaseObject (&script->npobj);
+    return ret;
+}
+
+/* Return the quoted loop body "0 pick 2 roll add 1 roll 1 sub", which
+   adds a counter to a sum below it and counts down, followed if LOOP_P
+   by "0 pick", to leave the loop condition.  */
+static NPVariant
+check_sum_body (TopObject* top, bool loop_p)
+{
+    NPVariant body[] = {
+        check_int (0), CHECK_OP (pick), check_int (2), CHECK_OP (roll),
+        CHECK_OP (add), check_int (1), CHECK_OP (roll),
+        check_z (top, 1), CHECK_OP (sub), check_int (0), CHECK_OP (pick)
+    };
+    return check_quote (top, loop_p ? 11 : 9, body);
+}
+
+/* The branch and loop opcodes run the right code, the caller's code
+   continues after each, and a failed run leaves the thread empty and
+   ready for the next.  */
+static void
+check_control (TopObject* top)
+{
+    Thread* thread = top->thread;
+    NPVariant result;
+    Tuple* script;
+
+    for (int32_t yes = 0; yes < 2; yes++) {
+        NPVariant add2[] = { check_z (top, 2), CHECK_OP (add) };
+        NPVariant branch[] = {
+            check_z (top, 5), check_int (yes),
+            CHECK_OP (quote), check_quote (top, 2, add2), CHECK_OP (if)
+        };
+        NPVariant then[] = { check_z (top, 1) };
+        NPVariant otherwise[] = { check_z (top, 2) };
+        NPVariant choice[] = {
+            check_int (yes),
+            CHECK_OP (quote), check_quote (top, 1, then),
+            CHECK_OP (quote), check_quote (top, 1, otherwise),
+            CHECK_OP (ifelse)
+        };
+
+        SELFCHECK (check_eval (top, 5, branch) == (yes ? 7 : 5));
+        SELFCHECK (check_eval (top, 6, choice) == (yes ? 1 : 2));
+    }
+
+    {
+        NPVariant loop[] = {
+            check_z (top, 0), check_z (top, 10),
+            CHECK_OP (quote), check_sum_body (top, true),
+            CHECK_OP (loop), CHECK_OP (drop)
+        };
+        SELFCHECK (check_eval (top, 6, loop) == 55);
+    }
+
+    /* A while whose body never runs, and one whose body runs often.  */
+    for (long n = 0; n <= 3000; n += 3000) {
+        NPVariant cond[] = { check_int (0), CHECK_OP (pick) };
+        NPVariant whilst[] = {
+            check_z (top, 0), check_z (top, n),
+            CHECK_OP (quote), check_quote (top, 2, cond),
+            CHECK_OP (quote), check_sum_body (top, false),
+            CHECK_OP (while), CHECK_OP (drop)
+        };
+        SELFCHECK (check_eval (top, 8, whilst) == n * (n + 1) / 2);
+    }
+
+    {
+        NPVariant bad[] = { check_int (1), check_int (2), CHECK_OP (if) };
+        script = check_script (top, 3, bad);
+        SELFCHECK (Tuple_invokeDefault (&script->npobj, 0, 0, &result));
+        SELFCHECK (NPVARIANT_IS_VOID (result));
+        SELFCHECK (!thread->frame.code && !thread->frame.next);
+        SELFCHECK (thread->sp == Segment_start (&thread->stack));
+        NPN_ReleaseObject (&script->npobj);
+    }
+    check_collect (top);
+}
+
+/* Run SCRIPT, resuming it until it finishes, and return its result as
+   for check_run.  Set *SLICES to the number of slices it took.  */
+static long
+check_slices (TopObject* top, Tuple* script, size_t* slices)
+{
+    NPObject* thread = (NPObject*) top->thread;
+    NPVariant result;
+    NPVariant again;
+    Tuple* out;
+    long ret;
+
+    SELFCHECK (Tuple_invokeDefault (&script->npobj, 0, 0, &result));
+    for (*slices = 1; NPVARIANT_IS_OBJECT (result) &&
+             NPVARIANT_TO_OBJECT (result) == thread; ++*slices) {
+        SELFCHECK (top->thread->suspended);
+        SELFCHECK (Tuple_invokeDefault (&script->npobj, 0, 0, &again));
+        SELFCHECK (NPVARIANT_IS_VOID (again));  /* "thread is suspended" */
+        NPN_ReleaseVariantValue (&result);
+        SELFCHECK (Thread_invokeDefault (thread, 0, 0, &result));
+    }
+    SELFCHECK (!top->thread->suspended && !top->thread->frame.code);
+    SELFCHECK (NPVARIANT_IS_OBJECT (result));
+    out = (Tuple*) ((Root*) NPVARIANT_TO_OBJECT (result))->payload;
+    SELFCHECK (Tuple_length (out) == 1);
+    ret = check_integer (top, &out->start[0]);
+    NPN_ReleaseVariantValue (&result);
+    return ret;
+}
+
+/* A run stops at a yield, after sliceSteps instructions, or after
+   sliceTime milliseconds, and calling the thread resumes it where it
+   stopped.  */
+static void
+check_threads (TopObject* top)
+{
+    Thread* thread = top->thread;
+    NPVariant yield[] = {
+        check_z (top, 1), CHECK_OP (yield), check_z (top, 2), CHECK_OP (add)
+    };
+    NPVariant loop[] = {
+        check_z (top, 0), check_z (top, 1000),
+        CHECK_OP (quote), check_sum_body (top, true),
+        CHECK_OP (loop), CHECK_OP (drop)
+    };
+    NPVariant long_loop[] = {
+        check_z (top, 0), check_z (top, 60000),
+        CHECK_OP (quote), check_sum_body (top, true),
+        CHECK_OP (loop), CHECK_OP (drop)
+    };
+    Tuple* yielder = check_script (top, 4, yield);
+    Tuple* summer = check_script (top, 6, loop);
+    Tuple* long_summer = check_script (top, 6, long_loop);
+    size_t slices;
+
+    SELFCHECK (check_slices (top, yielder, &slices) == 3 && slices == 2);
+    SELFCHECK (check_slices (top, summer, &slices) == 500500 && slices == 1);
+
+    thread->slice_steps = 1000;
+    SELFCHECK (check_slices (top, summer, &slices) == 500500);
+    SELFCHECK (slices > 10 && slices < 20);
+    thread->slice_steps = 0;
+
+    /* Some 800,000 instructions take more than a millisecond.  */
+    thread->slice_time = 1;
+    SELFCHECK (check_slices (top, long_summer, &slices) == 1800030000);
+    SELFCHECK (slices > 1);
+    thread->slice_time = 0;
+
+    NPN_ReleaseObject (&yielder->npobj);
+    NPN_ReleaseObject (&summer->npobj);
+    NPN_ReleaseObject (&long_summer->npobj);
+    check_collect (top);
+}
+
+#endif  /* NPGMP_SCRIPT */
+
+static void
+selftest (TopObject* top)
+{
+#if NPGMP_SCRIPT
+    check_gc (top);
+    check_free_lists (top);
+    check_strings (top);
+    check_clones (top);
+#endif
+#if NPGMP_COMPACT
+    check_compact (top);
+#endif
+#if NPGMP_NURSERY
+    check_nursery (top);
+#endif
+#if NPGMP_SCRIPT
+    check_code (top);
+    check_arith (top);
+    check_control (top);
+    check_threads (top);
+#endif
+}
+
+#endif  /* NPGMP_SELFTEST */
+
+
 /*
  * NPAPI plug-in entry points.
  */
@@ -4213,6 +9910,10 @@ static NPError
 npp_New(NPMIMEType pluginType, NPP instance, uint16_t mode,
         int16_t argc, char* argn[], char* argv[], NPSavedData* saved)
 {
+#if NPGMP_SCRIPT
+    TopObject* top;
+#endif
+
     /* Make this a windowless plug-in.  This makes Chrome happy.  */
     NPN_SetValue (instance, NPPVpluginWindowBool, (void*) false);
 
@@ -4222,13 +9923,18 @@ npp_New(NPMIMEType pluginType, NPP instance, uint16_t mode,
         return NPERR_OUT_OF_MEMORY_ERROR;
 
 #if NPGMP_SCRIPT
-    thread = (Thread*) NPN_CreateObject
-        (instance, &((TopObject*) instance->pdata)->npclassThread);
-    if (!thread) {
-        NPN_ReleaseObject ((NPObject*) instance->pdata);
+    /* The thread refers to the top object, see npp_Destroy.  */
+    top = (TopObject*) instance->pdata;
+    top->thread = (Thread*) NPN_CreateObject (instance, &top->Thread.npclass);
+    if (!top->thread) {
+        NPN_ReleaseObject ((NPObject*) top);
+        instance->pdata = 0;
         return NPERR_OUT_OF_MEMORY_ERROR;
     }
 #endif
+#if NPGMP_SELFTEST
+    selftest ((TopObject*) instance->pdata);
+#endif
 
     return NPERR_NO_ERROR;
 }
@@ -4241,8 +9947,20 @@ npp_Destroy(NPP instance, NPSavedData** save) {
 #endif  /* DEBUG_ALLOC */
     instance->pdata = 0;
     if (top) {
-        NPN_ReleaseObject ((NPObject*) top);
         top->destroying = true;
+#if NPGMP_MPZ
+        /* Constants refer to TOP, so it cannot free them.  */
+        free_constants (top);
+#endif
+#if NPGMP_SCRIPT
+        /* Likewise the thread, which holds the script heap.  */
+        if (top->thread) {
+            NPObject* thread = (NPObject*) top->thread;
+            top->thread = 0;
+            NPN_ReleaseObject (thread);
+        }
+#endif
+        NPN_ReleaseObject ((NPObject*) top);
     }
     return NPERR_NO_ERROR;
 }
@@ -4279,10 +9997,21 @@ NP_Initialize(NPNetscapeFuncs* bFuncs, NPPluginFuncs* pFuncs)
 
     ID_toString = NPN_GetStringIdentifier ("toString");
     ID_length   = NPN_GetStringIdentifier ("length");
+    ID_next     = NPN_GetStringIdentifier ("next");
+    ID_exponent = NPN_GetStringIdentifier ("exponent");
+    ID_feed     = NPN_GetStringIdentifier ("feed");
+    ID_finish   = NPN_GetStringIdentifier ("finish");
 
 #if NPGMP_SCRIPT
     init_script ();
 #endif
+#if NPGMP_MEMORY
+    /* After an NP_Shutdown that left blocks live, ours are still in.  */
+    if (!ATOMIC_CAS (&LimbShutdown, true, false)) {
+        mp_get_memory_functions (&SavedAlloc, &SavedRealloc, &SavedFree);
+        mp_set_memory_functions (gmp_alloc, gmp_realloc, gmp_free);
+    }
+#endif
 
     return NPERR_NO_ERROR;
 }
@@ -4318,5 +10047,12 @@ NP_GetValue(void* future, NPPVariable aVariable, void* aValue) {
 NP_EXPORT(NPError)
 NP_Shutdown()
 {
+#if NPGMP_MEMORY
+    /* Blocks may outlive the instances, say in other GMP users in the
+       process, so wait for the last to be freed.  */
+    LimbShutdown = true;
+    if (LimbLive == 0 && ATOMIC_CAS (&LimbShutdown, true, false))
+        limb_release ();
+#endif
     return NPERR_NO_ERROR;
 }